@@ -6,20 +6,83 @@
 
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 
 
-#define USE_PATCHED_GUID 0
+#define USE_PATCHED_GUID 1
 #define USE_PATCHED_FONTS 1
 #define USE_TRIGGER_DISPLAY 0
+#define USE_AUDIO_STREAM_QUALITY 0
 #define USE_R100 1
+#define USE_TEXTURE_CACHE 1
+#define USE_RESULT_CACHE 1
+#define USE_ADDRESS_CACHE 1
+
+
+// Every backend starts with these callbacks, so patches can be applied to
+// the file, a process, or a dry-run without knowing about it
+typedef struct Backend Backend;
+typedef Backend* Target;
+typedef struct Tracer Tracer;
+
+typedef struct {
+  off_t offset;
+  const void* data;
+  size_t size;
+} WriteRun;
+
+struct Backend {
+  void (*writex)(Target target, off_t offset, const void* data, size_t size);
+  void (*readx)(Target target, off_t offset, void* data, size_t size);
+
+  // Optional, for backends which can submit many runs at once
+  void (*writexv)(Target target, const WriteRun* runs, size_t count);
+
+  // Set if writes are discarded, so patches can skip expensive preparation
+  bool dry_run;
+
+  // Set if writes to separate bytes may come from several threads at once
+  bool concurrent;
+
+  // Addresses of this version of the game, see addresses_init
+  const uint32_t* addresses;
+
+  // Set for the backend which traces a patch, see trace_begin
+  Tracer* tracer;
+};
+
+static void writex(Target target, off_t offset, const void* data, size_t size) {
+  target->writex(target, offset, data, size);
+  return;
+}
 
+static void readx(Target target, off_t offset, void* data, size_t size) {
+  target->readx(target, offset, data, size);
+  return;
+}
+
+static void writexv(Target target, const WriteRun* runs, size_t count) {
+  if (target->writexv != NULL) {
+    target->writexv(target, runs, count);
+  } else {
+    for(size_t i = 0; i < count; i++) {
+      writex(target, runs[i].offset, runs[i].data, runs[i].size);
+    }
+  }
+  return;
+}
 
 #ifdef LOADER
 
@@ -27,9 +90,7 @@
 
 #ifdef DLL
 
-typedef void* Target;
-
-static void writex(Target target, off_t offset, const void* data, size_t size) {
+static void memory_writex(Target target, off_t offset, const void* data, size_t size) {
   //MessageBoxA(NULL, "Meep", "Meep X", 0);
   void* address = (void*)(uintptr_t)offset;
   DWORD old_protect;
@@ -39,7 +100,7 @@ static void writex(Target target, off_t offset, const void* data, size_t size) {
   return;
 }
 
-static void readx(Target target, off_t offset, void* data, size_t size) {
+static void memory_readx(Target target, off_t offset, void* data, size_t size) {
   memcpy(data, (void*)(uintptr_t)offset, size);
   return;
 }
@@ -47,21 +108,24 @@ static void readx(Target target, off_t offset, void* data, size_t size) {
 #else
 
 typedef struct {
+  Backend backend;
   PROCESS_INFORMATION process_information;
-} Target;
+} Process;
 
-static void writex(Target target, off_t offset, const void* data, size_t size) {
+static void process_writex(Target target, off_t offset, const void* data, size_t size) {
+  Process* process = (Process*)target;
   void* address = (void*)(uintptr_t)offset;
   DWORD old_protect;
-  VirtualProtectEx(target.process_information.hProcess, address, size, PAGE_EXECUTE_READWRITE, &old_protect);
-  BOOL status = WriteProcessMemory(target.process_information.hProcess, address, data, size, NULL);
+  VirtualProtectEx(process->process_information.hProcess, address, size, PAGE_EXECUTE_READWRITE, &old_protect);
+  BOOL status = WriteProcessMemory(process->process_information.hProcess, address, data, size, NULL);
   assert(status != 0);
-  VirtualProtectEx(target.process_information.hProcess, address, size, old_protect, &old_protect);
+  VirtualProtectEx(process->process_information.hProcess, address, size, old_protect, &old_protect);
   return;
 }
 
-static void readx(Target target, off_t offset, void* data, size_t size) {
-  ReadProcessMemory(target.process_information.hProcess, (void*)(uintptr_t)offset, data, size, NULL);
+static void process_readx(Target target, off_t offset, void* data, size_t size) {
+  Process* process = (Process*)target;
+  ReadProcessMemory(process->process_information.hProcess, (void*)(uintptr_t)offset, data, size, NULL);
   return;
 }
 
@@ -69,777 +133,5878 @@ static void readx(Target target, off_t offset, void* data, size_t size) {
 
 #else
 
-static off_t mapExe(uint32_t offset) {
-  /*
-    From `objdump -x swep1rcr.exe` for the patched US version:
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+#endif
+
+// Part of the file which is loaded at an address
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  uint32_t offset;
+} ImageSection;
+
+// The headers, and the section limit of the Windows loader
+#define IMAGE_MAX_SECTIONS (1 + 96)
 
-    0 .text         000aa750  00401000  00401000  00000400  2**2
-                    CONTENTS, ALLOC, LOAD, READONLY, CODE
-    1 .rdata        000054a2  004ac000  004ac000  000aac00  2**2
-                    CONTENTS, ALLOC, LOAD, READONLY, DATA
-    2 .data         00023600  004b2000  004b2000  000b0200  2**2
-                    CONTENTS, ALLOC, LOAD, DATA
-    3 .rsrc         000017b8  00ece000  00ece000  000d3800  2**2
-  */
+typedef struct {
+  Backend backend;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+  uint8_t* data;
+  size_t size;
+
+  // Set if the file was loaded into our own memory instead of mapped
+  bool buffered;
+
+  // Sections sorted by address, see image_parse. They are only read while
+  // patches run, which may be on several threads at once, so they don't
+  // change on their own: after resizing or editing the section headers,
+  // image_parse has to be called again.
+  uint32_t image_base;
+  ImageSection sections[IMAGE_MAX_SECTIONS];
+  unsigned int section_count;
+
+  // Writes mostly continue where the last one was, so that section is
+  // tried first
+  atomic_uint last_section;
+} Image;
+
+static uint16_t image_get16(const Image* image, size_t offset) {
+  uint16_t value;
+  memcpy(&value, &image->data[offset], 2);
+  return value;
+}
 
-  assert(offset >= 0x400000);
+static uint32_t image_get32(const Image* image, size_t offset) {
+  uint32_t value;
+  memcpy(&value, &image->data[offset], 4);
+  return value;
+}
 
-  if (offset >= 0x00ed0000) {
-    // hack
-    offset -= 0x00ed0000;
-    offset += 0x000d5000;
-  } else if (offset >= 0x00ece000) {
-    // .rsrc
-    offset -= 0x00ece000;
-    offset += 0x000d3800;
-  } else if (offset >= 0x004b2000) {
-   // .data
-    offset -= 0x004b2000;
-    offset += 0x000b0200;
-  } else if (offset >= 0x004ac000) {
-    // .rdata
-    offset -= 0x004ac000;
-    offset += 0x000aac00;
-  } else if (offset >= 0x00401000) {
-    // .text
-    offset -= 0x00401000;
-    offset += 0x00000400;
-  } else {
-    // headers
-    offset -= 0x00400000;
+// Reads the DOS, PE and section headers, returns false if they are invalid
+static bool image_parse(Image* image) {
+  image->section_count = 0;
+  atomic_store_explicit(&image->last_section, 0, memory_order_relaxed);
+  if ((image->size < 0x40) || memcmp(image->data, "MZ", 2)) {
+    return false;
+  }
+  uint32_t pe_header = image_get32(image, 0x3C);
+  if ((pe_header > image->size - 24) || memcmp(&image->data[pe_header], "PE\0\0", 4)) {
+    return false;
   }
-  return offset;
+  uint32_t coff_header = pe_header + 4;
+  uint16_t section_count = image_get16(image, coff_header + 2);
+  uint32_t size_of_optional_header = image_get16(image, coff_header + 16);
+  uint32_t optional_header = coff_header + 20;
+  uint32_t section_header = optional_header + size_of_optional_header;
+  if ((size_of_optional_header < 64) || (section_count >= IMAGE_MAX_SECTIONS) ||
+      ((section_header + section_count * 40) > image->size) ||
+      (image_get16(image, optional_header + 0) != 0x10B)) { // PE32
+    return false;
+  }
+  image->image_base = image_get32(image, optional_header + 28);
+  uint32_t size_of_headers = image_get32(image, optional_header + 60);
+
+  // Only bytes which are in the file can be accessed
+  ImageSection* sections = image->sections;
+  unsigned int count = 0;
+  sections[count++] = (ImageSection){ image->image_base, (size_of_headers < image->size) ? size_of_headers : image->size, 0 };
+  for(unsigned int i = 0; i < section_count; i++) {
+    uint32_t header = section_header + i * 40;
+    uint32_t raw_size = image_get32(image, header + 16);
+    uint32_t raw_offset = image_get32(image, header + 20);
+    if (raw_offset >= image->size) {
+      continue;
+    }
+    if (raw_size > image->size - raw_offset) {
+      raw_size = image->size - raw_offset;
+    }
+    if (raw_size == 0) {
+      continue;
+    }
+
+    // Keep them sorted, sections we append might not come last
+    ImageSection section = { image->image_base + image_get32(image, header + 12), raw_size, raw_offset };
+    unsigned int j;
+    for(j = count; (j > 0) && (sections[j - 1].address > section.address); j--) {
+      sections[j] = sections[j - 1];
+    }
+    sections[j] = section;
+    count++;
+  }
+  image->section_count = count;
+  return true;
 }
 
-typedef struct {
-  FILE* f;
-} Target;
+// Finds the file offset for size bytes at an address in the game
+static off_t image_offset(Image* image, off_t address, size_t size) {
+  const ImageSection* sections = image->sections;
+  unsigned int i = atomic_load_explicit(&image->last_section, memory_order_relaxed);
+  if ((address < sections[i].address) || ((address - sections[i].address) + size > sections[i].size)) {
+
+    // Find the last section which starts at or before the address
+    unsigned int low = 0;
+    unsigned int high = image->section_count;
+    while(high - low > 1) {
+      unsigned int middle = low + (high - low) / 2;
+      if (sections[middle].address <= address) {
+        low = middle;
+      } else {
+        high = middle;
+      }
+    }
+    i = low;
+    assert((address >= sections[i].address) && ((address - sections[i].address) + size <= sections[i].size));
+    atomic_store_explicit(&image->last_section, i, memory_order_relaxed);
+  }
+  return sections[i].offset + (address - sections[i].address);
+}
 
-static void writex(Target target, off_t offset, const void* data, size_t size) {
-  fseek(target.f, mapExe(offset), SEEK_SET);
-  fwrite(data, size, 1, target.f);
+static void image_writex(Target target, off_t offset, const void* data, size_t size) {
+  Image* image = (Image*)target;
+  off_t file_offset = image_offset(image, offset, size);
+  memcpy(&image->data[file_offset], data, size);
   return;
 }
 
-static void readx(Target target, off_t offset, void* data, size_t size) {
-  fseek(target.f, mapExe(offset), SEEK_SET);
-  fread(data, size, 1, target.f);
+static void image_readx(Target target, off_t offset, void* data, size_t size) {
+  Image* image = (Image*)target;
+  off_t file_offset = image_offset(image, offset, size);
+  memcpy(data, &image->data[file_offset], size);
   return;
 }
 
+static void image_map(Image* image) {
+#ifdef _WIN32
+  image->mapping = CreateFileMappingA(image->file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)image->size >> 32), (DWORD)image->size, NULL);
+  assert(image->mapping != NULL);
+  image->data = MapViewOfFile(image->mapping, FILE_MAP_WRITE, 0, 0, image->size);
+  assert(image->data != NULL);
+#else
+  image->data = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+  assert(image->data != MAP_FAILED);
 #endif
-
-static uint8_t read8(Target target, off_t offset) {
-  uint8_t value;
-  readx(target, offset, &value, 1);
-  return value;
+  return;
 }
 
-static void write8(Target target, off_t offset, uint8_t value) {
-  writex(target, offset, &value, 1);
+static void image_unmap(Image* image) {
+#ifdef _WIN32
+  UnmapViewOfFile(image->data);
+  CloseHandle(image->mapping);
+#else
+  munmap(image->data, image->size);
+#endif
+  image->data = NULL;
   return;
 }
 
-static uint16_t read16(Target target, off_t offset) {
-  uint16_t value;
-  readx(target, offset, &value, 2);
-  return value;
+static bool image_open(Image* image, const char* path) {
+  memset(image, 0x00, sizeof(Image));
+  image->backend.writex = image_writex;
+  image->backend.readx = image_readx;
+  image->backend.concurrent = true;
+#ifdef _WIN32
+  image->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (image->file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER file_size;
+  GetFileSizeEx(image->file, &file_size);
+  image->size = file_size.QuadPart;
+#else
+  image->fd = open(path, O_RDWR);
+  if (image->fd == -1) {
+    return false;
+  }
+  struct stat st;
+  fstat(image->fd, &st);
+  image->size = st.st_size;
+#endif
+  image_map(image);
+  return true;
 }
 
-static void write16(Target target, off_t offset, uint16_t value) {
-  writex(target, offset, &value, 2);
+// The sections are kept as they are, image_parse has to be called before
+// accessing the image again
+static void image_resize(Image* image, size_t size) {
+  if (image->buffered) {
+    image->data = realloc(image->data, size);
+    assert(image->data != NULL);
+    if (size > image->size) {
+      memset(&image->data[image->size], 0x00, size - image->size);
+    }
+    image->size = size;
+    return;
+  }
+
+  // The mapping can't grow in place, so we remap after changing the file size.
+  // New space in the file will read as zero.
+  image_unmap(image);
+#ifdef _WIN32
+  LARGE_INTEGER file_size;
+  file_size.QuadPart = size;
+  SetFilePointerEx(image->file, file_size, NULL, FILE_BEGIN);
+  BOOL status = SetEndOfFile(image->file);
+  assert(status != 0);
+#else
+  int status = ftruncate(image->fd, size);
+  assert(status == 0);
+#endif
+  image->size = size;
+  image_map(image);
   return;
 }
 
-static uint32_t read32(Target target, off_t offset) {
-  uint32_t value;
-  readx(target, offset, &value, 4);
-  return value;
-}
+static void image_close(Image* image) {
+  if (image->buffered) {
+    free(image->data);
+    image->data = NULL;
+    return;
+  }
 
-static void write32(Target target, off_t offset, uint32_t value) {
-  writex(target, offset, &value, 4);
+  // Flush all modifications to disk in one go
+#ifdef _WIN32
+  FlushViewOfFile(image->data, 0);
+  image_unmap(image);
+  CloseHandle(image->file);
+#else
+  msync(image->data, image->size, MS_SYNC);
+  image_unmap(image);
+  close(image->fd);
+#endif
   return;
 }
 
-static void patch16_add(Target target, off_t offset, uint16_t delta) {
-  write16(target, offset, read16(target, offset) + delta);
-  return;
-}
+// Loads a file into our own memory, so the original is only read.
+// A path of "-" reads from stdin.
+static bool image_load(Image* image, const char* path) {
+  memset(image, 0x00, sizeof(Image));
+  image->backend.writex = image_writex;
+  image->backend.readx = image_readx;
+  image->backend.concurrent = true;
+  image->buffered = true;
 
-static void patch32_add(Target target, off_t offset, uint32_t delta) {
-  write32(target, offset, read32(target, offset) + delta);
-  return;
-}
+  FILE* f;
+  if (!strcmp(path, "-")) {
+    f = stdin;
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  } else {
+    f = fopen(path, "rb");
+    if (f == NULL) {
+      return false;
+    }
+  }
 
-static uint32_t add_esp(Target target, uint32_t memory_offset, int32_t n) {
-  write8(target, memory_offset, 0x81); memory_offset += 1;
-  write8(target, memory_offset, 0xC4); memory_offset += 1;
-  write32(target, memory_offset, (uint32_t)n); memory_offset += 4;
-  return memory_offset;
+  // Pipes can't tell us their size, so we grow the buffer as we go
+  size_t capacity = 0;
+  while(true) {
+    if (image->size == capacity) {
+      capacity = capacity ? capacity * 2 : 0x400000;
+      image->data = realloc(image->data, capacity);
+      assert(image->data != NULL);
+    }
+    size_t read = fread(&image->data[image->size], 1, capacity - image->size, f);
+    image->size += read;
+    if (read == 0) {
+      break;
+    }
+  }
+  bool failed = ferror(f);
+  if (f != stdin) {
+    fclose(f);
+  }
+  if (failed) {
+    free(image->data);
+    return false;
+  }
+  return true;
 }
 
-static uint32_t test_eax_eax(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x85); memory_offset += 1;
-  write8(target, memory_offset, 0xC0); memory_offset += 1;
-  return memory_offset;
+// Writes the image sequentially in one pass
+static bool image_write(const Image* image, FILE* f) {
+  bool written = (fwrite(image->data, 1, image->size, f) == image->size);
+  written &= (fflush(f) == 0);
+  return written;
 }
 
-static uint32_t test_edx_edx(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x85); memory_offset += 1;
-  write8(target, memory_offset, 0xD2); memory_offset += 1;
-  return memory_offset;
+// Creates a temporary file next to path, which replaces path once it's complete
+static FILE* temporary_open(char* temporary_path, const char* path, const char* mode) {
+#ifdef _WIN32
+  sprintf(temporary_path, "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId());
+#else
+  sprintf(temporary_path, "%s.%lu.tmp", path, (unsigned long)getpid());
+#endif
+  return fopen(temporary_path, mode);
 }
 
-static uint32_t nop(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x90); memory_offset += 1;
-  return memory_offset;
-}
+#ifndef _WIN32
 
-static uint32_t push_eax(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x50); memory_offset += 1;
-  return memory_offset;
+// Gives the temporary file the permissions of the file it replaces, like
+// patching in place would keep them
+static bool temporary_copy_permissions(FILE* f, const char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return true;
+  }
+  if (fchmod(fileno(f), st.st_mode & 07777) != 0) {
+    return false;
+  }
+#ifdef __linux__
+  // The POSIX ACL, if there is one, is kept in an extended attribute
+  char acl[4096];
+  ssize_t acl_size = getxattr(path, "system.posix_acl_access", acl, sizeof(acl));
+  if ((acl_size > 0) && (fsetxattr(fileno(f), "system.posix_acl_access", acl, acl_size, 0) != 0)) {
+    return false;
+  }
+#endif
+  return true;
 }
 
-static uint32_t push_edx(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x52); memory_offset += 1;
-  return memory_offset;
-}
+#endif
 
-static uint32_t pop_edx(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0x5A); memory_offset += 1;
-  return memory_offset;
-}
+// Replaces path with the temporary file if everything was written, so path is
+// either untouched or complete. An existing path keeps its permissions.
+static bool temporary_commit(FILE* f, const char* temporary_path, const char* path, bool written) {
+  written &= (fflush(f) == 0);
+#ifdef _WIN32
+  written = written && (_commit(_fileno(f)) == 0);
+#else
+  written = written && temporary_copy_permissions(f, path);
+  written = written && (fsync(fileno(f)) == 0);
+#endif
+  written &= (fclose(f) == 0);
 
-static uint32_t push_u32(Target target, uint32_t memory_offset, uint32_t value) {
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write32(target, memory_offset, value); memory_offset += 4;
-  return memory_offset;
+#ifdef _WIN32
+  // ReplaceFile keeps the attributes and ACL of the file it replaces
+  if (GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES) {
+    written = written && ReplaceFileA(path, temporary_path, NULL, 0, NULL, NULL);
+  } else {
+    written = written && MoveFileExA(temporary_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+  }
+#else
+  written = written && (rename(temporary_path, path) == 0);
+#endif
+  if (!written) {
+    remove(temporary_path);
+  }
+  return written;
 }
 
-static uint32_t call(Target target, uint32_t memory_offset, uint32_t address) {
-  write8(target, memory_offset, 0xE8); memory_offset += 1;
-  write32(target, memory_offset, address - (memory_offset + 4)); memory_offset += 4;
-  return memory_offset;
+// Writes the image to a temporary file next to path, then replaces path with
+// it, so path is either untouched or completely patched
+static bool image_save(const Image* image, const char* path) {
+  char temporary_path[4096 + 32];
+  FILE* f = temporary_open(temporary_path, path, "wb");
+  if (f == NULL) {
+    return false;
+  }
+  return temporary_commit(f, temporary_path, path, image_write(image, f));
 }
 
-static uint32_t jmp(Target target, uint32_t memory_offset, uint32_t address) {
-  write8(target, memory_offset, 0xE9); memory_offset += 1;
-  write32(target, memory_offset, address - (memory_offset + 4)); memory_offset += 4;
-  return memory_offset;
+// Keeps stdout for the patched image; our messages go to stderr instead
+static FILE* claim_stdout(void) {
+  fflush(stdout);
+#ifdef _WIN32
+  int fd = _dup(_fileno(stdout));
+  _dup2(_fileno(stderr), _fileno(stdout));
+  _setmode(fd, _O_BINARY);
+  return _fdopen(fd, "wb");
+#else
+  int fd = dup(STDOUT_FILENO);
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+  return fdopen(fd, "wb");
+#endif
 }
 
-static uint32_t jnz(Target target, uint32_t memory_offset, uint32_t address) {
-  write8(target, memory_offset, 0x0F); memory_offset += 1;
-  write8(target, memory_offset, 0x85); memory_offset += 1;
-  write32(target, memory_offset, address - (memory_offset + 4)); memory_offset += 4;
-  return memory_offset;
+// Backend for a loaded image in our own memory
+typedef struct {
+  Backend backend;
+  uint8_t* data;
+  uint32_t base;
+  size_t size;
+} Memory;
+
+static void local_writex(Target target, off_t offset, const void* data, size_t size) {
+  Memory* memory = (Memory*)target;
+  assert((offset >= memory->base) && ((offset - memory->base) + size <= memory->size));
+  memcpy(&memory->data[offset - memory->base], data, size);
+  return;
 }
 
-static uint32_t retn(Target target, uint32_t memory_offset) {
-  write8(target, memory_offset, 0xC3); memory_offset += 1;
-  return memory_offset;
+static void local_readx(Target target, off_t offset, void* data, size_t size) {
+  Memory* memory = (Memory*)target;
+  assert((offset >= memory->base) && ((offset - memory->base) + size <= memory->size));
+  memcpy(data, &memory->data[offset - memory->base], size);
+  return;
 }
 
-#if 0
-
-static void* readExe(Target target, uint32_t offset, size_t size) {
-
-  // Find correct location in binary
-  offset = offset;
+static void memory_init(Memory* memory, uint8_t* data, uint32_t base, size_t size) {
+  memset(&memory->backend, 0x00, sizeof(memory->backend));
+  memory->backend.writex = local_writex;
+  memory->backend.readx = local_readx;
+  memory->backend.concurrent = true;
+  memory->data = data;
+  memory->base = base;
+  memory->size = size;
+  return;
+}
 
-  // Allocate space for the read
-  void* data = malloc(size);
+#ifdef __linux__
 
-  // Read the data from the exe
-  off_t previous_offset = ftell(f);
-  fseek(target, offset, SEEK_SET);
-  fread(data, size, 1, f);
-  fseek(target, previous_offset, SEEK_SET);
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <limits.h>
 
-  return data;
+// Backend for another process on Linux; this is used to test loader-style
+// patching with a stand-in process
+typedef struct {
+  Backend backend;
+  pid_t pid;
+  int mem_fd;
+  uintptr_t remote;
+  uint32_t base;
+  size_t size;
+} LinuxProcess;
+
+static uintptr_t linux_process_address(LinuxProcess* process, off_t offset, size_t size) {
+  assert((offset >= process->base) && ((offset - process->base) + size <= process->size));
+  return process->remote + (offset - process->base);
 }
 
-static void dumpTexture(Target target, size_t offset, uint8_t unk0, uint8_t unk1, unsigned int width, unsigned int height, const char* filename) {
-  // Presumably the format information?
-  assert(unk0 == 3);
-  assert(unk1 == 0);
+static void linux_process_writexv(Target target, const WriteRun* runs, size_t count) {
+  LinuxProcess* process = (LinuxProcess*)target;
+
+  while(count > 0) {
+    struct iovec local[IOV_MAX];
+    struct iovec remote[IOV_MAX];
+    size_t chunk = count < IOV_MAX ? count : IOV_MAX;
+    size_t total = 0;
+    for(size_t i = 0; i < chunk; i++) {
+      local[i].iov_base = (void*)runs[i].data;
+      local[i].iov_len = runs[i].size;
+      remote[i].iov_base = (void*)linux_process_address(process, runs[i].offset, runs[i].size);
+      remote[i].iov_len = runs[i].size;
+      total += runs[i].size;
+    }
 
-  FILE* out = fopen(filename, "wb");
-  fprintf(out, "P3\n%d %d\n15\n", width, height);
+    // This fails for protected pages, so we fall back to /proc/<pid>/mem
+    // (which ignores protection) for whatever wasn't written
+    ssize_t written = process_vm_writev(process->pid, local, chunk, remote, chunk, 0);
+    if (written < 0) {
+      written = 0;
+    }
+    if ((size_t)written < total) {
+      for(size_t i = 0; i < chunk; i++) {
+        if ((size_t)written >= local[i].iov_len) {
+          written -= local[i].iov_len;
+          continue;
+        }
+        const uint8_t* data = local[i].iov_base;
+        off_t address = (uintptr_t)remote[i].iov_base;
+        ssize_t status = pwrite(process->mem_fd, &data[written], local[i].iov_len - written, address + written);
+        assert(status == (ssize_t)(local[i].iov_len - written));
+        written = 0;
+      }
+    }
 
-  // Copy the pixel data
-  uint8_t* texture = readExe(target, offset, width * height * 4 / 8);
-  for(unsigned int i = 0; i < width * height * 2; i++) {
-    uint8_t v = ((texture[i / 2] << ((i % 2) * 4)) & 0xF0) >> 4;
-    fprintf(out, "%d %d %d\n", v, v, v);
+    runs += chunk;
+    count -= chunk;
   }
-  free(texture);
-
-  fclose(out);
   return;
 }
 
-static uint32_t dumpTextureTable(Target target, uint32_t offset, uint8_t unk0, uint8_t unk1, unsigned int width, unsigned int height, const char* filename) {
-  char filename_i[4096]; //FIXME: Size
-
-  // Get size of the table
-  uint32_t* buffer = readExe(target, offset + 0, 4);
-  uint32_t count = *buffer;
-  free(buffer);
+static void linux_process_writex(Target target, off_t offset, const void* data, size_t size) {
+  WriteRun run = { offset, data, size };
+  linux_process_writexv(target, &run, 1);
+  return;
+}
 
-  // Loop over elements and dump each
-  printf("// %s at 0x%X\n", filename, offset);
-  uint32_t* offsets = readExe(target, offset + 4, count * 4);
-  for(unsigned int i = 0; i < count; i++) {
-    sprintf(filename_i, "%s_%d.ppm", filename, i);
-    printf("// - [%d]: 0x%X\n", i, offsets[i]);
-    dumpTexture(target, offsets[i], unk0, unk1, width, height, filename_i);
+static void linux_process_readx(Target target, off_t offset, void* data, size_t size) {
+  LinuxProcess* process = (LinuxProcess*)target;
+  struct iovec local = { data, size };
+  struct iovec remote = { (void*)linux_process_address(process, offset, size), size };
+  if (process_vm_readv(process->pid, &local, 1, &remote, 1, 0) != (ssize_t)size) {
+    ssize_t status = pread(process->mem_fd, data, size, (uintptr_t)remote.iov_base);
+    assert(status == (ssize_t)size);
   }
-  free(offsets);
-  return count;
+  return;
 }
 
-#endif
+static bool linux_process_open(LinuxProcess* process, pid_t pid, uintptr_t remote, uint32_t base, size_t size) {
+  memset(&process->backend, 0x00, sizeof(process->backend));
+  process->backend.writex = linux_process_writex;
+  process->backend.readx = linux_process_readx;
+  process->backend.writexv = linux_process_writexv;
+  process->pid = pid;
+  process->remote = remote;
+  process->base = base;
+  process->size = size;
+
+  char path[64];
+  sprintf(path, "/proc/%d/mem", (int)pid);
+  process->mem_fd = open(path, O_RDWR);
+  return process->mem_fd != -1;
+}
 
-static uint32_t patchTextureTable(Target target, uint32_t memory_offset, uint32_t offset, uint32_t code_begin_offset, uint32_t code_end_offset, uint32_t width, uint32_t height, const char* filename) {
+static void linux_process_close(LinuxProcess* process) {
+  close(process->mem_fd);
+  return;
+}
 
-#if 1
-  // Attempt to realign the disassembler
-  for(unsigned int i = 0; i < 16; i++) {
-    memory_offset = nop(target, memory_offset);
-  }
 #endif
 
-  // Create a code cave
-  // The original argument for the width is only 8 bit (signed), so it's hard
-  // to extend. That's why we use a code cave.
-  uint32_t cave_memory_offset = memory_offset;
-
-  // Patches the arguments for the texture loader
-  memory_offset = push_u32(target, memory_offset, height);
-  memory_offset = push_u32(target, memory_offset, width);
-  memory_offset = push_u32(target, memory_offset, height);
-  memory_offset = push_u32(target, memory_offset, width);
-  memory_offset = jmp(target, memory_offset, code_end_offset);
-
-  //FIXME: Fixup the format?
-  //.text:0042D794                 push    0
-  //.text:0042D796                 push    3
+#endif
 
-  // Write code to jump into the codecave (5 bytes) and clear original code
-  uint32_t hack_offset = jmp(target, code_begin_offset, cave_memory_offset);
-  printf("Tying to jump to 0x%08X\n", cave_memory_offset);
-  //FIXME: Use a while loop instead
-  for(unsigned int i = 5; i < (code_end_offset - code_begin_offset); i++) {
-    hack_offset = nop(target, hack_offset);
+// Dry-run backend which measures how much of the code cave a patch needs.
+// Reads are passed through so patches can still inspect the game.
+typedef struct {
+  Backend backend;
+  Target parent;
+  uint32_t cave_begin;
+  uint32_t cave_end;
+} Counter;
+
+static void counter_writex(Target target, off_t offset, const void* data, size_t size) {
+  Counter* counter = (Counter*)target;
+  (void)data;
+  if ((offset >= counter->cave_begin) && ((offset + size) > counter->cave_end)) {
+    counter->cave_end = offset + size;
   }
+  return;
+}
 
-  // Get number of textures in the table
-  uint32_t count = read32(target, offset + 0);
-
-  // Have a buffer for pixeldata
-  unsigned int texture_size = width * height * 4 / 8;
-  uint8_t* buffer = malloc(texture_size);
+static void counter_readx(Target target, off_t offset, void* data, size_t size) {
+  Counter* counter = (Counter*)target;
+  readx(counter->parent, offset, data, size);
+  return;
+}
 
-  // Loop over all textures
-  for(unsigned int i = 0; i < count; i++) {
+static void counter_init(Counter* counter, Target parent, uint32_t cave_begin) {
+  memset(&counter->backend, 0x00, sizeof(counter->backend));
+  counter->backend.writex = counter_writex;
+  counter->backend.readx = counter_readx;
+  counter->backend.dry_run = true;
+  counter->backend.addresses = parent->addresses;
+  counter->parent = parent;
+  counter->cave_begin = cave_begin;
+  counter->cave_end = cave_begin;
+  return;
+}
 
-    // Load input texture to buffer
-    char path[4096];
-    sprintf(path, "textures/%s_%d_test.data", filename, i);
-    printf("Loading '%s'\n", path);
-    FILE* ft = fopen(path, "rb");
-    assert(ft != NULL);
-    memset(buffer, 0x00, texture_size);
-    for(unsigned int i = 0; i < texture_size * 2; i++) {
-      uint8_t pixel[2]; // GIMP only exports Gray + Alpha..
-      fread(pixel, sizeof(pixel), 1, ft);
-      buffer[i / 2] |= (pixel[0] & 0xF0) >> ((i % 2) * 4);
-    }
-    fclose(ft);
-
-    // Write pixel data to game
-    uint32_t texture_new = memory_offset;
-    writex(target, memory_offset, buffer, texture_size);
-    memory_offset += texture_size;
+// 64 bit FNV-1a; pass FNV_OFFSET or a previous result as hash
+#define FNV_OFFSET 0xCBF29CE484222325ULL
 
-    // Patch the table entry
-    uint32_t texture_old = read32(target, offset + 4 + i * 4);
-    write32(target, offset + 4 + i * 4, texture_new);
-    printf("%d: 0x%X -> 0x%X\n", i, texture_old, texture_new);
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash) {
+  const uint8_t* bytes = data;
+  for(size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001B3ULL;
   }
-  free(buffer);
-
-  return memory_offset;
+  return hash;
 }
 
-static void modify_network_guid(Target target, const void* data, size_t size) {
-
-  // Patches the game GUID so people don't cheat with it (as easily)
+// Sorted list of non-overlapping address ranges [begin, end)
+typedef struct {
+  uint32_t begin;
+  uint32_t end;
+} Interval;
 
-  if (size == 0) {
-    size = strlen(data);
+typedef struct {
+  Interval* intervals;
+  size_t count;
+  size_t capacity;
+} IntervalSet;
+
+static void interval_set_add(IntervalSet* set, uint32_t begin, uint32_t end) {
+
+  // Find the first range which ends at or after begin
+  size_t lo = 0;
+  size_t hi = set->count;
+  while(lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (set->intervals[mid].end < begin) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
 
-  #define SWAP(a, b) if (a ^ b) {a ^= b; b ^= a; a ^= b;}
-
-  static uint8_t s[256];
-  static bool initialized = false;
-  if (!initialized) {
-
-    // Initialize the RC4 S-Box
-    for (int i = 0; i < 256; i++) {
-      s[i] = i;
+  // Merge all ranges which overlap or touch the new one
+  hi = lo;
+  while((hi < set->count) && (set->intervals[hi].begin <= end)) {
+    if (set->intervals[hi].begin < begin) {
+      begin = set->intervals[hi].begin;
     }
-
-    initialized = true;
+    if (set->intervals[hi].end > end) {
+      end = set->intervals[hi].end;
+    }
+    hi++;
   }
 
-  // Modify the hash using RC4 schedule
-  assert(size <= 256);
-  const uint8_t* data_bytes = data;
-  uint8_t j = 0;
-  for (int i = 0; i < 256; i++) {
-    j += s[i] + data_bytes[i % size];
-    SWAP(s[i], s[j]);
+  // Replace them with a single range
+  if (lo == hi) {
+    if (set->count == set->capacity) {
+      set->capacity = set->capacity ? set->capacity * 2 : 32;
+      set->intervals = realloc(set->intervals, set->capacity * sizeof(Interval));
+    }
+    memmove(&set->intervals[lo + 1], &set->intervals[lo], (set->count - lo) * sizeof(Interval));
+    set->count++;
+  } else {
+    memmove(&set->intervals[lo + 1], &set->intervals[hi], (set->count - hi) * sizeof(Interval));
+    set->count -= hi - lo - 1;
   }
+  set->intervals[lo].begin = begin;
+  set->intervals[lo].end = end;
+  return;
+}
 
-  // Emit 16 bytes of the keystream
-  uint8_t k_i = 0;
-  uint8_t k_j = 0;
-  uint8_t k_s[256];
-  memcpy(k_s, s, 256);
-  for(int i = 0; i < 16; i++) {
-    k_j += k_s[++k_i];
-    SWAP(k_s[k_i], k_s[k_j]);
-    uint8_t rc4_output = k_s[(k_s[k_i] + k_s[k_j]) & 0xFF];
-    write8(target, 0x4AF9B0 + i, rc4_output);
+// Collects the ranges which are in both sets
+static void interval_set_intersect(const IntervalSet* a, const IntervalSet* b, IntervalSet* out) {
+  size_t i = 0;
+  size_t j = 0;
+  while((i < a->count) && (j < b->count)) {
+    const Interval* x = &a->intervals[i];
+    const Interval* y = &b->intervals[j];
+    uint32_t begin = (x->begin > y->begin) ? x->begin : y->begin;
+    uint32_t end = (x->end < y->end) ? x->end : y->end;
+    if (begin < end) {
+      interval_set_add(out, begin, end);
+    }
+    if (x->end < y->end) {
+      i++;
+    } else {
+      j++;
+    }
   }
+  return;
+}
 
-  // Overwrite the first 2 byte with a version index, so we have room
-  // to fix the algorithm if we have messed up
-  write16(target, 0x4AF9B0 + 0, 0x00000000);
+static void interval_set_free(IntervalSet* set) {
+  free(set->intervals);
+  memset(set, 0x00, sizeof(IntervalSet));
+  return;
+}
 
+// Passes everything through, but remembers which bytes were read and written,
+// unless the sets are NULL. The hash covers all writes, so it changes whenever
+// the result would.
+typedef struct {
+  Backend backend;
+  Target parent;
+  IntervalSet* reads;
+  IntervalSet* writes;
+  uint64_t hash;
+} Recorder;
+
+static void recorder_writex(Target target, off_t offset, const void* data, size_t size) {
+  Recorder* recorder = (Recorder*)target;
+  if ((recorder->writes != NULL) && (size > 0)) {
+    interval_set_add(recorder->writes, offset, offset + size);
+  }
+  uint32_t header[2] = { offset, size };
+  recorder->hash = fnv1a(header, sizeof(header), recorder->hash);
+  recorder->hash = fnv1a(data, size, recorder->hash);
+  writex(recorder->parent, offset, data, size);
   return;
 }
 
-static uint32_t patch_network_upgrades(Target target, uint32_t memory_offset, uint8_t* upgrade_levels, uint8_t* upgrade_healths) {
-  // Upgrade network play updates to 100%
+static void recorder_readx(Target target, off_t offset, void* data, size_t size) {
+  Recorder* recorder = (Recorder*)target;
+  if ((recorder->reads != NULL) && (size > 0)) {
+    interval_set_add(recorder->reads, offset, offset + size);
+  }
+  readx(recorder->parent, offset, data, size);
+  return;
+}
 
-#if USE_PATCHED_GUID
-  modify_network_guid(target, "Upgrades", 0);
-  modify_network_guid(target, upgrade_levels, 7);
-  modify_network_guid(target, upgrade_healths, 7);
+static void recorder_init(Recorder* recorder, Target parent, IntervalSet* reads, IntervalSet* writes) {
+  memset(&recorder->backend, 0x00, sizeof(recorder->backend));
+  recorder->backend.writex = recorder_writex;
+  recorder->backend.readx = recorder_readx;
+  recorder->backend.dry_run = parent->dry_run;
+  recorder->backend.addresses = parent->addresses;
+  recorder->backend.tracer = parent->tracer;
+  recorder->parent = parent;
+  recorder->reads = reads;
+  recorder->writes = writes;
+  recorder->hash = FNV_OFFSET;
+  return;
+}
+
+// The patch section starts with a header which points to a manifest.
+// The manifest lists where each patch lives, a hash of what it wrote and
+// a journal of the game bytes it replaced, so we can update the patch later.
+#define MANIFEST_MAGIC "swe1rpat"
+#define MANIFEST_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t manifest_offset;
+  uint32_t manifest_size;
+} SectionHeader;
+
+// Everything the patcher changed to add the section, so it can be removed
+typedef struct {
+  uint32_t file_size;
+  uint32_t size_of_image;
+  uint32_t size_of_code;
+  uint32_t size_of_initialized_data;
+  uint32_t section_count;
+  uint8_t section_header[40];
+  uint32_t checksum;
+} OriginalHeaders;
+
+typedef struct {
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t journal_size;
+  OriginalHeaders original;
+} ManifestHeader;
+
+typedef struct {
+  char name[32];
+  uint64_t hash;
+  uint32_t cave_offset;
+  uint32_t cave_size;
+
+  // Records of (address, size, original bytes), relative to the journal
+  uint32_t journal_offset;
+  uint32_t journal_size;
+} ManifestEntry;
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  const uint8_t* data;
+  unsigned int entry;
+} JournalRecord;
+
+typedef struct {
+  uint8_t* data;
+  OriginalHeaders original;
+  ManifestEntry* entries;
+  unsigned int entry_count;
+  JournalRecord* records;
+  unsigned int record_count;
+} Manifest;
+
+// Reads the manifest of a patch section, returns false if there is none
+static bool manifest_load(Target target, uint32_t section, uint32_t section_size, Manifest* manifest) {
+  memset(manifest, 0x00, sizeof(Manifest));
+
+  SectionHeader header;
+  readx(target, section, &header, sizeof(header));
+  if (memcmp(header.magic, MANIFEST_MAGIC, 8) ||
+      (header.manifest_offset > section_size) ||
+      (header.manifest_size > (section_size - header.manifest_offset)) ||
+      (header.manifest_size < sizeof(ManifestHeader))) {
+    return false;
+  }
+  manifest->data = malloc(header.manifest_size);
+  readx(target, section + header.manifest_offset, manifest->data, header.manifest_size);
+
+  ManifestHeader manifest_header;
+  size_t header_size = sizeof(ManifestHeader);
+  memcpy(&manifest_header, manifest->data, header_size);
+  size_t entries_size = (size_t)manifest_header.entry_count * sizeof(ManifestEntry);
+  if ((manifest_header.version != MANIFEST_VERSION) ||
+      (entries_size + manifest_header.journal_size != header.manifest_size - header_size)) {
+    free(manifest->data);
+    return false;
+  }
+  manifest->entries = (ManifestEntry*)&manifest->data[header_size];
+  manifest->entry_count = manifest_header.entry_count;
+  manifest->original = manifest_header.original;
+
+  // Split the journal into records
+  const uint8_t* journal = &manifest->data[header_size + entries_size];
+  for(unsigned int i = 0; i < manifest->entry_count; i++) {
+    ManifestEntry* entry = &manifest->entries[i];
+    entry->name[sizeof(entry->name) - 1] = '\0';
+    if ((entry->journal_offset > manifest_header.journal_size) ||
+        (entry->journal_size > (manifest_header.journal_size - entry->journal_offset))) {
+      free(manifest->data);
+      free(manifest->records);
+      return false;
+    }
+    uint32_t offset = 0;
+    while(offset < entry->journal_size) {
+      JournalRecord record;
+      const uint8_t* p = &journal[entry->journal_offset + offset];
+      if ((entry->journal_size - offset) < 8) {
+        break;
+      }
+      memcpy(&record.address, &p[0], 4);
+      memcpy(&record.size, &p[4], 4);
+      if (record.size > (entry->journal_size - offset - 8)) {
+        break;
+      }
+      record.data = &p[8];
+      record.entry = i;
+      manifest->records = realloc(manifest->records, (manifest->record_count + 1) * sizeof(JournalRecord));
+      manifest->records[manifest->record_count++] = record;
+      offset += 8 + record.size;
+    }
+    if (offset != entry->journal_size) {
+      free(manifest->data);
+      free(manifest->records);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void manifest_free(Manifest* manifest) {
+  free(manifest->data);
+  free(manifest->records);
+  memset(manifest, 0x00, sizeof(Manifest));
+  return;
+}
+
+static const ManifestEntry* manifest_find(const Manifest* manifest, const char* name) {
+  if (manifest == NULL) {
+    return NULL;
+  }
+  for(unsigned int i = 0; i < manifest->entry_count; i++) {
+    if (!strcmp(manifest->entries[i].name, name)) {
+      return &manifest->entries[i];
+    }
+  }
+  return NULL;
+}
+
+// Shows the game as it was before it was patched, so patches can be
+// measured and applied again. Writes which change nothing are dropped, so
+// an update only touches the bytes which are actually different.
+typedef struct {
+  Backend backend;
+  Target parent;
+  const Manifest* manifest;
+} Original;
+
+static void original_writex(Target target, off_t offset, const void* data, size_t size) {
+  Original* original = (Original*)target;
+  uint8_t* current = malloc(size);
+  readx(original->parent, offset, current, size);
+  if (memcmp(current, data, size)) {
+    writex(original->parent, offset, data, size);
+  }
+  free(current);
+  return;
+}
+
+static void original_readx(Target target, off_t offset, void* data, size_t size) {
+  Original* original = (Original*)target;
+  readx(original->parent, offset, data, size);
+
+  // In reverse order, like unpatch
+  for(unsigned int i = original->manifest->record_count; i > 0; i--) {
+    const JournalRecord* record = &original->manifest->records[i - 1];
+    uint32_t begin = (record->address > offset) ? record->address : offset;
+    uint32_t end = ((record->address + record->size) < (offset + size)) ? (record->address + record->size) : (offset + size);
+    if (begin < end) {
+      memcpy((uint8_t*)data + (begin - offset), &record->data[begin - record->address], end - begin);
+    }
+  }
+  return;
+}
+
+static void original_init(Original* original, Target parent, const Manifest* manifest) {
+  memset(&original->backend, 0x00, sizeof(original->backend));
+  original->backend.writex = original_writex;
+  original->backend.readx = original_readx;
+  original->backend.dry_run = parent->dry_run;
+  original->backend.concurrent = parent->concurrent;
+  original->backend.addresses = parent->addresses;
+  original->parent = parent;
+  original->manifest = manifest;
+  return;
+}
+
+// Collects writes in pages, so they can be submitted as few large runs.
+// This is much faster for backends where each write has a high cost.
+#define BATCH_PAGE_SIZE 0x1000
+
+typedef struct {
+  uint32_t address;
+  uint8_t dirty[BATCH_PAGE_SIZE / 8];
+  uint8_t data[BATCH_PAGE_SIZE];
+} BatchPage;
+
+typedef struct {
+  Backend backend;
+  Target parent;
+  BatchPage** pages;
+  size_t page_count;
+  size_t page_capacity;
+  BatchPage* last_page;
+
+  // Writes received and runs issued, which shows how well writes coalesce
+  unsigned int write_count;
+  size_t write_bytes;
+  unsigned int issued_count;
+  size_t issued_bytes;
+} Batch;
+
+static BatchPage* batch_page(Batch* batch, uint32_t address, bool create) {
+
+  // Sequential writes usually hit the same page again
+  if ((batch->last_page != NULL) && (batch->last_page->address == address)) {
+    return batch->last_page;
+  }
+
+  // Binary search for the page
+  size_t lo = 0;
+  size_t hi = batch->page_count;
+  while(lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (batch->pages[mid]->address < address) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if ((lo < batch->page_count) && (batch->pages[lo]->address == address)) {
+    batch->last_page = batch->pages[lo];
+    return batch->last_page;
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  // Insert a new page, keeping the list sorted
+  if (batch->page_count == batch->page_capacity) {
+    batch->page_capacity = batch->page_capacity ? batch->page_capacity * 2 : 64;
+    batch->pages = realloc(batch->pages, batch->page_capacity * sizeof(BatchPage*));
+  }
+  memmove(&batch->pages[lo + 1], &batch->pages[lo], (batch->page_count - lo) * sizeof(BatchPage*));
+  BatchPage* page = malloc(sizeof(BatchPage));
+  page->address = address;
+  memset(page->dirty, 0x00, sizeof(page->dirty));
+  batch->pages[lo] = page;
+  batch->page_count++;
+  batch->last_page = page;
+  return page;
+}
+
+static bool batch_dirty(const BatchPage* page, unsigned int i) {
+  return page->dirty[i / 8] & (1 << (i % 8));
+}
+
+static void batch_writex(Target target, off_t offset, const void* data, size_t size) {
+  Batch* batch = (Batch*)target;
+  batch->write_count++;
+  batch->write_bytes += size;
+
+  const uint8_t* bytes = data;
+  while(size > 0) {
+    uint32_t page_offset = offset % BATCH_PAGE_SIZE;
+    size_t chunk = BATCH_PAGE_SIZE - page_offset;
+    if (chunk > size) {
+      chunk = size;
+    }
+
+    BatchPage* page = batch_page(batch, offset - page_offset, true);
+    memcpy(&page->data[page_offset], bytes, chunk);
+    for(unsigned int i = page_offset; i < page_offset + chunk; i++) {
+      page->dirty[i / 8] |= 1 << (i % 8);
+    }
+
+    offset += chunk;
+    bytes += chunk;
+    size -= chunk;
+  }
+  return;
+}
+
+static void batch_readx(Target target, off_t offset, void* data, size_t size) {
+  Batch* batch = (Batch*)target;
+
+  // Read the original data, then apply pending writes on top
+  readx(batch->parent, offset, data, size);
+  uint8_t* bytes = data;
+  for(size_t i = 0; i < size; i++) {
+    uint32_t address = offset + i;
+    uint32_t page_offset = address % BATCH_PAGE_SIZE;
+    BatchPage* page = batch_page(batch, address - page_offset, false);
+    if ((page != NULL) && batch_dirty(page, page_offset)) {
+      bytes[i] = page->data[page_offset];
+    }
+  }
+  return;
+}
+
+static void batch_init(Batch* batch, Target parent) {
+  memset(batch, 0x00, sizeof(Batch));
+  batch->backend.writex = batch_writex;
+  batch->backend.readx = batch_readx;
+  batch->backend.dry_run = parent->dry_run;
+  batch->backend.addresses = parent->addresses;
+  batch->parent = parent;
+  return;
+}
+
+// Turns the collected pages into sorted runs, which have to be released with
+// batch_free_runs
+static WriteRun* batch_runs(Batch* batch, size_t* count) {
+  WriteRun* runs = malloc(batch->page_count * sizeof(WriteRun));
+  size_t run_count = 0;
+
+  // Each set of adjacent pages becomes a single run
+  size_t i = 0;
+  while(i < batch->page_count) {
+    size_t j = i;
+    while(((j + 1) < batch->page_count) && (batch->pages[j + 1]->address == (batch->pages[j]->address + BATCH_PAGE_SIZE))) {
+      j++;
+    }
+
+    // Trim the run to the first and last modified byte
+    unsigned int first = 0;
+    while(!batch_dirty(batch->pages[i], first)) {
+      first++;
+    }
+    unsigned int last = BATCH_PAGE_SIZE - 1;
+    while(!batch_dirty(batch->pages[j], last)) {
+      last--;
+    }
+    uint32_t begin = batch->pages[i]->address + first;
+    uint32_t end = batch->pages[j]->address + last + 1;
+
+    // Untouched bytes inside the run are filled with the original data
+    uint8_t* data = malloc(end - begin);
+    bool complete = true;
+    for(uint32_t address = begin; address < end; address++) {
+      BatchPage* page = batch->pages[i + (address - batch->pages[i]->address) / BATCH_PAGE_SIZE];
+      if (!batch_dirty(page, address % BATCH_PAGE_SIZE)) {
+        complete = false;
+        break;
+      }
+    }
+    if (!complete) {
+      readx(batch->parent, begin, data, end - begin);
+    }
+    for(uint32_t address = begin; address < end; address++) {
+      BatchPage* page = batch->pages[i + (address - batch->pages[i]->address) / BATCH_PAGE_SIZE];
+      unsigned int page_offset = address % BATCH_PAGE_SIZE;
+      if (batch_dirty(page, page_offset)) {
+        data[address - begin] = page->data[page_offset];
+      }
+    }
+
+    runs[run_count].offset = begin;
+    runs[run_count].data = data;
+    runs[run_count].size = end - begin;
+    run_count++;
+
+    batch->issued_count++;
+    batch->issued_bytes += end - begin;
+
+    i = j + 1;
+  }
+
+  *count = run_count;
+  return runs;
+}
+
+static void batch_free_runs(WriteRun* runs, size_t count) {
+  for(size_t i = 0; i < count; i++) {
+    free((void*)runs[i].data);
+  }
+  free(runs);
+  return;
+}
+
+// Drops all collected writes
+static void batch_clear(Batch* batch) {
+  for(size_t i = 0; i < batch->page_count; i++) {
+    free(batch->pages[i]);
+  }
+  free(batch->pages);
+  batch->pages = NULL;
+  batch->page_count = 0;
+  batch->page_capacity = 0;
+  batch->last_page = NULL;
+  return;
+}
+
+static void batch_flush(Batch* batch) {
+  size_t run_count;
+  WriteRun* runs = batch_runs(batch, &run_count);
+  writexv(batch->parent, runs, run_count);
+  batch_free_runs(runs, run_count);
+  batch_clear(batch);
+  return;
+}
+
+// A plan is the final set of writes for one executable, sorted by address, so
+// it can be applied at startup without running the patches again
+#define PLAN_VERSION 1
+
+typedef struct {
+  char magic[8]; // "swe1rpln"
+  uint32_t version;
+  uint32_t timestamp;
+  uint32_t cave_address;
+  uint32_t cave_size;
+  uint32_t run_count;
+  uint32_t data_size;
+} PlanHeader;
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+} PlanRun;
+
+// Serializes the writes collected in batch, which are dropped afterwards
+static uint8_t* plan_build(Batch* batch, uint32_t timestamp, uint32_t cave_address, uint32_t cave_size, size_t* size) {
+  size_t run_count;
+  WriteRun* runs = batch_runs(batch, &run_count);
+  size_t data_size = 0;
+  for(size_t i = 0; i < run_count; i++) {
+    data_size += runs[i].size;
+  }
+
+  *size = sizeof(PlanHeader) + run_count * sizeof(PlanRun) + data_size;
+  uint8_t* plan = malloc(*size);
+  assert(plan != NULL);
+  PlanHeader* header = (PlanHeader*)plan;
+  memcpy(header->magic, "swe1rpln", 8);
+  header->version = PLAN_VERSION;
+  header->timestamp = timestamp;
+  header->cave_address = cave_address;
+  header->cave_size = cave_size;
+  header->run_count = run_count;
+  header->data_size = data_size;
+
+  PlanRun* plan_runs = (PlanRun*)&plan[sizeof(PlanHeader)];
+  uint8_t* data = (uint8_t*)&plan_runs[run_count];
+  for(size_t i = 0; i < run_count; i++) {
+    plan_runs[i].address = runs[i].offset;
+    plan_runs[i].size = runs[i].size;
+    memcpy(data, runs[i].data, runs[i].size);
+    data += runs[i].size;
+  }
+  batch_free_runs(runs, run_count);
+  batch_clear(batch);
+  return plan;
+}
+
+// Returns the header if the plan is intact and made for this executable
+static const PlanHeader* plan_check(const uint8_t* plan, size_t size, uint32_t timestamp) {
+  const PlanHeader* header = (const PlanHeader*)plan;
+  if ((size < sizeof(PlanHeader)) || memcmp(header->magic, "swe1rpln", 8) ||
+      (header->version != PLAN_VERSION) || (header->timestamp != timestamp)) {
+    return NULL;
+  }
+  if ((size - sizeof(PlanHeader)) / sizeof(PlanRun) < header->run_count) {
+    return NULL;
+  }
+  const PlanRun* runs = (const PlanRun*)&plan[sizeof(PlanHeader)];
+  uint64_t data_size = 0;
+  for(uint32_t i = 0; i < header->run_count; i++) {
+    data_size += runs[i].size;
+  }
+  if ((data_size != header->data_size) ||
+      (size != sizeof(PlanHeader) + header->run_count * sizeof(PlanRun) + data_size)) {
+    return NULL;
+  }
+  return header;
+}
+
+// Writes a checked plan in one go, the runs point into the plan itself
+static void plan_apply(Target target, const uint8_t* plan) {
+  const PlanHeader* header = (const PlanHeader*)plan;
+  const PlanRun* plan_runs = (const PlanRun*)&plan[sizeof(PlanHeader)];
+  const uint8_t* data = (const uint8_t*)&plan_runs[header->run_count];
+  WriteRun* runs = malloc(header->run_count * sizeof(WriteRun));
+  for(uint32_t i = 0; i < header->run_count; i++) {
+    runs[i].offset = plan_runs[i].address;
+    runs[i].data = data;
+    runs[i].size = plan_runs[i].size;
+    data += plan_runs[i].size;
+  }
+  writexv(target, runs, header->run_count);
+  free(runs);
+  printf("Applied plan with %u writes (%u bytes)\n", header->run_count, header->data_size);
+  return;
+}
+
+static uint8_t read8(Target target, off_t offset) {
+  uint8_t value;
+  readx(target, offset, &value, 1);
+  return value;
+}
+
+static void write8(Target target, off_t offset, uint8_t value) {
+  writex(target, offset, &value, 1);
+  return;
+}
+
+static uint16_t read16(Target target, off_t offset) {
+  uint16_t value;
+  readx(target, offset, &value, 2);
+  return value;
+}
+
+static void write16(Target target, off_t offset, uint16_t value) {
+  writex(target, offset, &value, 2);
+  return;
+}
+
+static uint32_t read32(Target target, off_t offset) {
+  uint32_t value;
+  readx(target, offset, &value, 4);
+  return value;
+}
+
+static void write32(Target target, off_t offset, uint32_t value) {
+  writex(target, offset, &value, 4);
+  return;
+}
+
+static void patch16_add(Target target, off_t offset, uint16_t delta) {
+  write16(target, offset, read16(target, offset) + delta);
+  return;
+}
+
+static void patch32_add(Target target, off_t offset, uint32_t delta) {
+  write32(target, offset, read32(target, offset) + delta);
+  return;
+}
+
+// The DOS header points to the PE signature, the COFF header follows it
+static uint32_t find_coff_header(Target target, uint32_t image_base) {
+  return image_base + read32(target, image_base + 0x3C) + 4;
+}
+
+static uint32_t jmp(Target target, uint32_t memory_offset, uint32_t address) {
+  uint8_t code[5];
+  code[0] = 0xE9;
+  uint32_t displacement = address - (memory_offset + 5);
+  memcpy(&code[1], &displacement, 4);
+  writex(target, memory_offset, code, sizeof(code));
+  return memory_offset + sizeof(code);
+}
+
+static uint32_t nops(Target target, uint32_t memory_offset, size_t count) {
+  if (count == 0) {
+    return memory_offset;
+  }
+  uint8_t code[count];
+  memset(code, 0x90, count);
+  writex(target, memory_offset, code, count);
+  return memory_offset + count;
+}
+
+// In-memory assembler for code caves.
+// Code is collected as a list of items first, so labels can be used before
+// they are bound. Branches start out short and are only promoted to rel32
+// if the displacement doesn't fit, which is repeated until the layout is
+// stable. The finished cave is submitted with a single write.
+
+enum {
+  REG_EAX = 0,
+  REG_ECX = 1,
+  REG_EDX = 2,
+  REG_EBX = 3,
+  REG_ESP = 4,
+  REG_EBP = 5,
+  REG_ESI = 6,
+  REG_EDI = 7
+};
+
+enum {
+  CC_Z = 0x4,
+  CC_NZ = 0x5
+};
+
+typedef enum {
+  ASM_BYTES,
+  ASM_BRANCH
+} AsmItemKind;
+
+typedef struct {
+  AsmItemKind kind;
+
+  // Bytes
+  size_t data_offset;
+  size_t data_size;
+
+  // Branches (0xE8 call, 0xE9 jmp, 0x70 + cc jcc)
+  uint8_t opcode;
+  bool is_long;
+  int label;
+  uint32_t address;
+
+  // Filled in by the layout
+  uint32_t offset;
+} AsmItem;
+
+typedef struct {
+  uint32_t base;
+
+  uint8_t* data;
+  size_t data_size;
+  size_t data_capacity;
+
+  AsmItem* items;
+  size_t item_count;
+  size_t item_capacity;
+
+  // Item index each label is bound to (or -1)
+  int* labels;
+  size_t label_count;
+
+  uint32_t size;
+} Assembler;
+
+static void asm_init(Assembler* a, uint32_t base) {
+  memset(a, 0x00, sizeof(Assembler));
+  a->base = base;
+  return;
+}
+
+static void asm_free(Assembler* a) {
+  free(a->data);
+  free(a->items);
+  free(a->labels);
+  return;
+}
+
+static AsmItem* asm_item(Assembler* a, AsmItemKind kind) {
+  if (a->item_count == a->item_capacity) {
+    a->item_capacity = a->item_capacity ? a->item_capacity * 2 : 32;
+    a->items = realloc(a->items, a->item_capacity * sizeof(AsmItem));
+  }
+  AsmItem* item = &a->items[a->item_count++];
+  memset(item, 0x00, sizeof(AsmItem));
+  item->kind = kind;
+  item->label = -1;
+  return item;
+}
+
+static void asm_bytes(Assembler* a, const void* data, size_t size) {
+  if (a->data_size + size > a->data_capacity) {
+    while(a->data_size + size > a->data_capacity) {
+      a->data_capacity = a->data_capacity ? a->data_capacity * 2 : 256;
+    }
+    a->data = realloc(a->data, a->data_capacity);
+  }
+
+  // Extend the previous item if possible
+  AsmItem* item = (a->item_count > 0) ? &a->items[a->item_count - 1] : NULL;
+  if ((item == NULL) || (item->kind != ASM_BYTES) || ((item->data_offset + item->data_size) != a->data_size)) {
+    item = asm_item(a, ASM_BYTES);
+    item->data_offset = a->data_size;
+  }
+  memcpy(&a->data[a->data_size], data, size);
+  a->data_size += size;
+  item->data_size += size;
+  return;
+}
+
+static void asm_u8(Assembler* a, uint8_t value) {
+  asm_bytes(a, &value, 1);
+  return;
+}
+
+static void asm_u32(Assembler* a, uint32_t value) {
+  asm_bytes(a, &value, 4);
+  return;
+}
+
+static int asm_label(Assembler* a) {
+  a->labels = realloc(a->labels, (a->label_count + 1) * sizeof(int));
+  a->labels[a->label_count] = -1;
+  return a->label_count++;
+}
+
+static void asm_bind(Assembler* a, int label) {
+  assert(a->labels[label] == -1);
+
+  // Labels point at the next item; force one, so the label stays put
+  a->labels[label] = a->item_count;
+  asm_item(a, ASM_BYTES)->data_offset = a->data_size;
+  return;
+}
+
+static int asm_here(Assembler* a) {
+  int label = asm_label(a);
+  asm_bind(a, label);
+  return label;
+}
+
+static uint32_t asm_item_size(const AsmItem* item) {
+  switch(item->kind) {
+  case ASM_BYTES:
+    return item->data_size;
+  case ASM_BRANCH:
+    if (item->opcode == 0xE8) {
+      return 5;
+    }
+    if (item->opcode == 0xE9) {
+      return item->is_long ? 5 : 2;
+    }
+    return item->is_long ? 6 : 2;
+  }
+  assert(false);
+  return 0;
+}
+
+static uint32_t asm_target(Assembler* a, const AsmItem* item) {
+  if (item->label == -1) {
+    return item->address;
+  }
+  int index = a->labels[item->label];
+  assert(index != -1);
+  return a->base + a->items[index].offset + item->address;
+}
+
+static void asm_layout(Assembler* a) {
+  bool changed;
+  do {
+    // Assign offsets
+    uint32_t offset = 0;
+    for(size_t i = 0; i < a->item_count; i++) {
+      a->items[i].offset = offset;
+      offset += asm_item_size(&a->items[i]);
+    }
+    a->size = offset;
+
+    // Promote short branches which can't reach their target
+    changed = false;
+    for(size_t i = 0; i < a->item_count; i++) {
+      AsmItem* item = &a->items[i];
+      if ((item->kind != ASM_BRANCH) || item->is_long) {
+        continue;
+      }
+      int32_t displacement = asm_target(a, item) - (a->base + item->offset + 2);
+      if ((displacement < -128) || (displacement > 127)) {
+        item->is_long = true;
+        changed = true;
+      }
+    }
+  } while(changed);
+  return;
+}
+
+static uint32_t asm_address(Assembler* a, int label) {
+  int index = a->labels[label];
+  assert(index != -1);
+  return a->base + a->items[index].offset;
+}
+
+static uint32_t asm_commit(Assembler* a, Target target) {
+  asm_layout(a);
+
+  uint8_t* code = malloc(a->size);
+  for(size_t i = 0; i < a->item_count; i++) {
+    AsmItem* item = &a->items[i];
+    uint8_t* p = &code[item->offset];
+    uint32_t end = a->base + item->offset + asm_item_size(item);
+    switch(item->kind) {
+    case ASM_BYTES:
+      memcpy(p, &a->data[item->data_offset], item->data_size);
+      break;
+    case ASM_BRANCH:
+      if (!item->is_long) {
+        p[0] = (item->opcode == 0xE9) ? 0xEB : item->opcode;
+        p[1] = (uint8_t)(asm_target(a, item) - end);
+      } else {
+        uint32_t displacement = asm_target(a, item) - end;
+        if ((item->opcode & 0xF0) == 0x70) {
+          *p++ = 0x0F;
+          *p++ = item->opcode + 0x10;
+        } else {
+          *p++ = item->opcode;
+        }
+        memcpy(p, &displacement, 4);
+      }
+      break;
+    }
+  }
+
+  writex(target, a->base, code, a->size);
+  free(code);
+
+  return a->base + a->size;
+}
+
+static void asm_branch(Assembler* a, uint8_t opcode, int label, uint32_t address) {
+  AsmItem* item = asm_item(a, ASM_BRANCH);
+  item->opcode = opcode;
+  item->is_long = (opcode == 0xE8);
+  item->label = label;
+  item->address = address;
+  return;
+}
+
+static void asm_call(Assembler* a, uint32_t address) {
+  asm_branch(a, 0xE8, -1, address);
+  return;
+}
+
+static void asm_jmp(Assembler* a, uint32_t address) {
+  asm_branch(a, 0xE9, -1, address);
+  return;
+}
+
+static void asm_jmp_label(Assembler* a, int label) {
+  asm_branch(a, 0xE9, label, 0);
+  return;
+}
+
+static void asm_jcc(Assembler* a, uint8_t cc, uint32_t address) {
+  asm_branch(a, 0x70 + cc, -1, address);
+  return;
+}
+
+static void asm_jcc_label(Assembler* a, uint8_t cc, int label) {
+  asm_branch(a, 0x70 + cc, label, 0);
+  return;
+}
+
+static void asm_push(Assembler* a, int reg) {
+  asm_u8(a, 0x50 + reg);
+  return;
+}
+
+static void asm_pop(Assembler* a, int reg) {
+  asm_u8(a, 0x58 + reg);
+  return;
+}
+
+static void asm_push_u32(Assembler* a, uint32_t value) {
+  if (((int32_t)value >= -128) && ((int32_t)value <= 127)) {
+    asm_u8(a, 0x6A);
+    asm_u8(a, value);
+  } else {
+    asm_u8(a, 0x68);
+    asm_u32(a, value);
+  }
+  return;
+}
+
+static void asm_retn(Assembler* a) {
+  asm_u8(a, 0xC3);
+  return;
+}
+
+static void asm_add_esp(Assembler* a, int32_t n) {
+  if ((n >= -128) && (n <= 127)) {
+    asm_u8(a, 0x83);
+    asm_u8(a, 0xC4);
+    asm_u8(a, n);
+  } else {
+    asm_u8(a, 0x81);
+    asm_u8(a, 0xC4);
+    asm_u32(a, n);
+  }
+  return;
+}
+
+// Emits ModRM (and SIB / displacement) for [base + displacement]
+static void asm_modrm_memory(Assembler* a, int reg, int base, int32_t displacement) {
+  uint8_t mod;
+  if ((displacement == 0) && (base != REG_EBP)) {
+    mod = 0;
+  } else if ((displacement >= -128) && (displacement <= 127)) {
+    mod = 1;
+  } else {
+    mod = 2;
+  }
+  asm_u8(a, (mod << 6) | (reg << 3) | base);
+  if (base == REG_ESP) {
+    asm_u8(a, 0x24);
+  }
+  if (mod == 1) {
+    asm_u8(a, displacement);
+  } else if (mod == 2) {
+    asm_u32(a, displacement);
+  }
+  return;
+}
+
+static void asm_mov_reg_reg(Assembler* a, int dst, int src) {
+  asm_u8(a, 0x89);
+  asm_u8(a, 0xC0 | (src << 3) | dst);
+  return;
+}
+
+// mov reg, [base + displacement]
+static void asm_mov_reg_memory(Assembler* a, int reg, int base, int32_t displacement) {
+  asm_u8(a, 0x8B);
+  asm_modrm_memory(a, reg, base, displacement);
+  return;
+}
+
+// movzx reg, word [base + displacement]
+static void asm_movzx16_reg_memory(Assembler* a, int reg, int base, int32_t displacement) {
+  asm_u8(a, 0x0F);
+  asm_u8(a, 0xB7);
+  asm_modrm_memory(a, reg, base, displacement);
+  return;
+}
+
+// shr word [base + displacement], count
+static void asm_shr16_memory(Assembler* a, int base, int32_t displacement, uint8_t count) {
+  asm_u8(a, 0x66);
+  asm_u8(a, 0xC1);
+  asm_modrm_memory(a, 5, base, displacement);
+  asm_u8(a, count);
+  return;
+}
+
+static void asm_test_reg_reg(Assembler* a, int reg_a, int reg_b) {
+  asm_u8(a, 0x85);
+  asm_u8(a, 0xC0 | (reg_b << 3) | reg_a);
+  return;
+}
+
+// Instruction length decoder for x86-32.
+// This finds instruction boundaries in game code, so we know which
+// instructions a hook overwrites and how to move them elsewhere.
+
+#define X86_MODRM 0x01
+#define X86_I8 0x02
+#define X86_I16 0x04
+#define X86_IZ 0x08 // 16 or 32 bit, depending on operand size
+#define X86_REL 0x10
+#define X86_PREFIX 0x20
+#define X86_SPECIAL 0x40
+
+#define M X86_MODRM
+#define I8 X86_I8
+#define I16 X86_I16
+#define IZ X86_IZ
+#define REL X86_REL
+#define PFX X86_PREFIX
+#define SP X86_SPECIAL
+
+static const uint8_t x86_opcodes[256] = {
+  /* 0_ */ M, M, M, M, I8, IZ, 0, 0, M, M, M, M, I8, IZ, 0, SP,
+  /* 1_ */ M, M, M, M, I8, IZ, 0, 0, M, M, M, M, I8, IZ, 0, 0,
+  /* 2_ */ M, M, M, M, I8, IZ, PFX, 0, M, M, M, M, I8, IZ, PFX, 0,
+  /* 3_ */ M, M, M, M, I8, IZ, PFX, 0, M, M, M, M, I8, IZ, PFX, 0,
+  /* 4_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 5_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 6_ */ 0, 0, M, M, PFX, PFX, PFX, PFX, IZ, M|IZ, I8, M|I8, 0, 0, 0, 0,
+  /* 7_ */ I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL, I8|REL,
+  /* 8_ */ M|I8, M|IZ, M|I8, M|I8, M, M, M, M, M, M, M, M, M, M, M, M,
+  /* 9_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, SP, 0, 0, 0, 0, 0,
+  /* A_ */ SP, SP, SP, SP, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+  /* B_ */ I8, I8, I8, I8, I8, I8, I8, I8, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ,
+  /* C_ */ M|I8, M|I8, I16, 0, M, M, M|I8, M|IZ, I8|I16, 0, I16, 0, 0, I8, 0, 0,
+  /* D_ */ M, M, M, M, I8, I8, 0, 0, M, M, M, M, M, M, M, M,
+  /* E_ */ I8|REL, I8|REL, I8|REL, I8|REL, I8, I8, I8, I8, IZ|REL, IZ|REL, SP, I8|REL, 0, 0, 0, 0,
+  /* F_ */ PFX, 0, PFX, PFX, 0, 0, M|SP, M|SP, 0, 0, 0, 0, 0, 0, M, M,
+};
+
+static const uint8_t x86_opcodes_0f[256] = {
+  /* 0_ */ M, M, M, M, 0, 0, 0, 0, 0, 0, 0, 0, 0, M, 0, M|I8,
+  /* 1_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  /* 2_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  /* 3_ */ 0, 0, 0, 0, 0, 0, 0, 0, M|SP, M, M|SP, M, M, M, M, M,
+  /* 4_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  /* 5_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  /* 6_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  /* 7_ */ M|I8, M|I8, M|I8, M|I8, M, M, M, 0, M, M, M, M, M, M, M, M,
+  /* 8_ */ IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL, IZ|REL,
+  /* 9_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  /* A_ */ 0, 0, 0, M, M|I8, M, M, M, 0, 0, 0, M, M|I8, M, M, M,
+  /* B_ */ M, M, M, M, M, M, M, M, M, M, M|I8, M, M, M, M, M,
+  /* C_ */ M, M, M|I8, M, M|I8, M|I8, M|I8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* D_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  /* E_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  /* F_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+};
+
+#undef M
+#undef I8
+#undef I16
+#undef IZ
+#undef REL
+#undef PFX
+#undef SP
+
+typedef struct {
+  unsigned int length;
+  uint8_t opcode;
+  bool is_0f;
+
+  // Location of the memory displacement and immediate within the instruction
+  unsigned int displacement_offset;
+  unsigned int displacement_size;
+  unsigned int immediate_offset;
+  unsigned int immediate_size;
+
+  // Set if the immediate is a branch displacement
+  bool is_relative;
+} X86Instruction;
+
+static bool x86_decode(const uint8_t* code, size_t available, X86Instruction* instruction) {
+  memset(instruction, 0x00, sizeof(X86Instruction));
+
+  unsigned int i = 0;
+  bool operand16 = false;
+  bool address16 = false;
+
+  // Skip prefixes
+  while((i < available) && (x86_opcodes[code[i]] & X86_PREFIX)) {
+    if (code[i] == 0x66) {
+      operand16 = true;
+    } else if (code[i] == 0x67) {
+      address16 = true;
+    }
+    i++;
+  }
+
+  // Find the opcode
+  if (i >= available) {
+    return false;
+  }
+  uint8_t opcode = code[i++];
+  uint8_t flags;
+  if (opcode == 0x0F) {
+    if (i >= available) {
+      return false;
+    }
+    opcode = code[i++];
+    instruction->is_0f = true;
+    flags = x86_opcodes_0f[opcode];
+
+    // Three byte opcodes; only 0F 3A has an immediate
+    if (flags & X86_SPECIAL) {
+      if (i >= available) {
+        return false;
+      }
+      i++;
+      flags = X86_MODRM | ((opcode == 0x3A) ? X86_I8 : 0);
+    }
+  } else {
+    flags = x86_opcodes[opcode];
+  }
+  instruction->opcode = opcode;
+
+  unsigned int immediate_size = 0;
+  if (flags & X86_I8) {
+    immediate_size += 1;
+  }
+  if (flags & X86_I16) {
+    immediate_size += 2;
+  }
+  if (flags & X86_IZ) {
+    immediate_size += operand16 ? 2 : 4;
+  }
+
+  unsigned int displacement_size = 0;
+  if (!instruction->is_0f && (flags & X86_SPECIAL)) {
+    switch(opcode) {
+    case 0x9A: // call far
+    case 0xEA: // jmp far
+      immediate_size = operand16 ? 4 : 6;
+      break;
+    case 0xA0: case 0xA1: case 0xA2: case 0xA3: // mov with memory offset
+      displacement_size = address16 ? 2 : 4;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // Parse ModRM and SIB
+  if (flags & X86_MODRM) {
+    if (i >= available) {
+      return false;
+    }
+    uint8_t modrm = code[i++];
+    uint8_t mod = modrm >> 6;
+    uint8_t reg = (modrm >> 3) & 7;
+    uint8_t rm = modrm & 7;
+
+    // test has an immediate, but the other group 3 instructions don't
+    if (!instruction->is_0f && ((opcode == 0xF6) || (opcode == 0xF7)) && (reg <= 1)) {
+      immediate_size = (opcode == 0xF6) ? 1 : (operand16 ? 2 : 4);
+    }
+
+    if (mod != 3) {
+      if (address16) {
+        if (((mod == 0) && (rm == 6)) || (mod == 2)) {
+          displacement_size = 2;
+        } else if (mod == 1) {
+          displacement_size = 1;
+        }
+      } else {
+        if (rm == 4) {
+          if (i >= available) {
+            return false;
+          }
+          uint8_t sib = code[i++];
+          if ((mod == 0) && ((sib & 7) == 5)) {
+            displacement_size = 4;
+          }
+        }
+        if (((mod == 0) && (rm == 5)) || (mod == 2)) {
+          displacement_size = 4;
+        } else if (mod == 1) {
+          displacement_size = 1;
+        }
+      }
+    }
+  }
+
+  instruction->displacement_offset = i;
+  instruction->displacement_size = displacement_size;
+  i += displacement_size;
+  instruction->immediate_offset = i;
+  instruction->immediate_size = immediate_size;
+  i += immediate_size;
+  instruction->is_relative = (flags & X86_REL);
+
+  // Instructions can't be longer than 15 bytes
+  if ((i > available) || (i > 15)) {
+    return false;
+  }
+
+  instruction->length = i;
+  return true;
+}
+
+// cmp dword [address], value
+static void asm_cmp_absolute_u8(Assembler* a, uint32_t address, int8_t value) {
+  asm_u8(a, 0x83);
+  asm_u8(a, 0x3D);
+  asm_u32(a, address);
+  asm_u8(a, value);
+  return;
+}
+
+// Hook trampolines.
+// Each hook site declares which registers (and flags) still hold values the
+// game needs. The hook body declares what it clobbers, and only registers in
+// both sets are saved around it.
+
+#define LIVE(reg) (1 << (reg))
+#define LIVE_FLAGS (1 << 8)
+#define LIVE_ALL_REGISTERS 0xFF
+
+// Registers a cdecl function may change
+#define CLOBBERS_CDECL (LIVE(REG_EAX) | LIVE(REG_ECX) | LIVE(REG_EDX) | LIVE_FLAGS)
+
+typedef enum {
+  // Replaces the destination of the call at address
+  HOOK_CALL,
+
+  // Replaces the code from address to resume, or the first count
+  // instructions at address if resume is 0
+  HOOK_REPLACE
+} HookKind;
+
+typedef struct {
+  HookKind kind;
+  uint32_t address;
+  uint32_t resume;
+  unsigned int count;
+  unsigned int live;
+} HookSite;
+
+// Finds the instructions which will be overwritten by the hook
+static void hook_locate(Target target, HookSite* site) {
+  if (site->kind == HOOK_CALL) {
+    return;
+  }
+
+  uint8_t code[64];
+  readx(target, site->address, code, sizeof(code));
+
+  unsigned int offset = 0;
+  unsigned int count = 0;
+  while(true) {
+    if (site->resume != 0) {
+      if ((site->address + offset) >= site->resume) {
+        break;
+      }
+    } else if (count == site->count) {
+      break;
+    }
+
+    X86Instruction instruction;
+    if (!x86_decode(&code[offset], sizeof(code) - offset, &instruction)) {
+      fprintf(stderr, "Unable to decode instruction at 0x%08X\n", site->address + offset);
+      assert(false);
+    }
+    offset += instruction.length;
+    count++;
+  }
+
+  // Make sure we don't leave partial instructions behind
+  if ((site->resume != 0) && ((site->address + offset) != site->resume)) {
+    fprintf(stderr, "Hook at 0x%08X does not end on an instruction boundary\n", site->address);
+    assert(false);
+  }
+  assert(offset >= 5);
+  site->resume = site->address + offset;
+  return;
+}
+
+// Saves live registers which will be clobbered, returns the stack usage
+static int hook_begin(Assembler* a, const HookSite* site, unsigned int clobbers) {
+  unsigned int saved = site->live & clobbers;
+  int stack = 0;
+  if (saved & LIVE_FLAGS) {
+    asm_u8(a, 0x9C); // pushfd
+    stack += 4;
+  }
+  for(int reg = REG_EDI; reg >= REG_EAX; reg--) {
+    if (saved & LIVE(reg)) {
+      asm_push(a, reg);
+      stack += 4;
+    }
+  }
+  return stack;
+}
+
+// Restores registers saved by hook_begin and returns to the game. Call replacements return or tail-jump by themselves.
+static void hook_end(Assembler* a, const HookSite* site, unsigned int clobbers) {
+  unsigned int saved = site->live & clobbers;
+  for(int reg = REG_EAX; reg <= REG_EDI; reg++) {
+    if (saved & LIVE(reg)) {
+      asm_pop(a, reg);
+    }
+  }
+  if (saved & LIVE_FLAGS) {
+    asm_u8(a, 0x9D); // popfd
+  }
+  if (site->kind != HOOK_CALL) {
+    asm_jmp(a, site->resume);
+  }
+  return;
+}
+
+static void hook_install(Target target, const HookSite* site, uint32_t code) {
+  if (site->kind != HOOK_CALL) {
+    // Jump into the hook, it will jump back
+    assert((site->resume - site->address) >= 5);
+    uint32_t hack_offset = jmp(target, site->address, code);
+    nops(target, hack_offset, site->resume - hack_offset);
+  } else {
+    // Redirect the call
+    write32(target, site->address + 1, code - (site->address + 5));
+  }
+  return;
+}
+
+#if 0
+
+static void* readExe(Target target, uint32_t offset, size_t size) {
+
+  // Find correct location in binary
+  offset = offset;
+
+  // Allocate space for the read
+  void* data = malloc(size);
+
+  // Read the data from the exe
+  off_t previous_offset = ftell(f);
+  fseek(target, offset, SEEK_SET);
+  fread(data, size, 1, f);
+  fseek(target, previous_offset, SEEK_SET);
+
+  return data;
+}
+
+static void dumpTexture(Target target, size_t offset, uint8_t unk0, uint8_t unk1, unsigned int width, unsigned int height, const char* filename) {
+  // Presumably the format information?
+  assert(unk0 == 3);
+  assert(unk1 == 0);
+
+  FILE* out = fopen(filename, "wb");
+  fprintf(out, "P3\n%d %d\n15\n", width, height);
+
+  // Copy the pixel data
+  uint8_t* texture = readExe(target, offset, width * height * 4 / 8);
+  for(unsigned int i = 0; i < width * height * 2; i++) {
+    uint8_t v = ((texture[i / 2] << ((i % 2) * 4)) & 0xF0) >> 4;
+    fprintf(out, "%d %d %d\n", v, v, v);
+  }
+  free(texture);
+
+  fclose(out);
+  return;
+}
+
+static uint32_t dumpTextureTable(Target target, uint32_t offset, uint8_t unk0, uint8_t unk1, unsigned int width, unsigned int height, const char* filename) {
+  char filename_i[4096]; //FIXME: Size
+
+  // Get size of the table
+  uint32_t* buffer = readExe(target, offset + 0, 4);
+  uint32_t count = *buffer;
+  free(buffer);
+
+  // Loop over elements and dump each
+  printf("// %s at 0x%X\n", filename, offset);
+  uint32_t* offsets = readExe(target, offset + 4, count * 4);
+  for(unsigned int i = 0; i < count; i++) {
+    sprintf(filename_i, "%s_%d.ppm", filename, i);
+    printf("// - [%d]: 0x%X\n", i, offsets[i]);
+    dumpTexture(target, offsets[i], unk0, unk1, width, height, filename_i);
+  }
+  free(offsets);
+  return count;
+}
+
+#endif
+
+// Code cave allocator.
+// All patches take their space from here, so the section can't overflow and
+// we can report which patch uses how much of it.
+#define CAVE_CODE_ALIGNMENT 16
+#define CAVE_TEXTURE_ALIGNMENT 4
+
+typedef enum {
+  CAVE_CODE,
+  CAVE_DATA,
+  CAVE_TEXTURES,
+  CAVE_PADDING,
+  CAVE_KIND_COUNT
+} CaveKind;
+
+typedef struct {
+  const char* name;
+  uint32_t used[CAVE_KIND_COUNT];
+} CaveUser;
+
+typedef struct {
+  uint32_t begin;
+  uint32_t end;
+  uint32_t offset;
+
+  // Allocations are accounted to the current user
+  CaveUser* users;
+  unsigned int user_count;
+  unsigned int current;
+} Cave;
+
+static void cave_init(Cave* cave, uint32_t begin, uint32_t size) {
+  memset(cave, 0x00, sizeof(Cave));
+  cave->begin = begin;
+  cave->end = begin + size;
+  cave->offset = begin;
+  return;
+}
+
+static void cave_free(Cave* cave) {
+  free(cave->users);
+  cave->users = NULL;
+  cave->user_count = 0;
+  return;
+}
+
+static void cave_enter(Cave* cave, const char* name) {
+  for(cave->current = 0; cave->current < cave->user_count; cave->current++) {
+    if (!strcmp(cave->users[cave->current].name, name)) {
+      return;
+    }
+  }
+  cave->users = realloc(cave->users, (cave->user_count + 1) * sizeof(CaveUser));
+  CaveUser* user = &cave->users[cave->user_count++];
+  memset(user, 0x00, sizeof(CaveUser));
+  user->name = name;
+  return;
+}
+
+static void cave_claim(Cave* cave, uint32_t size, CaveKind kind) {
+  if ((cave->end - cave->offset) < size) {
+    fprintf(stderr, "Code cave overflow: '%s' needs 0x%X bytes at 0x%08X, only 0x%X left\n",
+            cave->user_count ? cave->users[cave->current].name : "?",
+            size, cave->offset, cave->end - cave->offset);
+    assert(false);
+  }
+  assert(cave->user_count > 0);
+  cave->users[cave->current].used[kind] += size;
+  cave->offset += size;
+  return;
+}
+
+// Pads the next allocation to alignment (a power of 2) and returns its address
+static uint32_t cave_align(Cave* cave, uint32_t alignment) {
+  uint32_t padding = -cave->offset & (alignment - 1);
+  cave_claim(cave, padding, CAVE_PADDING);
+  return cave->offset;
+}
+
+static uint32_t cave_reserve(Cave* cave, uint32_t size, uint32_t alignment, CaveKind kind) {
+  uint32_t address = cave_align(cave, alignment);
+  cave_claim(cave, size, kind);
+  return address;
+}
+
+static uint32_t cave_data(Cave* cave, Target target, const void* data, size_t size, uint32_t alignment) {
+  uint32_t address = cave_reserve(cave, size, alignment, CAVE_DATA);
+  writex(target, address, data, size);
+  return address;
+}
+
+// Writes code which was assembled at cave_align(cave, CAVE_CODE_ALIGNMENT)
+static void cave_commit(Cave* cave, Assembler* a, Target target) {
+  assert(a->base == cave->offset);
+  asm_layout(a);
+  cave_claim(cave, a->size, CAVE_CODE);
+  asm_commit(a, target);
+  return;
+}
+
+static void cave_print(const Cave* cave) {
+  static const char* kinds[CAVE_KIND_COUNT] = { "code", "data", "textures", "padding" };
+  uint32_t totals[CAVE_KIND_COUNT] = { 0 };
+  printf("Code cave at 0x%08X:\n", cave->begin);
+  printf("  %-24s", "patch");
+  for(unsigned int k = 0; k < CAVE_KIND_COUNT; k++) {
+    printf(" %10s", kinds[k]);
+  }
+  printf("\n");
+  for(unsigned int i = 0; i < cave->user_count; i++) {
+    const CaveUser* user = &cave->users[i];
+    printf("  %-24s", user->name);
+    for(unsigned int k = 0; k < CAVE_KIND_COUNT; k++) {
+      printf(" %10u", user->used[k]);
+      totals[k] += user->used[k];
+    }
+    printf("\n");
+  }
+  printf("  %-24s", "total");
+  for(unsigned int k = 0; k < CAVE_KIND_COUNT; k++) {
+    printf(" %10u", totals[k]);
+  }
+  printf("\n");
+  printf("  %u of %u bytes used\n", cave->offset - cave->begin, cave->end - cave->begin);
+  return;
+}
+
+// Runs a function for many indices on all CPUs
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+  void (*function)(void* context, unsigned int index);
+  void* context;
+  unsigned int count;
+  atomic_uint next;
+} ParallelFor;
+
+// Set while a thread works for parallel_for. A nested parallel_for, like
+// converting textures while several files are patched at once, then runs
+// on that thread alone instead of starting threads of its own.
+static _Thread_local bool parallel_nested = false;
+
+static void parallel_work(ParallelFor* parallel) {
+  bool nested = parallel_nested;
+  parallel_nested = true;
+  while(true) {
+    unsigned int index = atomic_fetch_add(&parallel->next, 1);
+    if (index >= parallel->count) {
+      break;
+    }
+    parallel->function(parallel->context, index);
+  }
+  parallel_nested = nested;
+  return;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI parallel_thread(LPVOID argument) {
+  parallel_work(argument);
+  return 0;
+}
+#else
+static void* parallel_thread(void* argument) {
+  parallel_work(argument);
+  return NULL;
+}
+#endif
+
+static unsigned int cpu_count(void) {
+#ifdef _WIN32
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+  return system_info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return (count > 0) ? count : 1;
+#endif
+}
+
+static void parallel_for(unsigned int count, void (*function)(void* context, unsigned int index), void* context) {
+  ParallelFor parallel;
+  parallel.function = function;
+  parallel.context = context;
+  parallel.count = count;
+  atomic_init(&parallel.next, 0);
+
+  // The calling thread also works, so we need one thread less
+  unsigned int thread_count = parallel_nested ? 1 : cpu_count();
+  if (thread_count > count) {
+    thread_count = count;
+  }
+  if (thread_count > 0) {
+    thread_count--;
+  }
+
+#ifdef _WIN32
+  HANDLE threads[64];
+  if (thread_count > 64) {
+    thread_count = 64;
+  }
+  for(unsigned int i = 0; i < thread_count; i++) {
+    threads[i] = CreateThread(NULL, 0, parallel_thread, &parallel, 0, NULL);
+    assert(threads[i] != NULL);
+  }
+  parallel_work(&parallel);
+  for(unsigned int i = 0; i < thread_count; i++) {
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+  }
+#else
+  pthread_t threads[thread_count + 1];
+  for(unsigned int i = 0; i < thread_count; i++) {
+    int status = pthread_create(&threads[i], NULL, parallel_thread, &parallel);
+    assert(status == 0);
+  }
+  parallel_work(&parallel);
+  for(unsigned int i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+#endif
+  return;
+}
+
+// A lock which needs no setup, so it can guard static data
+#ifdef _WIN32
+typedef SRWLOCK Mutex;
+#define MUTEX_INIT SRWLOCK_INIT
+
+static void mutex_lock(Mutex* mutex) {
+  AcquireSRWLockExclusive(mutex);
+  return;
+}
+
+static void mutex_unlock(Mutex* mutex) {
+  ReleaseSRWLockExclusive(mutex);
+  return;
+}
+#else
+typedef pthread_mutex_t Mutex;
+#define MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+
+static void mutex_lock(Mutex* mutex) {
+  int status = pthread_mutex_lock(mutex);
+  assert(status == 0);
+  return;
+}
+
+static void mutex_unlock(Mutex* mutex) {
+  int status = pthread_mutex_unlock(mutex);
+  assert(status == 0);
+  return;
+}
+#endif
+
+static double seconds_now(void) {
+#ifdef _WIN32
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1000000000.0;
+#endif
+}
+
+// Instrumentation for --trace. Each patch runs on its own Tracer, which
+// counts the accesses. Spans cover a patch or a part of it, like a texture
+// table, and are nested by depth.
+typedef struct {
+  char name[32];
+  unsigned int depth;
+  double seconds;
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t bytes_written;
+  uint32_t cave_bytes;
+} TraceSpan;
+
+typedef struct {
+  TraceSpan* spans;
+  unsigned int span_count;
+} Trace;
+
+struct Tracer {
+  Backend backend;
+  Target parent;
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t bytes_written;
+  unsigned int depth;
+  Trace trace;
+};
+
+static void tracer_writex(Target target, off_t offset, const void* data, size_t size) {
+  Tracer* tracer = (Tracer*)target;
+  tracer->writes++;
+  tracer->bytes_written += size;
+  writex(tracer->parent, offset, data, size);
+  return;
+}
+
+static void tracer_readx(Target target, off_t offset, void* data, size_t size) {
+  Tracer* tracer = (Tracer*)target;
+  tracer->reads++;
+  readx(tracer->parent, offset, data, size);
+  return;
+}
+
+static void tracer_init(Tracer* tracer, Target parent) {
+  memset(tracer, 0x00, sizeof(Tracer));
+  tracer->backend.writex = tracer_writex;
+  tracer->backend.readx = tracer_readx;
+  tracer->backend.dry_run = parent->dry_run;
+  tracer->backend.concurrent = parent->concurrent;
+  tracer->backend.addresses = parent->addresses;
+  tracer->backend.tracer = tracer;
+  tracer->parent = parent;
+  return;
+}
+
+static void trace_free(Trace* trace) {
+  free(trace->spans);
+  trace->spans = NULL;
+  trace->span_count = 0;
+  return;
+}
+
+// Starts a span if target is traced, the result is for trace_end
+static unsigned int trace_begin(Target target, const Cave* cave, const char* name) {
+  Tracer* tracer = target->tracer;
+  if (tracer == NULL) {
+    return 0;
+  }
+  Trace* trace = &tracer->trace;
+  trace->spans = realloc(trace->spans, (trace->span_count + 1) * sizeof(TraceSpan));
+  assert(trace->spans != NULL);
+  TraceSpan* span = &trace->spans[trace->span_count];
+  memset(span, 0x00, sizeof(TraceSpan));
+  snprintf(span->name, sizeof(span->name), "%s", name);
+  span->depth = tracer->depth++;
+
+  // Everything starts as the current value, trace_end turns it into the difference
+  span->reads = tracer->reads;
+  span->writes = tracer->writes;
+  span->bytes_written = tracer->bytes_written;
+  span->cave_bytes = cave->offset;
+  span->seconds = seconds_now();
+  return trace->span_count++;
+}
+
+static void trace_end(Target target, const Cave* cave, unsigned int index) {
+  Tracer* tracer = target->tracer;
+  if (tracer == NULL) {
+    return;
+  }
+  TraceSpan* span = &tracer->trace.spans[index];
+  span->seconds = seconds_now() - span->seconds;
+  span->reads = tracer->reads - span->reads;
+  span->writes = tracer->writes - span->writes;
+  span->bytes_written = tracer->bytes_written - span->bytes_written;
+  span->cave_bytes = cave->offset - span->cave_bytes;
+  tracer->depth--;
+  return;
+}
+
+// Moves the spans of a tracer to the end of trace
+static void trace_append(Trace* trace, Tracer* tracer) {
+  Trace* spans = &tracer->trace;
+  trace->spans = realloc(trace->spans, (trace->span_count + spans->span_count) * sizeof(TraceSpan));
+  assert((trace->spans != NULL) || (spans->span_count == 0));
+  memcpy(&trace->spans[trace->span_count], spans->spans, spans->span_count * sizeof(TraceSpan));
+  trace->span_count += spans->span_count;
+  trace_free(spans);
+  return;
+}
+
+static void trace_print_span(const TraceSpan* span) {
+  printf("  %*s%-*s %8.3fms %8llu %8llu %10llu %10u\n",
+         span->depth * 2, "", 28 - span->depth * 2, span->name,
+         span->seconds * 1000.0,
+         (unsigned long long)span->reads,
+         (unsigned long long)span->writes,
+         (unsigned long long)span->bytes_written,
+         span->cave_bytes);
+  return;
+}
+
+static void trace_print(const Trace* trace) {
+  printf("Trace:\n");
+  printf("  %-28s %10s %8s %8s %10s %10s\n", "span", "time", "reads", "writes", "written", "cave");
+  TraceSpan total;
+  memset(&total, 0x00, sizeof(total));
+  strcpy(total.name, "total");
+  for(unsigned int i = 0; i < trace->span_count; i++) {
+    const TraceSpan* span = &trace->spans[i];
+    trace_print_span(span);
+
+    // Nested spans are already part of the patch which contains them
+    if (span->depth == 0) {
+      total.seconds += span->seconds;
+      total.reads += span->reads;
+      total.writes += span->writes;
+      total.bytes_written += span->bytes_written;
+      total.cave_bytes += span->cave_bytes;
+    }
+  }
+  trace_print_span(&total);
+  return;
+}
+
+// Quotes a string for JSON, escaping quotes, backslashes and control bytes
+static void json_write_string(FILE* f, const char* string) {
+  fputc('"', f);
+  for(const char* c = string; *c != '\0'; c++) {
+    unsigned char byte = *c;
+    if ((byte == '"') || (byte == '\\')) {
+      fprintf(f, "\\%c", byte);
+    } else if (byte < 0x20) {
+      fprintf(f, "\\u%04X", byte);
+    } else {
+      fputc(byte, f);
+    }
+  }
+  fputc('"', f);
+  return;
+}
+
+static bool trace_write_json(const Trace* trace, FILE* f) {
+  fprintf(f, "{\n  \"spans\": [");
+  for(unsigned int i = 0; i < trace->span_count; i++) {
+    const TraceSpan* span = &trace->spans[i];
+    fprintf(f, "%s\n    { \"name\": ", (i > 0) ? "," : "");
+    json_write_string(f, span->name);
+    fprintf(f, ", \"depth\": %u, \"seconds\": %.9f, \"reads\": %llu, \"writes\": %llu, \"bytes_written\": %llu, \"cave_bytes\": %u }",
+            span->depth, span->seconds,
+            (unsigned long long)span->reads,
+            (unsigned long long)span->writes,
+            (unsigned long long)span->bytes_written,
+            span->cave_bytes);
+  }
+  fprintf(f, "\n  ]\n}\n");
+  return !ferror(f);
+}
+
+// Texture conversion.
+// Inputs are Gray + Alpha pixels; the game uses 4 bpp, so we
+// keep the upper 4 bits of gray. The first pixel goes to the upper nibble.
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define USE_SIMD 1
+#include <immintrin.h>
+#else
+#define USE_SIMD 0
+#endif
+
+static void pack_4bpp_scalar(uint8_t* out, const uint8_t* in, size_t size) {
+  for(size_t i = 0; i < size; i++) {
+    out[i] = (in[i * 4 + 0] & 0xF0) | (in[i * 4 + 2] >> 4);
+  }
+  return;
+}
+
+#if USE_SIMD
+
+// Each 32 bit lane holds 2 pixels (g0, a0, g1, a1), which become 1 byte
+__attribute__((target("sse2")))
+static __m128i pack_4bpp_sse2_lanes(__m128i v) {
+  v = _mm_and_si128(v, _mm_set1_epi32(0x00F000F0));
+  v = _mm_or_si128(v, _mm_srli_epi32(v, 20));
+  return _mm_and_si128(v, _mm_set1_epi32(0xFF));
+}
+
+__attribute__((target("sse2")))
+static void pack_4bpp_sse2(uint8_t* out, const uint8_t* in, size_t size) {
+  size_t i = 0;
+  for(; i + 16 <= size; i += 16) {
+    const __m128i* p = (const __m128i*)&in[i * 4];
+    __m128i v0 = pack_4bpp_sse2_lanes(_mm_loadu_si128(&p[0]));
+    __m128i v1 = pack_4bpp_sse2_lanes(_mm_loadu_si128(&p[1]));
+    __m128i v2 = pack_4bpp_sse2_lanes(_mm_loadu_si128(&p[2]));
+    __m128i v3 = pack_4bpp_sse2_lanes(_mm_loadu_si128(&p[3]));
+    __m128i v = _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3));
+    _mm_storeu_si128((__m128i*)&out[i], v);
+  }
+  pack_4bpp_scalar(&out[i], &in[i * 4], size - i);
+  return;
+}
+
+__attribute__((target("avx2")))
+static __m256i pack_4bpp_avx2_lanes(__m256i v) {
+  v = _mm256_and_si256(v, _mm256_set1_epi32(0x00F000F0));
+  v = _mm256_or_si256(v, _mm256_srli_epi32(v, 20));
+  return _mm256_and_si256(v, _mm256_set1_epi32(0xFF));
+}
+
+__attribute__((target("avx2")))
+static void pack_4bpp_avx2(uint8_t* out, const uint8_t* in, size_t size) {
+  size_t i = 0;
+  for(; i + 32 <= size; i += 32) {
+    const __m256i* p = (const __m256i*)&in[i * 4];
+    __m256i v0 = pack_4bpp_avx2_lanes(_mm256_loadu_si256(&p[0]));
+    __m256i v1 = pack_4bpp_avx2_lanes(_mm256_loadu_si256(&p[1]));
+    __m256i v2 = pack_4bpp_avx2_lanes(_mm256_loadu_si256(&p[2]));
+    __m256i v3 = pack_4bpp_avx2_lanes(_mm256_loadu_si256(&p[3]));
+    __m256i v = _mm256_packus_epi16(_mm256_packs_epi32(v0, v1), _mm256_packs_epi32(v2, v3));
+
+    // The packs work within 128 bit halves, so we have to fix the order
+    v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    _mm256_storeu_si256((__m256i*)&out[i], v);
+  }
+  pack_4bpp_sse2(&out[i], &in[i * 4], size - i);
+  return;
+}
+
+#endif
+
+// Converts size bytes of 4 bpp output from size * 4 bytes of input
+static void pack_4bpp(uint8_t* out, const uint8_t* in, size_t size) {
+#if USE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    pack_4bpp_avx2(out, in, size);
+    return;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    pack_4bpp_sse2(out, in, size);
+    return;
+  }
+#endif
+  pack_4bpp_scalar(out, in, size);
+  return;
+}
+
+// Reads an entire file at once
+static uint8_t* load_file(const char* path, size_t* size) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t* data = malloc(*size);
+  size_t read = fread(data, 1, *size, f);
+  fclose(f);
+  if (read != *size) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+// Minimal PNG decoder for non-interlaced 8 bit images.
+// Scanlines are handed out as soon as they have been decompressed, so we
+// never hold more than the zlib window and 2 rows in memory.
+
+typedef void (*PngScanline)(void* context, unsigned int y, const uint8_t* pixels, unsigned int channels);
+
+// Each entry is (symbol << 4) | length, indexed by the next 15 bits
+typedef struct {
+  uint16_t entries[1 << 15];
+} Huffman;
+
+typedef struct {
+
+  // Compressed stream, after all IDAT chunks have been joined
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+  uint64_t bits;
+  unsigned int bit_count;
+
+  // History for back-references
+  uint8_t window[1 << 15];
+  uint32_t window_offset;
+
+  // Scanlines, each starting with the filter type
+  unsigned int width;
+  unsigned int height;
+  unsigned int channels;
+  unsigned int stride;
+  unsigned int row;
+  size_t row_offset;
+  uint8_t* current;
+  uint8_t* previous;
+  uint32_t adler_a;
+  uint32_t adler_b;
+  PngScanline scanline;
+  void* context;
+
+  bool failed;
+
+  Huffman lengths;
+  Huffman distances;
+} PngDecoder;
+
+static uint32_t read_be32(const uint8_t* data) {
+  return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+// Missing input is read as zeros; it's detected by the checksum later
+static void png_refill(PngDecoder* png, unsigned int count) {
+  while(png->bit_count < count) {
+    uint64_t byte = (png->offset < png->size) ? png->data[png->offset] : 0;
+    png->bits |= byte << png->bit_count;
+    png->bit_count += 8;
+    png->offset++;
+  }
+  return;
+}
+
+static uint32_t png_bits(PngDecoder* png, unsigned int count) {
+  png_refill(png, count);
+  uint32_t value = png->bits & ((1ULL << count) - 1);
+  png->bits >>= count;
+  png->bit_count -= count;
+  return value;
+}
+
+static bool png_build_huffman(Huffman* huffman, const uint8_t* lengths, unsigned int count) {
+  unsigned int counts[16] = { 0 };
+  for(unsigned int i = 0; i < count; i++) {
+    counts[lengths[i]]++;
+  }
+  counts[0] = 0;
+
+  // Reject codes with more symbols than their length allows
+  int left = 1;
+  uint16_t next_code[16];
+  uint16_t code = 0;
+  for(unsigned int length = 1; length < 16; length++) {
+    left = (left << 1) - counts[length];
+    if (left < 0) {
+      return false;
+    }
+    next_code[length] = code;
+    code = (code + counts[length]) << 1;
+  }
+
+  // Unused entries stay 0, which is never a valid length
+  memset(huffman->entries, 0x00, sizeof(huffman->entries));
+  for(unsigned int symbol = 0; symbol < count; symbol++) {
+    unsigned int length = lengths[symbol];
+    if (length == 0) {
+      continue;
+    }
+
+    // Deflate stores codes starting with the most significant bit
+    unsigned int code = next_code[length]++;
+    unsigned int reversed = 0;
+    for(unsigned int i = 0; i < length; i++) {
+      reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    for(unsigned int i = reversed; i < (1 << 15); i += 1 << length) {
+      huffman->entries[i] = (symbol << 4) | length;
+    }
+  }
+  return true;
+}
+
+static int png_decode_symbol(PngDecoder* png, const Huffman* huffman) {
+  png_refill(png, 15);
+  uint16_t entry = huffman->entries[png->bits & 0x7FFF];
+  unsigned int length = entry & 0xF;
+  if (length == 0) {
+    return -1;
+  }
+  png->bits >>= length;
+  png->bit_count -= length;
+  return entry >> 4;
+}
+
+static uint8_t png_paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if ((pa <= pb) && (pa <= pc)) {
+    return a;
+  }
+  return (pb <= pc) ? b : c;
+}
+
+#define PNG_ADLER_NMAX 5552
+
+static void png_finish_row(PngDecoder* png) {
+  uint8_t* line = &png->current[1];
+  const uint8_t* above = &png->previous[1];
+  unsigned int bpp = png->channels;
+
+  // Adler-32 of the decompressed data. The sums are reduced at least every
+  // PNG_ADLER_NMAX bytes, the most which can't overflow 32 bits.
+  unsigned int size = 1 + png->stride;
+  for(unsigned int begin = 0; begin < size; begin += PNG_ADLER_NMAX) {
+    unsigned int end = (size - begin > PNG_ADLER_NMAX) ? (begin + PNG_ADLER_NMAX) : size;
+    for(unsigned int i = begin; i < end; i++) {
+      png->adler_a += png->current[i];
+      png->adler_b += png->adler_a;
+    }
+    png->adler_a %= 65521;
+    png->adler_b %= 65521;
+  }
+
+  switch(png->current[0]) {
+  case 0:
+    break;
+  case 1:
+    for(unsigned int i = bpp; i < png->stride; i++) {
+      line[i] += line[i - bpp];
+    }
+    break;
+  case 2:
+    for(unsigned int i = 0; i < png->stride; i++) {
+      line[i] += above[i];
+    }
+    break;
+  case 3:
+    for(unsigned int i = 0; i < png->stride; i++) {
+      unsigned int left = (i >= bpp) ? line[i - bpp] : 0;
+      line[i] += (left + above[i]) / 2;
+    }
+    break;
+  case 4:
+    for(unsigned int i = 0; i < png->stride; i++) {
+      uint8_t left = (i >= bpp) ? line[i - bpp] : 0;
+      uint8_t upper_left = (i >= bpp) ? above[i - bpp] : 0;
+      line[i] += png_paeth(left, above[i], upper_left);
+    }
+    break;
+  default:
+    png->failed = true;
+    return;
+  }
+
+  png->scanline(png->context, png->row, line, png->channels);
+
+  uint8_t* swap = png->previous;
+  png->previous = png->current;
+  png->current = swap;
+  png->row++;
+  png->row_offset = 0;
+  return;
+}
+
+static void png_output(PngDecoder* png, uint8_t byte) {
+  png->window[png->window_offset++ & 0x7FFF] = byte;
+  if (png->row == png->height) {
+    png->failed = true;
+    return;
+  }
+  png->current[png->row_offset++] = byte;
+  if (png->row_offset == 1 + png->stride) {
+    png_finish_row(png);
+  }
+  return;
+}
+
+static bool png_inflate_block(PngDecoder* png) {
+  static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+  };
+  static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+  };
+  static const uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+  };
+  static const uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+  };
+
+  while(!png->failed) {
+
+    // Stop early if we are reading far past the end of the input
+    if (png->offset > png->size + 8) {
+      return false;
+    }
+
+    int symbol = png_decode_symbol(png, &png->lengths);
+    if (symbol < 0) {
+      return false;
+    } else if (symbol < 256) {
+      png_output(png, symbol);
+    } else if (symbol == 256) {
+      return true;
+    } else {
+      symbol -= 257;
+      if (symbol >= 29) {
+        return false;
+      }
+      unsigned int length = length_base[symbol] + png_bits(png, length_extra[symbol]);
+      int distance_symbol = png_decode_symbol(png, &png->distances);
+      if ((distance_symbol < 0) || (distance_symbol >= 30)) {
+        return false;
+      }
+      uint32_t distance = distance_base[distance_symbol] + png_bits(png, distance_extra[distance_symbol]);
+      if (distance > png->window_offset) {
+        return false;
+      }
+      for(unsigned int i = 0; i < length; i++) {
+        png_output(png, png->window[(png->window_offset - distance) & 0x7FFF]);
+      }
+    }
+  }
+  return false;
+}
+
+static bool png_inflate(PngDecoder* png) {
+
+  // zlib header, deflate without preset dictionary
+  uint8_t cmf = png_bits(png, 8);
+  uint8_t flg = png_bits(png, 8);
+  if (((cmf & 0xF) != 8) || (((cmf << 8) | flg) % 31) || (flg & 0x20)) {
+    return false;
+  }
+
+  bool final;
+  do {
+    final = png_bits(png, 1);
+    unsigned int type = png_bits(png, 2);
+    if (type == 0) {
+
+      // Stored block, which starts at the next byte
+      png_bits(png, png->bit_count % 8);
+      uint16_t length = png_bits(png, 16);
+      uint16_t length_complement = png_bits(png, 16);
+      uint16_t expected = ~length_complement;
+      if (length != expected) {
+        return false;
+      }
+      for(unsigned int i = 0; i < length; i++) {
+        png_output(png, png_bits(png, 8));
+      }
+      if (png->failed || (png->offset > png->size + 8)) {
+        return false;
+      }
+      continue;
+    }
+
+    uint8_t lengths[288 + 32];
+    unsigned int length_count;
+    unsigned int distance_count;
+    if (type == 1) {
+
+      // Fixed codes
+      length_count = 288;
+      distance_count = 30;
+      memset(&lengths[0], 8, 144);
+      memset(&lengths[144], 9, 112);
+      memset(&lengths[256], 7, 24);
+      memset(&lengths[280], 8, 8);
+      memset(&lengths[288], 5, 30);
+    } else if (type == 2) {
+
+      // Dynamic codes, which are compressed using another code
+      static const uint8_t order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+      };
+      length_count = png_bits(png, 5) + 257;
+      distance_count = png_bits(png, 5) + 1;
+      unsigned int code_length_count = png_bits(png, 4) + 4;
+      if ((length_count > 286) || (distance_count > 30)) {
+        return false;
+      }
+      uint8_t code_lengths[19] = { 0 };
+      for(unsigned int i = 0; i < code_length_count; i++) {
+        code_lengths[order[i]] = png_bits(png, 3);
+      }
+      if (!png_build_huffman(&png->lengths, code_lengths, 19)) {
+        return false;
+      }
+
+      unsigned int count = length_count + distance_count;
+      unsigned int i = 0;
+      while(i < count) {
+        int symbol = png_decode_symbol(png, &png->lengths);
+        unsigned int repeat;
+        uint8_t value;
+        if (symbol < 0) {
+          return false;
+        } else if (symbol < 16) {
+          lengths[i++] = symbol;
+          continue;
+        } else if (symbol == 16) {
+          if (i == 0) {
+            return false;
+          }
+          value = lengths[i - 1];
+          repeat = 3 + png_bits(png, 2);
+        } else if (symbol == 17) {
+          value = 0;
+          repeat = 3 + png_bits(png, 3);
+        } else {
+          value = 0;
+          repeat = 11 + png_bits(png, 7);
+        }
+        if (i + repeat > count) {
+          return false;
+        }
+        memset(&lengths[i], value, repeat);
+        i += repeat;
+      }
+      if (lengths[256] == 0) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+
+    if (!png_build_huffman(&png->lengths, &lengths[0], length_count) ||
+        !png_build_huffman(&png->distances, &lengths[length_count], distance_count)) {
+      return false;
+    }
+    if (!png_inflate_block(png)) {
+      return false;
+    }
+  } while(!final);
+
+  // Adler-32 follows at the next byte
+  png_bits(png, png->bit_count % 8);
+  uint32_t adler = 0;
+  for(unsigned int i = 0; i < 4; i++) {
+    adler = (adler << 8) | png_bits(png, 8);
+  }
+  if (png->offset - png->bit_count / 8 > png->size) {
+    return false;
+  }
+  return adler == ((png->adler_b << 16) | png->adler_a);
+}
+
+// Decodes a PNG of the expected size and passes each row to scanline
+static bool png_decode(const uint8_t* file, size_t size, unsigned int width, unsigned int height, PngScanline scanline, void* context) {
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  if ((size < 8) || memcmp(file, signature, 8)) {
+    return false;
+  }
+
+  PngDecoder* png = malloc(sizeof(PngDecoder));
+  memset(png, 0x00, offsetof(PngDecoder, lengths));
+  png->adler_a = 1;
+  png->scanline = scanline;
+  png->context = context;
+
+  // Join all IDAT chunks, which are usually tiny compared to the image
+  uint8_t* data = malloc(size);
+  size_t data_size = 0;
+  bool valid = false;
+  size_t offset = 8;
+  while(offset + 12 <= size) {
+    uint32_t chunk_size = read_be32(&file[offset]);
+    const uint8_t* type = &file[offset + 4];
+    const uint8_t* chunk = &file[offset + 8];
+    if (chunk_size > size - offset - 12) {
+      break;
+    }
+    if (!memcmp(type, "IHDR", 4) && (chunk_size >= 13)) {
+      png->width = read_be32(&chunk[0]);
+      png->height = read_be32(&chunk[4]);
+      uint8_t depth = chunk[8];
+      uint8_t color = chunk[9];
+      uint8_t interlace = chunk[12];
+      switch(color) {
+      case 0: png->channels = 1; break; // Gray
+      case 2: png->channels = 3; break; // RGB
+      case 4: png->channels = 2; break; // Gray + Alpha
+      case 6: png->channels = 4; break; // RGBA
+      default: png->channels = 0; break;
+      }
+      valid = (png->width == width) && (png->height == height) &&
+              (depth == 8) && (png->channels != 0) && (interlace == 0);
+    } else if (!memcmp(type, "IDAT", 4)) {
+      memcpy(&data[data_size], chunk, chunk_size);
+      data_size += chunk_size;
+    } else if (!memcmp(type, "IEND", 4)) {
+      break;
+    }
+    offset += 12 + chunk_size;
+  }
+
+  if (valid) {
+    png->data = data;
+    png->size = data_size;
+    png->stride = png->width * png->channels;
+    png->current = calloc(1 + png->stride, 1);
+    png->previous = calloc(1 + png->stride, 1);
+    valid = png_inflate(png) && !png->failed && (png->row == png->height);
+    free(png->current);
+    free(png->previous);
+  }
+
+  free(data);
+  free(png);
+  return valid;
+}
+
+// Writes a cache entry through a temporary file, so other runs never see
+// partial files. Failing to store is not fatal, the entry is just computed
+// again next time.
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+static void cache_write(const char* directory, const char* path, const void* header, size_t header_size, const void* data, size_t size) {
+#ifdef _WIN32
+  CreateDirectoryA(directory, NULL);
+#else
+  mkdir(directory, 0777);
+#endif
+
+  // Several entries may be stored at once by different threads
+  static atomic_uint counter;
+  char temporary_path[4096 + 32];
+#ifdef _WIN32
+  unsigned long process = GetCurrentProcessId();
+#else
+  unsigned long process = getpid();
+#endif
+  sprintf(temporary_path, "%s.%lu.%u.tmp", path, process, atomic_fetch_add(&counter, 1));
+  FILE* f = fopen(temporary_path, "wb");
+  if (f == NULL) {
+    return;
+  }
+  bool written = (fwrite(header, 1, header_size, f) == header_size) &&
+                 (fwrite(data, 1, size, f) == size);
+  written &= (fclose(f) == 0);
+
+#ifdef _WIN32
+  written = written && MoveFileExA(temporary_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+  written = written && (rename(temporary_path, path) == 0);
+#endif
+  if (!written) {
+    remove(temporary_path);
+  }
+  return;
+}
+
+#if USE_TEXTURE_CACHE
+
+// Converted textures are stored in this folder, named after a hash of the
+// input and everything which affects the conversion.
+// Bump the version whenever the output of pack_4bpp changes.
+#define TEXTURE_CACHE_PATH "textures/cache"
+#define TEXTURE_CACHE_VERSION 2
+#define TEXTURE_CACHE_MAGIC 0x50504234 // "4BPP"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint64_t input_hash;
+  uint64_t data_hash;
+  uint64_t size;
+} TextureCacheHeader;
+
+static void texture_cache_path(char* path, const TextureCacheHeader* header) {
+  uint64_t key = fnv1a(header, offsetof(TextureCacheHeader, data_hash), FNV_OFFSET);
+  sprintf(path, TEXTURE_CACHE_PATH "/%016llX.4bpp", (unsigned long long)key);
+  return;
+}
+
+// Returns the converted texture or NULL if there's no valid cache entry
+static uint8_t* texture_cache_load(TextureCacheHeader* header) {
+  char path[4096];
+  texture_cache_path(path, header);
+  size_t size;
+  uint8_t* file = load_file(path, &size);
+  if (file == NULL) {
+    return NULL;
+  }
+
+  // Anything unexpected is treated as a miss and overwritten later
+  TextureCacheHeader stored;
+  bool valid = (size == sizeof(stored) + header->size);
+  if (valid) {
+    memcpy(&stored, file, sizeof(stored));
+    valid = (stored.magic == header->magic) &&
+            (stored.version == header->version) &&
+            (stored.width == header->width) &&
+            (stored.height == header->height) &&
+            (stored.input_hash == header->input_hash) &&
+            (stored.size == header->size) &&
+            (stored.data_hash == fnv1a(&file[sizeof(stored)], stored.size, FNV_OFFSET));
+  }
+  if (!valid) {
+    free(file);
+    return NULL;
+  }
+
+  header->data_hash = stored.data_hash;
+  memmove(file, &file[sizeof(stored)], stored.size);
+  return file;
+}
+
+static void texture_cache_store(const TextureCacheHeader* header, const uint8_t* data) {
+  char path[4096];
+  texture_cache_path(path, header);
+  cache_write(TEXTURE_CACHE_PATH, path, header, sizeof(*header), data, header->size);
+  return;
+}
+
+#endif
+
+// Textures are converted in parallel after all tables have been prepared.
+// They are placed in the order they were queued, so the result doesn't
+// depend on the order of conversion.
+#define TEXTURE_PATH_FORMAT "textures/%s_%d_test.png"
+
+typedef struct {
+  char path[4096];
+  uint32_t table_entry;
+  uint32_t width;
+  uint32_t height;
+  size_t size;
+  uint8_t* data;
+  uint64_t hash;
+} TextureJob;
+
+typedef struct {
+  TextureJob* jobs;
+  unsigned int count;
+} Textures;
+
+// Converted textures are kept, so we only convert once for measuring and
+// patching. Files which are patched at the same time share them: the lock
+// covers the list, and entries are only added, never changed, so their data
+// can be used after unlocking.
+static Mutex converted_lock = MUTEX_INIT;
+static TextureJob* converted_textures = NULL;
+static unsigned int converted_texture_count = 0;
+
+// Only the intensity is used; fonts are gray, so that's the first channel
+static void pack_scanline(void* context, unsigned int y, const uint8_t* pixels, unsigned int channels) {
+  TextureJob* job = context;
+  uint8_t gray_alpha[job->width * 2];
+  for(unsigned int x = 0; x < job->width; x++) {
+    gray_alpha[x * 2 + 0] = pixels[x * channels];
+    gray_alpha[x * 2 + 1] = 0xFF;
+  }
+  pack_4bpp(&job->data[y * job->width / 2], gray_alpha, job->width / 2);
+  return;
+}
+
+static void convert_texture(void* context, unsigned int index) {
+  Textures* textures = context;
+  TextureJob* job = &textures->jobs[index];
+  if (job->data != NULL) {
+    return;
+  }
+
+  printf("Loading '%s'\n", job->path);
+  size_t input_size;
+  uint8_t* input = load_file(job->path, &input_size);
+  if (input == NULL) {
+    fprintf(stderr, "Unable to load '%s'\n", job->path);
+    assert(false);
+  }
+
+#if USE_TEXTURE_CACHE
+  TextureCacheHeader header;
+  memset(&header, 0x00, sizeof(header));
+  header.magic = TEXTURE_CACHE_MAGIC;
+  header.version = TEXTURE_CACHE_VERSION;
+  header.width = job->width;
+  header.height = job->height;
+  header.input_hash = fnv1a(input, input_size, FNV_OFFSET);
+  header.size = job->size;
+  job->data = texture_cache_load(&header);
+  if (job->data != NULL) {
+    free(input);
+    job->hash = header.data_hash;
+    return;
+  }
+#endif
+
+  job->data = malloc(job->size);
+  if (!png_decode(input, input_size, job->width, job->height, pack_scanline, job)) {
+    fprintf(stderr, "Unable to decode '%s', expected a %ux%u 8 bit PNG\n", job->path, job->width, job->height);
+    assert(false);
+  }
+  free(input);
+
+  job->hash = fnv1a(job->data, job->size, FNV_OFFSET);
+
+#if USE_TEXTURE_CACHE
+  header.data_hash = job->hash;
+  texture_cache_store(&header, job->data);
+#endif
+  return;
+}
+
+static void write_textures(Target target, Cave* cave, Textures* textures) {
+  unsigned int span = trace_begin(target, cave, "textures");
+
+  // Find textures which have been converted before
+  mutex_lock(&converted_lock);
+  for(unsigned int i = 0; i < textures->count; i++) {
+    TextureJob* job = &textures->jobs[i];
+    for(unsigned int j = 0; j < converted_texture_count; j++) {
+      TextureJob* converted = &converted_textures[j];
+      if (!strcmp(converted->path, job->path) && (converted->size == job->size)) {
+        job->data = converted->data;
+        job->hash = converted->hash;
+        break;
+      }
+    }
+  }
+
+  // Convert all other textures at once and keep them. The lock is held
+  // meanwhile, so other files wait for these instead of converting them too.
+  unsigned int missing = 0;
+  for(unsigned int i = 0; i < textures->count; i++) {
+    missing += (textures->jobs[i].data == NULL);
+  }
+  if (missing > 0) {
+    parallel_for(textures->count, convert_texture, textures);
+    converted_textures = realloc(converted_textures, (converted_texture_count + textures->count) * sizeof(TextureJob));
+    for(unsigned int i = 0; i < textures->count; i++) {
+      TextureJob* job = &textures->jobs[i];
+      bool known = false;
+      for(unsigned int j = 0; j < converted_texture_count; j++) {
+        known |= (converted_textures[j].data == job->data);
+      }
+      if (!known) {
+        converted_textures[converted_texture_count++] = *job;
+      }
+    }
+  }
+  mutex_unlock(&converted_lock);
+
+  // Write everything in order
+  size_t saved = 0;
+  uint32_t* addresses = malloc(textures->count * sizeof(uint32_t));
+  for(unsigned int i = 0; i < textures->count; i++) {
+    TextureJob* job = &textures->jobs[i];
+
+    // Look for an identical texture which we have already written
+    unsigned int j;
+    for(j = 0; j < i; j++) {
+      TextureJob* other = &textures->jobs[j];
+      if ((other->hash == job->hash) && (other->size == job->size) && !memcmp(other->data, job->data, job->size)) {
+        break;
+      }
+    }
+    if (j < i) {
+      addresses[i] = addresses[j];
+      saved += job->size;
+    } else {
+
+      // Write pixel data to game
+      addresses[i] = cave_reserve(cave, job->size, CAVE_TEXTURE_ALIGNMENT, CAVE_TEXTURES);
+      writex(target, addresses[i], job->data, job->size);
+    }
+
+    // Patch the table entry
+    uint32_t texture_old = read32(target, job->table_entry);
+    write32(target, job->table_entry, addresses[i]);
+    if (!target->dry_run) {
+      printf("%s: 0x%X -> 0x%X\n", job->path, texture_old, addresses[i]);
+    }
+  }
+  free(addresses);
+  if (!target->dry_run) {
+    printf("Saved %zu bytes by reusing identical textures\n", saved);
+  }
+
+  free(textures->jobs);
+  textures->jobs = NULL;
+  textures->count = 0;
+  trace_end(target, cave, span);
+  return;
+}
+
+static void patchTextureTable(Target target, Cave* cave, Textures* textures, uint32_t offset, uint32_t code_offset, uint32_t width, uint32_t height, const char* filename) {
+  unsigned int span = trace_begin(target, cave, filename);
+
+  // Create a code cave
+  // The original argument for the width is only 8 bit (signed), so it's hard
+  // to extend. That's why we use a code cave.
+  // It replaces the 4 instructions which push the texture size.
+  HookSite site = { .kind = HOOK_REPLACE, .address = code_offset, .count = 4, .live = 0 };
+  hook_locate(target, &site);
+
+  Assembler a;
+  asm_init(&a, cave_align(cave, CAVE_CODE_ALIGNMENT));
+
+  int cave_code = asm_here(&a);
+
+  // Patches the arguments for the texture loader
+  hook_begin(&a, &site, 0);
+  asm_push_u32(&a, height);
+  asm_push_u32(&a, width);
+  asm_push_u32(&a, height);
+  asm_push_u32(&a, width);
+  hook_end(&a, &site, 0);
+
+  cave_commit(cave, &a, target);
+  uint32_t cave_memory_offset = asm_address(&a, cave_code);
+  asm_free(&a);
+
+  //FIXME: Fixup the format?
+  //.text:0042D794                 push    0
+  //.text:0042D796                 push    3
+
+  // Write code to jump into the codecave (5 bytes) and clear original code
+  hook_install(target, &site, cave_memory_offset);
+  if (!target->dry_run) {
+    printf("Tying to jump to 0x%08X\n", cave_memory_offset);
+  }
+
+  // Get number of textures in the table
+  uint32_t count = read32(target, offset + 0);
+
+  // Have a buffer for pixeldata
+  unsigned int texture_size = width * height * 4 / 8;
+
+  // Queue all textures for loading
+  textures->jobs = realloc(textures->jobs, (textures->count + count) * sizeof(TextureJob));
+  for(unsigned int i = 0; i < count; i++) {
+    TextureJob* job = &textures->jobs[textures->count++];
+    sprintf(job->path, TEXTURE_PATH_FORMAT, filename, i);
+    job->table_entry = offset + 4 + i * 4;
+    job->width = width;
+    job->height = height;
+    job->size = texture_size;
+    job->data = NULL;
+  }
+
+  trace_end(target, cave, span);
+  return;
+}
+
+// Addresses in the game which the patches use. They are built in for the
+// known build; other builds are searched for signatures, which are all
+// resolved in one pass over the sections.
+#define KNOWN_TIMESTAMP 0x3C60692C
+
+typedef enum {
+  ADDRESS_NONE,
+  ADDRESS_FONT0_TABLE,
+  ADDRESS_FONT1_TABLE,
+  ADDRESS_FONT2_TABLE,
+  ADDRESS_FONT3_TABLE,
+  ADDRESS_FONT4_TABLE,
+  ADDRESS_FONT0_CODE,
+  ADDRESS_FONT1_CODE,
+  ADDRESS_FONT2_CODE,
+  ADDRESS_FONT3_CODE,
+  ADDRESS_FONT4_CODE,
+  ADDRESS_NETWORK_GUID,
+  ADDRESS_UPGRADE_MENU_LEVEL,
+  ADDRESS_UPGRADE_MENU_HEALTH,
+  ADDRESS_UPGRADE_HOOK,
+  ADDRESS_UPGRADE_HOOK_END,
+  ADDRESS_GENERATE_UPGRADED_HANDLING,
+  ADDRESS_COLLISION_CALL,
+  ADDRESS_COLLISION_FUNCTION,
+  ADDRESS_IS_MULTIPLAYER,
+  ADDRESS_AUDIO_STREAM_FORMAT,
+  ADDRESS_AUDIO_STREAM_CHUNK,
+  ADDRESS_SPRINTF,
+  ADDRESS_LOAD_SPRITE,
+  ADDRESS_LOAD_SPRITE_INTERNAL,
+  ADDRESS_LOAD_SPRITE_TGA,
+  ADDRESS_SHOW_MESSAGE,
+  ADDRESS_TRIGGER_CALL,
+  ADDRESS_RUN_TRIGGER,
+  ADDRESS_COUNT
+} AddressId;
+
+#define ADDRESS_BIT(id) (1ULL << (id))
+
+// How an address follows from the match of its signature
+typedef enum {
+  RESOLVE_MATCH,   // It's in the match, at offset
+  RESOLVE_POINTER, // The match has it as an operand at offset
+  RESOLVE_CALL     // The match has a call at offset, it's the destination
+} AddressResolve;
+
+// The font loaders push the texture size as 8 bit immediates, then the table
+#define FONT_SIGNATURE "68 80 00 00 00 6A 40 68 80 00 00 00 6A 40 6A ?? 6A ?? 68 ?? ?? ?? ??"
+
+// The application GUID is copied into the session description
+#define NETWORK_GUID_SIGNATURE "BE ?? ?? ?? ?? 8D 7C 24 ?? A5 A5 A5 A5"
+
+// The menu stores upgrade level and health, then passes their addresses
+#define UPGRADE_MENU_SIGNATURE "C6 44 24 ?? ?? C6 44 24 ?? ?? 8D ?? 24 ?? 8D ?? 24 ??"
+
+// The hook replaces the pushes up to the next instruction, which is the end
+#define UPGRADE_HOOK_SIGNATURE "8D 54 24 ?? 50 55 56"
+
+// The race setup passes the upgrades and the output table to the generator
+#define UPGRADE_HANDLING_SIGNATURE "52 50 55 68 ?? ?? ?? ?? 88 4C 34 ?? E8 ?? ?? ?? ??"
+
+// The collision check is called, and its result tested right away
+#define COLLISION_SIGNATURE "E8 ?? ?? ?? ?? 83 C4 08 85 C0 74"
+
+// The flag is a dword which is compared to 0
+#define IS_MULTIPLAYER_SIGNATURE "83 3D ?? ?? ?? ?? 00 75 ?? 6A"
+
+// Buffer size, bits per sample, channels and sample rate of the stream format
+#define AUDIO_STREAM_FORMAT_SIGNATURE "68 ?? ?? ?? ?? 6A ?? 6A ?? 68 ?? ?? ?? ?? E8"
+
+// The chunk size is pushed twice, then stored
+#define AUDIO_STREAM_CHUNK_SIGNATURE "68 ?? ?? ?? ?? 68 ?? ?? ?? ?? C7 ?? ?? ?? ?? ?? ??"
+
+// The C runtime sets up a string as a file
+#define SPRINTF_SIGNATURE "55 8B EC 83 EC 20 8B 45 08 56 89 45 ?? 89 45 ?? 8D 45 10 C7 45 ?? 42 00 00 00"
+
+// The sprite loader only passes the index to the internal one
+#define LOAD_SPRITE_SIGNATURE "FF 74 24 04 E8 ?? ?? ?? ?? 83 C4 04"
+
+// A TGA is loaded from a path, and the result tested
+#define LOAD_SPRITE_TGA_SIGNATURE "68 ?? ?? ?? ?? E8 ?? ?? ?? ?? 83 C4 04 85 C0 75"
+
+// Messages are shown with a text and a float duration
+#define SHOW_MESSAGE_SIGNATURE "68 ?? ?? ?? 40 50 E8 ?? ?? ?? ?? 83 C4 08"
+
+// Each trigger is run with its pointer
+#define TRIGGER_SIGNATURE "56 E8 ?? ?? ?? ?? 83 C4 04"
+
+// Each address is found by a signature, which has to match exactly
+// match_count times in the game. The address is then taken from the match
+// at offset, see AddressResolve. The known build keeps the built-in
+// addresses, and reports signatures which find something else.
+static const struct {
+  const char* name;
+  uint32_t known;
+  const char* signature;
+  unsigned int match;
+  unsigned int match_count;
+  unsigned int offset;
+  AddressResolve resolve;
+} address_info[ADDRESS_COUNT] = {
+  [ADDRESS_FONT0_TABLE] = { "font0_table", 0x4BF91C, FONT_SIGNATURE, 0, 5, 19, RESOLVE_POINTER },
+  [ADDRESS_FONT1_TABLE] = { "font1_table", 0x4BF7E4, FONT_SIGNATURE, 1, 5, 19, RESOLVE_POINTER },
+  [ADDRESS_FONT2_TABLE] = { "font2_table", 0x4BF84C, FONT_SIGNATURE, 2, 5, 19, RESOLVE_POINTER },
+  [ADDRESS_FONT3_TABLE] = { "font3_table", 0x4BF8B4, FONT_SIGNATURE, 3, 5, 19, RESOLVE_POINTER },
+  [ADDRESS_FONT4_TABLE] = { "font4_table", 0x4BF984, FONT_SIGNATURE, 4, 5, 19, RESOLVE_POINTER },
+  [ADDRESS_FONT0_CODE] = { "font0_code", 0x42D745, FONT_SIGNATURE, 0, 5 },
+  [ADDRESS_FONT1_CODE] = { "font1_code", 0x42D786, FONT_SIGNATURE, 1, 5 },
+  [ADDRESS_FONT2_CODE] = { "font2_code", 0x42D7C7, FONT_SIGNATURE, 2, 5 },
+  [ADDRESS_FONT3_CODE] = { "font3_code", 0x42D808, FONT_SIGNATURE, 3, 5 },
+  [ADDRESS_FONT4_CODE] = { "font4_code", 0x42D849, FONT_SIGNATURE, 4, 5 },
+  [ADDRESS_NETWORK_GUID] = { "network_guid", 0x4AF9B0, NETWORK_GUID_SIGNATURE, 0, 1, 1, RESOLVE_POINTER },
+  [ADDRESS_UPGRADE_MENU_LEVEL] = { "upgrade_menu_level", 0x45CFC6, UPGRADE_MENU_SIGNATURE, 0, 1, 4 },
+  [ADDRESS_UPGRADE_MENU_HEALTH] = { "upgrade_menu_health", 0x45CFCB, UPGRADE_MENU_SIGNATURE, 0, 1, 9 },
+  [ADDRESS_UPGRADE_HOOK] = { "upgrade_hook", 0x45B765, UPGRADE_HOOK_SIGNATURE, 0, 1 },
+  [ADDRESS_UPGRADE_HOOK_END] = { "upgrade_hook_end", 0x45B76C, UPGRADE_HOOK_SIGNATURE, 0, 1, 7 },
+  [ADDRESS_GENERATE_UPGRADED_HANDLING] = { "generate_upgraded_handling", 0x449D00, UPGRADE_HANDLING_SIGNATURE, 0, 1, 12, RESOLVE_CALL },
+  [ADDRESS_COLLISION_CALL] = { "collision_call", 0x47B5AF, COLLISION_SIGNATURE, 0, 1 },
+  [ADDRESS_COLLISION_FUNCTION] = { "collision_function", 0x47B0C0, COLLISION_SIGNATURE, 0, 1, 0, RESOLVE_CALL },
+  [ADDRESS_IS_MULTIPLAYER] = { "is_multiplayer", 0x4D5E00, IS_MULTIPLAYER_SIGNATURE, 0, 1, 2, RESOLVE_POINTER },
+  [ADDRESS_AUDIO_STREAM_FORMAT] = { "audio_stream_format", 0x423215, AUDIO_STREAM_FORMAT_SIGNATURE, 0, 1, 1 },
+  [ADDRESS_AUDIO_STREAM_CHUNK] = { "audio_stream_chunk", 0x423549, AUDIO_STREAM_CHUNK_SIGNATURE, 0, 1, 1 },
+  [ADDRESS_SPRINTF] = { "sprintf", 0x49EB80, SPRINTF_SIGNATURE, 0, 1 },
+  [ADDRESS_LOAD_SPRITE] = { "load_sprite", 0x446FB0, LOAD_SPRITE_SIGNATURE, 0, 1 },
+  [ADDRESS_LOAD_SPRITE_INTERNAL] = { "load_sprite_internal", 0x446CA0, LOAD_SPRITE_SIGNATURE, 0, 1, 4, RESOLVE_CALL },
+  [ADDRESS_LOAD_SPRITE_TGA] = { "load_sprite_from_tga", 0x4114D0, LOAD_SPRITE_TGA_SIGNATURE, 0, 1, 5, RESOLVE_CALL },
+  [ADDRESS_SHOW_MESSAGE] = { "show_message", 0x44FCE0, SHOW_MESSAGE_SIGNATURE, 0, 1, 6, RESOLVE_CALL },
+  [ADDRESS_TRIGGER_CALL] = { "trigger_call", 0x476E80, TRIGGER_SIGNATURE, 0, 1, 1 },
+  [ADDRESS_RUN_TRIGGER] = { "run_trigger", 0x47CE60, TRIGGER_SIGNATURE, 0, 1, 1, RESOLVE_CALL }
+};
+
+static uint32_t address(Target target, AddressId id) {
+  assert(target->addresses != NULL);
+  uint32_t value = target->addresses[id];
+  assert(value != 0);
+  return value;
+}
+
+#define SIGNATURE_MAX_SIZE 64
+#define SIGNATURE_MAX_MATCHES 16
+
+typedef struct {
+  const char* text;
+  uint8_t bytes[SIGNATURE_MAX_SIZE];
+  uint8_t mask[SIGNATURE_MAX_SIZE];
+  unsigned int size;
+
+  // Candidates are found by this byte, which should be a rare one
+  unsigned int anchor;
+
+  uint32_t matches[SIGNATURE_MAX_MATCHES];
+  unsigned int match_count;
+} Signature;
+
+static void signature_compile(Signature* signature, const char* text) {
+  memset(signature, 0x00, sizeof(Signature));
+  signature->text = text;
+  const char* c = text;
+  while(*c != '\0') {
+    if (*c == ' ') {
+      c++;
+      continue;
+    }
+    assert(signature->size < SIGNATURE_MAX_SIZE);
+    if (c[0] == '?') {
+      assert(c[1] == '?');
+    } else {
+      unsigned int value;
+      int parsed = sscanf(c, "%2X", &value);
+      assert(parsed == 1);
+      signature->bytes[signature->size] = value;
+      signature->mask[signature->size] = 0xFF;
+    }
+    signature->size++;
+    c += 2;
+  }
+
+  // Zeros, padding and common opcodes would give many false candidates
+  unsigned int best_score = 4;
+  for(unsigned int i = 0; i < signature->size; i++) {
+    if (signature->mask[i] == 0x00) {
+      continue;
+    }
+    uint8_t byte = signature->bytes[i];
+    unsigned int score = 0;
+    if ((byte == 0x00) || (byte == 0xFF)) {
+      score = 3;
+    } else if ((byte == 0xCC) || (byte == 0x90) || (byte == 0x8B) || (byte == 0x89) || (byte == 0xE8)) {
+      score = 2;
+    }
+    if (score < best_score) {
+      best_score = score;
+      signature->anchor = i;
+    }
+  }
+  assert(best_score != 4);
+  return;
+}
+
+static void signature_check(Signature* signature, const uint8_t* data, size_t size, size_t position, uint32_t address) {
+  if ((position < signature->anchor) || ((position - signature->anchor + signature->size) > size)) {
+    return;
+  }
+  const uint8_t* start = &data[position - signature->anchor];
+  for(unsigned int i = 0; i < signature->size; i++) {
+    if ((start[i] & signature->mask[i]) != signature->bytes[i]) {
+      return;
+    }
+  }
+  if (signature->match_count < SIGNATURE_MAX_MATCHES) {
+    signature->matches[signature->match_count] = address + (position - signature->anchor);
+  }
+  signature->match_count++;
+  return;
+}
+
+// Checks all signatures whose anchor byte is at position
+static void signatures_check(Signature* signatures, unsigned int count, const uint8_t* data, size_t size, size_t position, uint32_t address) {
+  for(unsigned int i = 0; i < count; i++) {
+    if (signatures[i].bytes[signatures[i].anchor] == data[position]) {
+      signature_check(&signatures[i], data, size, position, address);
+    }
+  }
+  return;
+}
+
+#if USE_SIMD
+
+// Compares 16 bytes against all anchor bytes at once, and only checks the
+// candidates. Returns where the scalar loop has to continue.
+__attribute__((target("sse2")))
+static size_t signatures_scan_sse2(Signature* signatures, unsigned int count, const uint8_t* anchors, unsigned int anchor_count, const uint8_t* data, size_t size, uint32_t address) {
+  size_t position = 0;
+  for(; position + 16 <= size; position += 16) {
+    uint32_t bits = 0;
+    __m128i v = _mm_loadu_si128((const __m128i*)&data[position]);
+    for(unsigned int i = 0; i < anchor_count; i++) {
+      bits |= _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(anchors[i])));
+    }
+    while(bits != 0) {
+      size_t candidate = position + __builtin_ctz(bits);
+      bits &= bits - 1;
+      signatures_check(signatures, count, data, size, candidate, address);
+    }
+  }
+  return position;
+}
+
+#endif
+
+// Finds all signatures in data, which is at address in the game. Only bytes
+// which are the anchor of a signature are checked further.
+static void signatures_scan(Signature* signatures, unsigned int count, const uint8_t* data, size_t size, uint32_t address) {
+  bool is_anchor[256] = { false };
+  uint8_t anchors[256];
+  unsigned int anchor_count = 0;
+  for(unsigned int i = 0; i < count; i++) {
+    uint8_t byte = signatures[i].bytes[signatures[i].anchor];
+    if (!is_anchor[byte]) {
+      is_anchor[byte] = true;
+      anchors[anchor_count++] = byte;
+    }
+  }
+
+  size_t position = 0;
+#if USE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    position = signatures_scan_sse2(signatures, count, anchors, anchor_count, data, size, address);
+  }
+#endif
+  for(; position < size; position++) {
+    if (is_anchor[data[position]]) {
+      signatures_check(signatures, count, data, size, position, address);
+    }
+  }
+  return;
+}
+
+#if USE_ADDRESS_CACHE
+
+// Resolved addresses are stored next to the converted textures
+#define ADDRESS_CACHE_PATH "textures/cache"
+#define ADDRESS_CACHE_VERSION 1
+#define ADDRESS_CACHE_MAGIC 0x52444441 // "ADDR"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;
+  uint32_t addresses[ADDRESS_COUNT];
+} AddressCache;
+
+// Everything which affects the addresses: the game build and our tables.
+// The build is identified by its timestamp, size and section table. The
+// patch section and CheckSum are ignored, as patching changes them, so
+// patched files share the entry of their build.
+static uint64_t address_cache_key(Target target, uint32_t coff_header, uint32_t timestamp) {
+  uint32_t optional_header = coff_header + 20;
+  uint32_t section_header = optional_header + read16(target, coff_header + 16);
+  uint16_t section_count = read16(target, coff_header + 2);
+
+  // The patch section starts where the image ended before, see patch_game
+  uint32_t size_of_image = (read32(target, optional_header + 56) + 0xFFF) & ~0xFFF;
+  uint64_t key = FNV_OFFSET;
+  for(unsigned int i = 0; i < section_count; i++) {
+    uint8_t header[40];
+    readx(target, section_header + i * 40, header, sizeof(header));
+    if (memcmp(header, "hack\0\0\0\0", 8)) {
+      key = fnv1a(header, sizeof(header), key);
+    } else {
+      memcpy(&size_of_image, &header[12], 4);
+    }
+  }
+  uint32_t values[3] = {
+    ADDRESS_CACHE_VERSION,
+    timestamp,
+    size_of_image
+  };
+  key = fnv1a(values, sizeof(values), key);
+  for(unsigned int i = 0; i < ADDRESS_COUNT; i++) {
+    const char* texts[2] = { address_info[i].name, address_info[i].signature };
+    for(unsigned int j = 0; j < 2; j++) {
+      if (texts[j] != NULL) {
+        key = fnv1a(texts[j], strlen(texts[j]) + 1, key);
+      }
+    }
+    uint32_t fields[5] = { address_info[i].known, address_info[i].match, address_info[i].match_count, address_info[i].offset, address_info[i].resolve };
+    key = fnv1a(fields, sizeof(fields), key);
+  }
+  return key;
+}
+
+static void address_cache_path(char* path, uint64_t key) {
+  sprintf(path, ADDRESS_CACHE_PATH "/%016llX.addr", (unsigned long long)key);
+  return;
+}
+
+#endif
+
+// Finds the addresses of all signatures in the code and data sections
+static void addresses_scan(Target target, uint32_t image_base, uint32_t coff_header, uint32_t* addresses) {
+  Signature signatures[ADDRESS_COUNT];
+  unsigned int signature_count = 0;
+  unsigned int signature_index[ADDRESS_COUNT];
+  for(unsigned int i = 0; i < ADDRESS_COUNT; i++) {
+    if (address_info[i].signature == NULL) {
+      continue;
+    }
+    unsigned int j;
+    for(j = 0; j < signature_count; j++) {
+      if (!strcmp(signatures[j].text, address_info[i].signature)) {
+        break;
+      }
+    }
+    if (j == signature_count) {
+      signature_compile(&signatures[signature_count++], address_info[i].signature);
+    }
+    signature_index[i] = j;
+  }
+
+  uint32_t optional_header = coff_header + 20;
+  uint32_t section_header = optional_header + read16(target, coff_header + 16);
+  uint16_t section_count = read16(target, coff_header + 2);
+  for(unsigned int i = 0; i < section_count; i++) {
+    uint32_t header = section_header + i * 40;
+    uint32_t characteristics = read32(target, header + 36);
+    if ((read32(target, header + 0) == *(uint32_t*)"hack") || !(characteristics & 0x60)) {
+      continue;
+    }
+    uint32_t virtual_size = read32(target, header + 8);
+    uint32_t raw_size = read32(target, header + 16);
+    uint32_t size = (raw_size < virtual_size) ? raw_size : virtual_size;
+    uint32_t section = image_base + read32(target, header + 12);
+    uint8_t* data = malloc(size);
+    assert(data != NULL);
+    readx(target, section, data, size);
+    signatures_scan(signatures, signature_count, data, size, section);
+    free(data);
+  }
+
+  for(unsigned int i = 0; i < ADDRESS_COUNT; i++) {
+    if (address_info[i].signature == NULL) {
+      continue;
+    }
+    Signature* signature = &signatures[signature_index[i]];
+    if ((signature->match_count == address_info[i].match_count) && (signature->match_count <= SIGNATURE_MAX_MATCHES)) {
+
+      // Sections might not be sorted
+      uint32_t* matches = signature->matches;
+      for(unsigned int j = 1; j < signature->match_count; j++) {
+        for(unsigned int k = j; (k > 0) && (matches[k - 1] > matches[k]); k--) {
+          uint32_t swap = matches[k - 1];
+          matches[k - 1] = matches[k];
+          matches[k] = swap;
+        }
+      }
+      uint32_t match = matches[address_info[i].match] + address_info[i].offset;
+      switch(address_info[i].resolve) {
+      case RESOLVE_MATCH:
+        addresses[i] = match;
+        break;
+      case RESOLVE_POINTER:
+        addresses[i] = read32(target, match);
+        break;
+      case RESOLVE_CALL:
+        addresses[i] = match + 5 + read32(target, match + 1);
+        break;
+      }
+    }
+  }
+  return;
+}
+
+// Finds all addresses for the game in target, which the patches then get
+// from target and every backend on top of it. Addresses which can't be found
+// stay 0, so the patches using them are skipped.
+static void addresses_init(Target target, uint32_t image_base, uint32_t* addresses) {
+  target->addresses = addresses;
+  memset(addresses, 0x00, ADDRESS_COUNT * sizeof(uint32_t));
+
+  uint32_t coff_header = find_coff_header(target, image_base);
+  uint32_t timestamp = read32(target, coff_header + 4);
+
+#if USE_ADDRESS_CACHE
+  // Earlier runs on the same build have done the work already
+  uint64_t key = address_cache_key(target, coff_header, timestamp);
+  char path[4096];
+  address_cache_path(path, key);
+  size_t size;
+  AddressCache* cache = (AddressCache*)load_file(path, &size);
+  if ((cache != NULL) && (size == sizeof(AddressCache)) && (cache->magic == ADDRESS_CACHE_MAGIC) &&
+      (cache->version == ADDRESS_CACHE_VERSION) && (cache->key == key)) {
+    memcpy(addresses, cache->addresses, sizeof(cache->addresses));
+    free(cache);
+    return;
+  }
+  free(cache);
+#endif
+
+  addresses_scan(target, image_base, coff_header, addresses);
+
+  // The known build must give the built-in addresses
+  if (timestamp == KNOWN_TIMESTAMP) {
+    for(unsigned int i = 1; i < ADDRESS_COUNT; i++) {
+      if ((addresses[i] != 0) && (addresses[i] != address_info[i].known)) {
+        fprintf(stderr, "Found %s at 0x%08X, expected 0x%08X\n", address_info[i].name, addresses[i], address_info[i].known);
+      }
+      addresses[i] = address_info[i].known;
+    }
+  }
+
+#if USE_ADDRESS_CACHE
+  AddressCache entry;
+  memset(&entry, 0x00, sizeof(entry));
+  entry.magic = ADDRESS_CACHE_MAGIC;
+  entry.version = ADDRESS_CACHE_VERSION;
+  entry.key = key;
+  memcpy(entry.addresses, addresses, sizeof(entry.addresses));
+  cache_write(ADDRESS_CACHE_PATH, path, &entry, sizeof(entry), NULL, 0);
+#endif
+  return;
+}
+
+static void patch_network_upgrades(Target target, Cave* cave, const uint8_t* upgrade_levels, const uint8_t* upgrade_healths) {
+  // Upgrade network play updates to 100%
+
+#if 0
+  // what the hell is the point of this shit, jay
+  // The following patch only supports the same upgrade level and health for menus
+  // So in order to keep everything synchronized, we assert that only one setting is present for all categories
+  for(int i = 0; i < 7; i++) {
+    assert(upgrade_levels[i] == upgrade_levels[0]);
+    assert(upgrade_healths[i] == upgrade_healths[0]);
+  }
+#endif
+
+  // Now do the actual upgrade for menus
+  write8(target, address(target, ADDRESS_UPGRADE_MENU_LEVEL), upgrade_levels[0]);
+  write8(target, address(target, ADDRESS_UPGRADE_MENU_HEALTH), upgrade_healths[0]);
+
+  //FIXME: Upgrade network player creation
+
+  // 0x45B725 vs 0x45B9FF
+
+  #if 0
+  lea     edx, [esp+1Ch+upgrade_health]
+  lea     eax, [esp+1Ch+upgrade_level]
+  push    edx             ; upgrade_healths
+  push    eax             ; upgrade_levels
+  push    ebp             ; handling_in
+  push    offset handling_out ; handling_out
+  mov     [esp+esi+2Ch+upgrade_health], cl
+  call    _sub_449D00_generate_upgraded_handling_table_data
+  #endif
+
+  // Place upgrade data in memory
+  uint32_t upgrade_levels_address = cave_data(cave, target, upgrade_levels, 7, 1);
+  uint32_t upgrade_healths_address = cave_data(cave, target, upgrade_healths, 7, 1);
+
+
+  // Now inject the code, it replaces code from 0x45B765 to 0x45B76C
+  // The original code keeps using eax and edx after this point
+  HookSite site = { .kind = HOOK_REPLACE, .address = address(target, ADDRESS_UPGRADE_HOOK), .resume = address(target, ADDRESS_UPGRADE_HOOK_END), .live = LIVE(REG_EAX) | LIVE(REG_EDX) };
+  hook_locate(target, &site);
+
+  Assembler a;
+  asm_init(&a, cave_align(cave, CAVE_CODE_ALIGNMENT));
+
+  int upgrade_code = asm_here(&a);
+
+  hook_begin(&a, &site, CLOBBERS_CDECL);
+  asm_push_u32(&a, upgrade_healths_address);
+  asm_push_u32(&a, upgrade_levels_address);
+  asm_push(&a, REG_ESI);
+  asm_push(&a, REG_EDI);
+  asm_call(&a, address(target, ADDRESS_GENERATE_UPGRADED_HANDLING));
+  asm_add_esp(&a, 0x10);
+  hook_end(&a, &site, CLOBBERS_CDECL);
+
+  cave_commit(cave, &a, target);
+  uint32_t memory_offset_upgrade_code = asm_address(&a, upgrade_code);
+  asm_free(&a);
+
+
+  // Install it by jumping from 0x45B765, the hook will return to 0x45B76C
+  hook_install(target, &site, memory_offset_upgrade_code);
+
+  return;
+}
+
+static void patch_network_collisions(Target target, Cave* cave) {
+  // Disable collision between network players
+
+  // Inject the code, it replaces the destination of the call at 0x47B5AF
+  // We only touch the flags, which the call clobbers anyway
+  const HookSite site = { .kind = HOOK_CALL, .address = address(target, ADDRESS_COLLISION_CALL), .live = LIVE_ALL_REGISTERS };
+
+  uint32_t memory_offset_collision_code = cave_align(cave, CAVE_CODE_ALIGNMENT);
+  Assembler a;
+  asm_init(&a, memory_offset_collision_code);
+
+  hook_begin(&a, &site, LIVE_FLAGS);
+  asm_cmp_absolute_u8(&a, address(target, ADDRESS_IS_MULTIPLAYER), 0); // _dword_4D5E00_is_multiplayer
+  hook_end(&a, &site, LIVE_FLAGS);
+
+  // Only run collisions in singleplayer; we tail-jump to keep the return
+  asm_jcc(&a, CC_Z, address(target, ADDRESS_COLLISION_FUNCTION)); // _sub_47B0C0
+  asm_retn(&a);
+
+  cave_commit(cave, &a, target);
+  asm_free(&a);
+
+
+  // Install it by patching call at 0x47B5AF
+  hook_install(target, &site, memory_offset_collision_code);
+
+  return;
+}
+
+static void patch_audio_stream_quality(Target target, uint32_t samplerate, uint8_t bits_per_sample, bool stereo) {
+  // Patch audio streaming quality
+
+  // Calculate a fitting buffer-size
+  uint32_t buffer_size = 2 * samplerate * (bits_per_sample / 8) * (stereo ? 2 : 1);
+
+  // Patch audio stream source setting
+  uint32_t format = address(target, ADDRESS_AUDIO_STREAM_FORMAT);
+  write32(target, format + 0, buffer_size);
+  write8(target, format + 5, bits_per_sample);
+  write32(target, format + 9, samplerate);
+
+  // Patch audio stream buffer chunk size
+  uint32_t chunk = address(target, ADDRESS_AUDIO_STREAM_CHUNK);
+  write32(target, chunk + 0x0, buffer_size / 2);
+  write32(target, chunk + 0x5, buffer_size / 2);
+  write32(target, chunk + 0xC, buffer_size / 2);
+
+  return;
+}
+
+static void patch_sprite_loader_to_load_tga(Target target, Cave* cave) {
+  // Replace the sprite loader with a version that checks for "data\\images\\sprite-%d.tga"
+
+  // Write the path we want to use to the binary
+  const char* tga_path = "data\\sprites\\sprite-%d.tga";
+  uint32_t tga_path_address = cave_data(cave, target, tga_path, strlen(tga_path) + 1, 1);
+
+  Assembler a;
+  asm_init(&a, cave_align(cave, CAVE_CODE_ALIGNMENT));
+
+
+
+  // FIXME: load_success: Yay! Shift down size, to compensate for higher resolution
+  int load_success = asm_here(&a);
+  #if 1
+
+  // Shift the width and height of the sprite to the right
+  #if 1
+  asm_shr16_memory(&a, REG_EAX, 0, 1);
+  asm_shr16_memory(&a, REG_EAX, 2, 2);
+  asm_shr16_memory(&a, REG_EAX, 14, 2);
+  #endif
+
+  // Get address of page and repeat steps
+  asm_mov_reg_memory(&a, REG_EDX, REG_EAX, 16);
+
+  #if 1
+  asm_shr16_memory(&a, REG_EDX, 0, 1);
+  asm_shr16_memory(&a, REG_EDX, 2, 2);
+  #endif
+
+  // Get address of texture and repeat steps
+
+  //0:  8b 50 10                mov    edx,DWORD PTR [eax+0x10]
+  //3:  66 c1 6a 02 02          shr    WORD PTR [edx+0x2],0x2
+  #endif
+
+  // finish: Clear stack and return
+  int finish = asm_here(&a);
+  asm_add_esp(&a, 0x4 + 0x400);
+  asm_retn(&a);
+
+  // Start of actual code
+  int tga_loader_code = asm_here(&a);
+
+  // Read the sprite_index from stack
+  asm_mov_reg_memory(&a, REG_EAX, REG_ESP, 4);
+
+  // Make room for sprintf buffer and keep the pointer in edx
+  asm_add_esp(&a, -0x400);
+  asm_mov_reg_reg(&a, REG_EDX, REG_ESP);
+
+  // Generate the path, keep sprite_index on stack as we'll keep using it
+  asm_push(&a, REG_EAX); // (sprite_index)
+  asm_push_u32(&a, tga_path_address); // (fmt)
+  asm_push(&a, REG_EDX); // (buffer)
+  asm_call(&a, address(target, ADDRESS_SPRINTF)); // sprintf
+  asm_pop(&a, REG_EDX); // (buffer)
+  asm_add_esp(&a, 0x4);
+
+  // Attempt to load the TGA, then remove path from stack
+  asm_push(&a, REG_EDX); // (buffer)
+  asm_call(&a, address(target, ADDRESS_LOAD_SPRITE_TGA)); // load_sprite_from_tga_and_add_loaded_sprite
+  asm_add_esp(&a, 0x4);
+
+  // Check if the load failed
+  asm_test_reg_reg(&a, REG_EAX, REG_EAX);
+  asm_jcc_label(&a, CC_NZ, load_success);
+
+  // Load failed, so load the original sprite (sprite-index still on stack)
+  asm_call(&a, address(target, ADDRESS_LOAD_SPRITE_INTERNAL)); // load_sprite_internal
+  asm_jmp_label(&a, finish);
+
+  cave_commit(cave, &a, target);
+  uint32_t memory_offset_tga_loader_code = asm_address(&a, tga_loader_code);
+  asm_free(&a);
+
+
+  // Install it by jumping from 0x446FB0 (and we'll return directly)
+  jmp(target, address(target, ADDRESS_LOAD_SPRITE), memory_offset_tga_loader_code);
+
+  return;
+}
+
+static void patch_trigger_display(Target target, Cave* cave) {
+  // Display triggers
+
+  const char* trigger_string = "Trigger %d activated";
+  float trigger_string_display_duration = 3.0f;
+
+  uint32_t trigger_string_address = cave_data(cave, target, trigger_string, strlen(trigger_string) + 1, 1);
+
+  Assembler a;
+  asm_init(&a, cave_align(cave, CAVE_CODE_ALIGNMENT));
+
+  // The hook replaces the destination of the call at 0x476E80
+  const HookSite site = { .kind = HOOK_CALL, .address = address(target, ADDRESS_TRIGGER_CALL), .live = 0 };
+
+  int trigger_code = asm_here(&a);
+  int stack = hook_begin(&a, &site, CLOBBERS_CDECL);
+
+  // Read the trigger from stack
+  asm_mov_reg_memory(&a, REG_EAX, REG_ESP, stack + 4);
+
+  // Get pointer to section 8
+  asm_mov_reg_memory(&a, REG_EAX, REG_EAX, 0x4C);
+
+  // Read the section8.trigger_action field
+  asm_movzx16_reg_memory(&a, REG_EAX, REG_EAX, 0x24);
+
+  // Make room for sprintf buffer and keep the pointer in edx
+  asm_add_esp(&a, -0x400);
+  asm_mov_reg_reg(&a, REG_EDX, REG_ESP);
+
+  // Generate the string we'll display
+  asm_push(&a, REG_EAX); // (trigger index)
+  asm_push_u32(&a, trigger_string_address); // (fmt)
+  asm_push(&a, REG_EDX); // (buffer)
+  asm_call(&a, address(target, ADDRESS_SPRINTF)); // sprintf
+  asm_pop(&a, REG_EDX); // (buffer)
+  asm_add_esp(&a, 0x8);
+
+  // Display a message
+  asm_push_u32(&a, *(uint32_t*)&trigger_string_display_duration);
+  asm_push(&a, REG_EDX); // (buffer)
+  asm_call(&a, address(target, ADDRESS_SHOW_MESSAGE));
+  asm_add_esp(&a, 0x8);
+
+  // Pop the string buffer off of the stack
+  asm_add_esp(&a, 0x400);
+  hook_end(&a, &site, CLOBBERS_CDECL);
+
+  // Jump to the real function to run the trigger
+  asm_jmp(&a, address(target, ADDRESS_RUN_TRIGGER));
+
+  cave_commit(cave, &a, target);
+  uint32_t memory_offset_trigger_code = asm_address(&a, trigger_code);
+  asm_free(&a);
+
+  // Install it by replacing the call destination (we'll jump to the real one)
+  hook_install(target, &site, memory_offset_trigger_code);
+
+  return;
+}
+
+// Each font has a texture table and code which loads it
+static const struct {
+  const char* name;
+  AddressId table;
+  AddressId code;
+} fonts[] = {
+  { "font0", ADDRESS_FONT0_TABLE, ADDRESS_FONT0_CODE },
+  { "font1", ADDRESS_FONT1_TABLE, ADDRESS_FONT1_CODE },
+  { "font2", ADDRESS_FONT2_TABLE, ADDRESS_FONT2_CODE },
+  { "font3", ADDRESS_FONT3_TABLE, ADDRESS_FONT3_CODE },
+  { "font4", ADDRESS_FONT4_TABLE, ADDRESS_FONT4_CODE }
+};
+
+#define FONT_COUNT (sizeof(fonts) / sizeof(fonts[0]))
+
+// Parameters of the patches. These are part of the result cache key, so
+// every setting has to live here.
+static const struct {
+  uint8_t upgrade_levels[7];
+  uint8_t upgrade_healths[7];
+  uint8_t audio_bits_per_sample;
+  uint8_t audio_stereo;
+  uint32_t audio_samplerate;
+} settings = {
+#if USE_R100
+  .upgrade_levels  = {    3,    5,    5,    5,    5,    5,    5 },
+#else
+  .upgrade_levels  = {    5,    5,    5,    5,    5,    5,    5 },
+#endif
+  .upgrade_healths = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF },
+  .audio_bits_per_sample = 16,
+  .audio_stereo = true,
+  .audio_samplerate = 22050 * 2
+};
+
+static void apply_fonts(Target target, Cave* cave) {
+  Textures textures = { NULL, 0 };
+  for(unsigned int i = 0; i < FONT_COUNT; i++) {
+    patchTextureTable(target, cave, &textures, address(target, fonts[i].table), address(target, fonts[i].code), 512, 1024, fonts[i].name);
+  }
+  write_textures(target, cave, &textures);
+  return;
+}
+
+static void apply_network_upgrades(Target target, Cave* cave) {
+  patch_network_upgrades(target, cave, settings.upgrade_levels, settings.upgrade_healths);
+  return;
+}
+
+#if USE_AUDIO_STREAM_QUALITY
+static void apply_audio_stream_quality(Target target, Cave* cave) {
+  patch_audio_stream_quality(target, settings.audio_samplerate, settings.audio_bits_per_sample, settings.audio_stereo);
+  return;
+}
+#endif
+
+#define FONT_ADDRESSES (ADDRESS_BIT(ADDRESS_FONT0_TABLE) | ADDRESS_BIT(ADDRESS_FONT0_CODE) | \
+                        ADDRESS_BIT(ADDRESS_FONT1_TABLE) | ADDRESS_BIT(ADDRESS_FONT1_CODE) | \
+                        ADDRESS_BIT(ADDRESS_FONT2_TABLE) | ADDRESS_BIT(ADDRESS_FONT2_CODE) | \
+                        ADDRESS_BIT(ADDRESS_FONT3_TABLE) | ADDRESS_BIT(ADDRESS_FONT3_CODE) | \
+                        ADDRESS_BIT(ADDRESS_FONT4_TABLE) | ADDRESS_BIT(ADDRESS_FONT4_CODE))
+
+// All patches, in the order they are applied.
+// Each gets its own part of the code cave.
+// A patch is skipped if the game lacks any of the addresses it uses.
+// Every patch states whether it changes gameplay, which the network GUID
+// is made from.
+static const struct {
+  const char* name;
+  void (*apply)(Target target, Cave* cave);
+  uint64_t addresses;
+  bool gameplay;
+} patches[] = {
+#if USE_PATCHED_FONTS
+  { "fonts", apply_fonts, FONT_ADDRESSES, .gameplay = false },
+#endif
+  { "network_upgrades", apply_network_upgrades,
+    ADDRESS_BIT(ADDRESS_UPGRADE_MENU_LEVEL) | ADDRESS_BIT(ADDRESS_UPGRADE_MENU_HEALTH) |
+    ADDRESS_BIT(ADDRESS_UPGRADE_HOOK) | ADDRESS_BIT(ADDRESS_UPGRADE_HOOK_END) |
+    ADDRESS_BIT(ADDRESS_GENERATE_UPGRADED_HANDLING), .gameplay = true },
+#if 1
+  { "network_collisions", patch_network_collisions,
+    ADDRESS_BIT(ADDRESS_COLLISION_CALL) | ADDRESS_BIT(ADDRESS_COLLISION_FUNCTION) |
+    ADDRESS_BIT(ADDRESS_IS_MULTIPLAYER), .gameplay = true },
+#endif
+#if USE_AUDIO_STREAM_QUALITY
+  { "audio_stream_quality", apply_audio_stream_quality,
+    ADDRESS_BIT(ADDRESS_AUDIO_STREAM_FORMAT) | ADDRESS_BIT(ADDRESS_AUDIO_STREAM_CHUNK), .gameplay = false },
+#endif
+#if 0
+  { "sprite_loader_to_load_tga", patch_sprite_loader_to_load_tga,
+    ADDRESS_BIT(ADDRESS_SPRINTF) | ADDRESS_BIT(ADDRESS_LOAD_SPRITE) |
+    ADDRESS_BIT(ADDRESS_LOAD_SPRITE_INTERNAL) | ADDRESS_BIT(ADDRESS_LOAD_SPRITE_TGA), .gameplay = false },
+#endif
+#if USE_TRIGGER_DISPLAY
+  { "trigger_display", patch_trigger_display,
+    ADDRESS_BIT(ADDRESS_SPRINTF) | ADDRESS_BIT(ADDRESS_SHOW_MESSAGE) |
+    ADDRESS_BIT(ADDRESS_TRIGGER_CALL) | ADDRESS_BIT(ADDRESS_RUN_TRIGGER), .gameplay = false },
+#endif
+};
+
+#define PATCH_COUNT (sizeof(patches) / sizeof(patches[0]))
+
+// What each patch did while measuring. Patches which don't touch each
+// other's bytes are applied at the same time; a patch which reads what
+// another one writes has to wait for it.
+typedef struct {
+  IntervalSet reads;
+  IntervalSet writes;
+  uint64_t hash;
+  uint32_t cave_offset;
+  uint32_t cave_size;
+  uint32_t used[CAVE_KIND_COUNT];
+  unsigned int round;
+
+  // Cleared if an earlier run already wrote the same bytes
+  bool apply;
+
+  // Cleared if the game lacks addresses which the patch uses
+  bool available;
+} PatchRecord;
+
+typedef struct {
+  PatchRecord records[PATCH_COUNT];
+  unsigned int round_count;
+
+  // Header and manifest for the patch section
+  uint32_t manifest_offset;
+  uint8_t* manifest;
+  uint32_t manifest_size;
+
+  // Address of the network GUID if it is written after the patches, or 0
+  uint32_t network_guid;
+} Schedule;
+
+// Orders the patches, returns false if any of them write the same bytes
+static bool schedule_build(Schedule* schedule) {
+  bool conflicts = false;
+  schedule->round_count = 0;
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    PatchRecord* record = &schedule->records[i];
+    record->round = 0;
+    for(unsigned int j = 0; j < i; j++) {
+      PatchRecord* other = &schedule->records[j];
+
+      IntervalSet overlap = { NULL, 0, 0 };
+      interval_set_intersect(&record->writes, &other->writes, &overlap);
+      for(size_t k = 0; k < overlap.count; k++) {
+        fprintf(stderr, "Conflict: '%s' and '%s' both write 0x%08X-0x%08X\n",
+                patches[j].name, patches[i].name,
+                overlap.intervals[k].begin, overlap.intervals[k].end - 1);
+        conflicts = true;
+      }
+      interval_set_intersect(&record->reads, &other->writes, &overlap);
+      interval_set_intersect(&record->writes, &other->reads, &overlap);
+      if ((overlap.count > 0) && (record->round <= other->round)) {
+        record->round = other->round + 1;
+      }
+      interval_set_free(&overlap);
+    }
+    if (record->round >= schedule->round_count) {
+      schedule->round_count = record->round + 1;
+    }
+  }
+  return !conflicts;
+}
+
+static void schedule_free(Schedule* schedule) {
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    interval_set_free(&schedule->records[i].reads);
+    interval_set_free(&schedule->records[i].writes);
+  }
+  free(schedule->manifest);
+  return;
+}
+
+// Describes the placement of each patch and the game bytes it replaces,
+// which are read from target before anything is written
+static void manifest_build(Schedule* schedule, Target target, uint32_t memory_offset) {
+  uint32_t journal_size = 0;
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    const IntervalSet* writes = &schedule->records[i].writes;
+    for(size_t j = 0; (j < writes->count) && (writes->intervals[j].begin < memory_offset); j++) {
+      assert(writes->intervals[j].end <= memory_offset);
+      journal_size += 8 + writes->intervals[j].end - writes->intervals[j].begin;
+    }
+  }
+
+  // The network GUID isn't a patch, but gets an entry to restore it
+  unsigned int entry_count = PATCH_COUNT;
+  if (schedule->network_guid != 0) {
+    journal_size += 8 + 16;
+    entry_count++;
+  }
+
+  size_t entries_size = entry_count * sizeof(ManifestEntry);
+  schedule->manifest_size = sizeof(ManifestHeader) + entries_size + journal_size;
+  schedule->manifest = calloc(1, schedule->manifest_size);
+  ManifestHeader header;
+  memset(&header, 0x00, sizeof(header));
+  header.version = MANIFEST_VERSION;
+  header.entry_count = entry_count;
+  header.journal_size = journal_size;
+  memcpy(schedule->manifest, &header, sizeof(header));
+
+  uint8_t* journal = &schedule->manifest[sizeof(ManifestHeader) + entries_size];
+  uint32_t journal_offset = 0;
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    const PatchRecord* record = &schedule->records[i];
+    ManifestEntry entry;
+    memset(&entry, 0x00, sizeof(entry));
+    assert(strlen(patches[i].name) < sizeof(entry.name));
+    strcpy(entry.name, patches[i].name);
+    entry.hash = record->hash;
+    entry.cave_offset = record->cave_offset;
+    entry.cave_size = record->cave_size;
+    entry.journal_offset = journal_offset;
+    for(size_t j = 0; (j < record->writes.count) && (record->writes.intervals[j].begin < memory_offset); j++) {
+      const Interval* interval = &record->writes.intervals[j];
+      uint32_t size = interval->end - interval->begin;
+      memcpy(&journal[journal_offset + 0], &interval->begin, 4);
+      memcpy(&journal[journal_offset + 4], &size, 4);
+      readx(target, interval->begin, &journal[journal_offset + 8], size);
+      journal_offset += 8 + size;
+    }
+    entry.journal_size = journal_offset - entry.journal_offset;
+    memcpy(&schedule->manifest[sizeof(ManifestHeader) + i * sizeof(ManifestEntry)], &entry, sizeof(entry));
+  }
+  if (schedule->network_guid != 0) {
+    ManifestEntry entry;
+    memset(&entry, 0x00, sizeof(entry));
+    strcpy(entry.name, "network_guid");
+    entry.journal_offset = journal_offset;
+    entry.journal_size = 8 + 16;
+    uint32_t size = 16;
+    memcpy(&journal[journal_offset + 0], &schedule->network_guid, 4);
+    memcpy(&journal[journal_offset + 4], &size, 4);
+    readx(target, schedule->network_guid, &journal[journal_offset + 8], size);
+    memcpy(&schedule->manifest[sizeof(ManifestHeader) + PATCH_COUNT * sizeof(ManifestEntry)], &entry, sizeof(entry));
+  }
+  return;
+}
+
+static void manifest_set_original(Schedule* schedule, const OriginalHeaders* original) {
+  memcpy(&schedule->manifest[offsetof(ManifestHeader, original)], original, sizeof(OriginalHeaders));
+  return;
+}
+
+// Puts back the game bytes of patches which will be written again or which
+// don't exist anymore, which includes the network GUID. Like unpatch, this goes in reverse order, so the bytes
+// from before the first write win where records overlap.
+static void manifest_restore(Target target, const Manifest* manifest, const Schedule* schedule) {
+  for(unsigned int i = manifest->record_count; i > 0; i--) {
+    const JournalRecord* record = &manifest->records[i - 1];
+    const ManifestEntry* entry = &manifest->entries[record->entry];
+    bool restore = true;
+    for(unsigned int j = 0; j < PATCH_COUNT; j++) {
+      if (!strcmp(entry->name, patches[j].name)) {
+        restore = schedule->records[j].apply;
+      }
+    }
+    if (restore) {
+      writex(target, record->address, record->data, record->size);
+    }
+  }
+  return;
+}
+
+typedef struct {
+  Target target;
+  const Schedule* schedule;
+  Cave caves[PATCH_COUNT];
+  unsigned int indices[PATCH_COUNT];
+
+  // Only used with a trace, each patch counts on its own
+  Trace* trace;
+  Tracer tracers[PATCH_COUNT];
+
+  // Hash of the writes of each gameplay patch, for the network GUID
+  uint64_t hashes[PATCH_COUNT];
+} PatchRound;
+
+static void apply_patch(void* context, unsigned int index) {
+  PatchRound* round = context;
+  unsigned int i = round->indices[index];
+  Target target = round->target;
+  unsigned int span = 0;
+  if (round->trace != NULL) {
+    tracer_init(&round->tracers[i], target);
+    target = &round->tracers[i].backend;
+    span = trace_begin(target, &round->caves[i], patches[i].name);
+  }
+
+  // Gameplay patches hash what they write while they write it. The recorder
+  // isn't concurrent, so each patch writes in the same order every time.
+  if (patches[i].gameplay) {
+    Recorder recorder;
+    recorder_init(&recorder, target, NULL, NULL);
+    patches[i].apply(&recorder.backend, &round->caves[i]);
+    round->hashes[i] = recorder.hash;
+  } else {
+    patches[i].apply(target, &round->caves[i]);
+  }
+
+  if (round->trace != NULL) {
+    trace_end(target, &round->caves[i], span);
+  }
+  return;
+}
+
+#define GUID_VERSION 1
+
+// Puts a digest of everything the gameplay patches wrote into the network
+// GUID, so only players with the same gameplay meet. The hashes are combined
+// in table order, so threads don't change it. The GUID was restored before
+// the patches ran, so this still sees the original one.
+static void apply_network_guid(Target target, const Schedule* schedule, const uint64_t* hashes) {
+  uint32_t guid = schedule->network_guid;
+  uint8_t original[16];
+  readx(target, guid, original, sizeof(original));
+  uint64_t digest[2] = { FNV_OFFSET, FNV_OFFSET };
+  digest[1] = fnv1a("swe1r", 5, digest[1]);
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    if (!patches[i].gameplay || !schedule->records[i].available) {
+      continue;
+    }
+    for(unsigned int j = 0; j < 2; j++) {
+      digest[j] = fnv1a(patches[i].name, strlen(patches[i].name) + 1, digest[j]);
+      digest[j] = fnv1a(&hashes[i], sizeof(hashes[i]), digest[j]);
+    }
+  }
+  for(unsigned int j = 0; j < 2; j++) {
+    digest[j] = fnv1a(original, sizeof(original), digest[j]);
+  }
+
+  // The first 2 bytes are a version index, so we have room to fix the
+  // algorithm if we have messed up
+  uint8_t value[16];
+  memcpy(value, digest, sizeof(value));
+  uint16_t version = GUID_VERSION;
+  memcpy(&value[0], &version, 2);
+  writex(target, guid, value, sizeof(value));
+  return;
+}
+
+// Applies the scheduled patches; if trace is set, their spans are added
+static void patch(Target target, Cave* cave, const Schedule* schedule, Trace* trace) {
+#if 0
+  // This is a debug feature to dump the original font textures
+
+  dumpTextureTable(target, 0x4BF91C, 3, 0, 64, 128, "font0");
+  dumpTextureTable(target, 0x4BF7E4, 3, 0, 64, 128, "font1");
+  dumpTextureTable(target, 0x4BF84C, 3, 0, 64, 128, "font2");
+  dumpTextureTable(target, 0x4BF8B4, 3, 0, 64, 128, "font3");
+  dumpTextureTable(target, 0x4BF984, 3, 0, 64, 128, "font4");
 #endif
 
-#if 0
-  // what the hell is the point of this shit, jay
-  // The following patch only supports the same upgrade level and health for menus
-  // So in order to keep everything synchronized, we assert that only one setting is present for all categories
-  for(int i = 0; i < 7; i++) {
-    assert(upgrade_levels[i] == upgrade_levels[0]);
-    assert(upgrade_healths[i] == upgrade_healths[0]);
+
+// Start the actual patching
+
+  // Every patch uses the part of the cave it used while measuring
+  PatchRound round;
+  round.target = target;
+  round.schedule = schedule;
+  round.trace = trace;
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    const PatchRecord* record = &schedule->records[i];
+    cave_init(&round.caves[i], cave->begin + record->cave_offset, record->cave_size);
+    cave_enter(&round.caves[i], patches[i].name);
+
+    // Patches which are already in place wrote the same as while measuring
+    round.hashes[i] = record->hash;
   }
-#endif
 
-  // Now do the actual upgrade for menus
-  write8(target, 0x45CFC6, upgrade_levels[0]);
-  write8(target, 0x45CFCB, upgrade_healths[0]);
+  // Run each round at once, if the target allows it
+  for(unsigned int r = 0; r < schedule->round_count; r++) {
+    unsigned int count = 0;
+    for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+      const PatchRecord* record = &schedule->records[i];
+      if (record->apply && record->available && (record->round == r)) {
+        round.indices[count++] = i;
+      }
+    }
+    if (target->concurrent) {
+      parallel_for(count, apply_patch, &round);
+    } else {
+      for(unsigned int i = 0; i < count; i++) {
+        apply_patch(&round, i);
+      }
+    }
+  }
 
-  //FIXME: Upgrade network player creation
+  // The network GUID goes last, when every gameplay patch has been hashed
+  if (schedule->network_guid != 0) {
+    apply_network_guid(target, schedule, round.hashes);
+  }
 
-  // 0x45B725 vs 0x45B9FF
+  // Spans are listed in the order of the patches, not the order they ran
+  if (trace != NULL) {
+    for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+      const PatchRecord* record = &schedule->records[i];
+      if (record->apply && record->available) {
+        trace_append(trace, &round.tracers[i]);
+      }
+    }
+  }
 
-  #if 0
-  lea     edx, [esp+1Ch+upgrade_health]
-  lea     eax, [esp+1Ch+upgrade_level]
-  push    edx             ; upgrade_healths
-  push    eax             ; upgrade_levels
-  push    ebp             ; handling_in
-  push    offset handling_out ; handling_out
-  mov     [esp+esi+2Ch+upgrade_health], cl
-  call    _sub_449D00_generate_upgraded_handling_table_data
-  #endif
+  // Write the header and manifest, so we can update the patch later
+  SectionHeader header;
+  memcpy(header.magic, MANIFEST_MAGIC, 8);
+  header.manifest_offset = schedule->manifest_offset;
+  header.manifest_size = schedule->manifest_size;
+  writex(target, cave->begin, &header, sizeof(header));
+  writex(target, cave->begin + schedule->manifest_offset, schedule->manifest, schedule->manifest_size);
+
+  // Account everything to the shared cave, in the order it is placed
+  cave_enter(cave, "manifest");
+  cave_claim(cave, sizeof(SectionHeader), CAVE_DATA);
+  unsigned int applied = 0;
+  bool placed[PATCH_COUNT] = { false };
+  for(unsigned int n = 0; n < PATCH_COUNT; n++) {
+    unsigned int i = PATCH_COUNT;
+    for(unsigned int j = 0; j < PATCH_COUNT; j++) {
+      if (!placed[j] && ((i == PATCH_COUNT) || (schedule->records[j].cave_offset < schedule->records[i].cave_offset))) {
+        i = j;
+      }
+    }
+    placed[i] = true;
+
+    const PatchRecord* record = &schedule->records[i];
+    cave_enter(cave, patches[i].name);
+    cave_claim(cave, cave->begin + record->cave_offset - cave->offset, CAVE_PADDING);
+    uint32_t used = 0;
+    for(unsigned int k = 0; k < CAVE_KIND_COUNT; k++) {
+      cave_claim(cave, record->used[k], k);
+      used += record->used[k];
+    }
+    cave_claim(cave, record->cave_size - used, CAVE_PADDING);
+    cave_free(&round.caves[i]);
+    applied += record->apply && record->available;
+  }
+  cave_enter(cave, "manifest");
+  cave_claim(cave, cave->begin + schedule->manifest_offset - cave->offset, CAVE_PADDING);
+  cave_claim(cave, schedule->manifest_size, CAVE_DATA);
 
-  // Place upgrade data in memory
+  if (!target->dry_run) {
+    printf("Applied %u of %u patches in %u rounds\n", applied, (unsigned int)PATCH_COUNT, schedule->round_count);
+    cave_print(cave);
+  }
+  return;
+}
+
+static void print_network_guid(Target target) {
+  if (target->addresses[ADDRESS_NETWORK_GUID] == 0) {
+    return;
+  }
+  printf("Network GUID is: ");
+  for(int i = 0; i < 16; i++) {
+    printf("%02X", read8(target, address(target, ADDRESS_NETWORK_GUID) + i));
+  }
+  printf("\n"); 
+}
+
+// Returns an address which a patch uses, but which the game lacks
+static AddressId patch_missing(const uint32_t* addresses, unsigned int i) {
+  for(unsigned int j = 0; j < ADDRESS_COUNT; j++) {
+    if ((patches[i].addresses & ADDRESS_BIT(j)) && (addresses[j] == 0)) {
+      return j;
+    }
+  }
+  return ADDRESS_NONE;
+}
 
-  uint32_t memory_offset_upgrade_levels = memory_offset;
-  writex(target, memory_offset, upgrade_levels, 7);
-  memory_offset += 7;
+// Tells if any patch can be used for this version of the game
+static bool patches_available(const uint32_t* addresses) {
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    if (patch_missing(addresses, i) == ADDRESS_NONE) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  uint32_t memory_offset_upgrade_healths = memory_offset;
-  writex(target, memory_offset, upgrade_healths, 7);
-  memory_offset += 7;
+static void measure_one(Counter* counter, uint32_t memory_offset, unsigned int i, PatchRecord* record, uint32_t cave_offset) {
+  interval_set_free(&record->reads);
+  interval_set_free(&record->writes);
+  Recorder recorder;
+  recorder_init(&recorder, &counter->backend, &record->reads, &record->writes);
+  Cave cave;
+  cave_init(&cave, memory_offset + cave_offset, UINT32_MAX - (memory_offset + cave_offset));
+  cave_enter(&cave, patches[i].name);
+  patches[i].apply(&recorder.backend, &cave);
+  record->hash = recorder.hash;
+  record->cave_offset = cave_offset;
+  record->cave_size = cave.offset - cave.begin;
+  memcpy(record->used, cave.users[0].used, sizeof(record->used));
+  cave_free(&cave);
+  return;
+}
 
+static bool measure_patch(Target target, uint32_t memory_offset, const Manifest* previous, Schedule* schedule, uint32_t* patch_size) {
+  // Do a dry-run to find out how much space we'll need and which bytes
+  // each patch touches
+  Counter counter;
+  counter_init(&counter, target, memory_offset);
+  memset(schedule, 0x00, sizeof(Schedule));
+
+  // Patches stay where an earlier run placed them, if they still fit.
+  // Everything else goes after them.
+  uint32_t end = sizeof(SectionHeader);
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    const ManifestEntry* entry = manifest_find(previous, patches[i].name);
+    if ((entry != NULL) && ((entry->cave_offset + entry->cave_size) > end)) {
+      end = entry->cave_offset + entry->cave_size;
+    }
+  }
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    PatchRecord* record = &schedule->records[i];
+    record->apply = true;
+    AddressId missing = patch_missing(target->addresses, i);
+    record->available = (missing == ADDRESS_NONE);
+    if (!record->available) {
+      if (!target->dry_run) {
+        printf("Skipping '%s', unable to find %s\n", patches[i].name, address_info[missing].name);
+      }
+
+      // Bytes from an earlier run are put back, the patch takes no space
+      record->cave_offset = end;
+      continue;
+    }
+    const ManifestEntry* entry = manifest_find(previous, patches[i].name);
+    if (entry != NULL) {
+      measure_one(&counter, memory_offset, i, record, entry->cave_offset);
+      if (record->cave_size <= entry->cave_size) {
+        record->cave_size = entry->cave_size;
+        record->apply = (record->hash != entry->hash);
+        continue;
+      }
+    }
+    end = (end + CAVE_CODE_ALIGNMENT - 1) & ~(CAVE_CODE_ALIGNMENT - 1);
+    measure_one(&counter, memory_offset, i, record, end);
+    end += record->cave_size;
+  }
 
-  // Now inject the code
+  // Every write to the cave must have been allocated
+  assert(counter.cave_end <= memory_offset + end);
 
-  uint32_t memory_offset_upgrade_code = memory_offset;
+#if USE_PATCHED_GUID
+  // Without gameplay changes we can still play with everyone else
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    if (patches[i].gameplay && schedule->records[i].available && (target->addresses[ADDRESS_NETWORK_GUID] != 0)) {
+      schedule->network_guid = address(target, ADDRESS_NETWORK_GUID);
+    }
+  }
+#endif
 
-  //  -> push edx
-  write8(target, memory_offset, 0x52); memory_offset += 1;
+  // The manifest goes last
+  schedule->manifest_offset = (end + CAVE_CODE_ALIGNMENT - 1) & ~(CAVE_CODE_ALIGNMENT - 1);
+  manifest_build(schedule, target, memory_offset);
 
-  //  -> push eax
-  write8(target, memory_offset, 0x50); memory_offset += 1;
+  // Round up to full pages, so we can use it for section and allocation size
+  *patch_size = schedule->manifest_offset + schedule->manifest_size;
+  *patch_size = (*patch_size + 0xFFF) & ~0xFFF;
 
-  //  -> push offset upgrade_healths
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write32(target, memory_offset, memory_offset_upgrade_healths); memory_offset += 4;
+  if (!schedule_build(schedule)) {
+    fprintf(stderr, "Patches conflict with each other, aborting.\n");
+    return false;
+  }
+  return true;
+}
 
-  //  -> push offset upgrade_levels
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write32(target, memory_offset, memory_offset_upgrade_levels); memory_offset += 4;
+#ifndef DLL
 
-  //  -> push esi
-  write8(target, memory_offset, 0x56); memory_offset += 1;
+#ifndef LOADER
 
-  //  -> push edi
-  write8(target, memory_offset, 0x57); memory_offset += 1;
+// Loads the sections like the Windows loader would, followed by extra_size
+// zero bytes for the patch
+static uint8_t* image_layout(Image* image, uint32_t image_base, uint32_t extra_size, size_t* layout_size) {
+  Target target = &image->backend;
+  uint32_t coff_header = find_coff_header(target, image_base);
+  uint32_t optional_header = coff_header + 20;
+  uint32_t size_of_optional_header = read16(target, coff_header + 16);
+  uint32_t section_header = optional_header + size_of_optional_header;
+  uint16_t section_count = read16(target, coff_header + 2);
+  uint32_t size_of_headers = read32(target, optional_header + 60);
+  uint32_t size_of_image = read32(target, optional_header + 56);
+  size_of_image = (size_of_image + 0xFFF) & ~0xFFF;
 
-  //  -> call _sub_449D00
-  write8(target, memory_offset, 0xE8); memory_offset += 1;
-  write32(target, memory_offset, 0x449D00 - (memory_offset + 4)); memory_offset += 4;
+  *layout_size = size_of_image + extra_size;
+  uint8_t* layout = calloc(1, *layout_size);
+  assert(layout != NULL);
+  memcpy(layout, image->data, size_of_headers);
+  for(int i = 0; i < section_count; i++) {
+    uint32_t header = section_header + i * 40;
+    uint32_t virtual_size = read32(target, header + 8);
+    uint32_t virtual_address = read32(target, header + 12);
+    uint32_t raw_size = read32(target, header + 16);
+    uint32_t raw_offset = read32(target, header + 20);
+    memcpy(&layout[virtual_address], &image->data[raw_offset], raw_size < virtual_size ? raw_size : virtual_size);
+  }
+  return layout;
+}
 
-  //  -> add esp, 0x10
-  write8(target, memory_offset, 0x83); memory_offset += 1;
-  write8(target, memory_offset, 0xC4); memory_offset += 1;
-  write8(target, memory_offset, 0x10); memory_offset += 1;
+#endif
 
-  //  -> pop eax
-  write8(target, memory_offset, 0x58); memory_offset += 1;
+#if !defined(LOADER) && defined(__linux__)
 
-  //  -> pop edx
-  write8(target, memory_offset, 0x5A); memory_offset += 1;
+static int stand_in(const char* path) {
+  // Applies the patch to a suspended child process, like the loader does on
+  // Windows, then compares the result to a patch applied in our own memory
 
-  //  -> retn
-  write8(target, memory_offset, 0xC3); memory_offset += 1;
+  Image image;
+  if (!image_open(&image, path)) {
+    fprintf(stderr, "Unable to open '%s'\n", path);
+    return 1;
+  }
+  if (!image_parse(&image)) {
+    fprintf(stderr, "'%s' is not a valid executable\n", path);
+    image_close(&image);
+    return 1;
+  }
+  Target target = &image.backend;
 
+  uint32_t image_base = image.image_base;
+  uint32_t coff_header = find_coff_header(target, image_base);
+  uint32_t optional_header = coff_header + 20;
+  uint32_t size_of_image = read32(target, optional_header + 56);
+  size_of_image = (size_of_image + 0xFFF) & ~0xFFF;
+
+  uint32_t memory_offset = image_base + size_of_image;
+  uint32_t addresses[ADDRESS_COUNT];
+  addresses_init(target, image_base, addresses);
+  Schedule schedule;
+  uint32_t patch_size;
+  if (!measure_patch(target, memory_offset, NULL, &schedule, &patch_size)) {
+    image_close(&image);
+    return 1;
+  }
 
-  // Install it by jumping from 0x45B765 and returning to 0x45B76C
+  // Load the sections like the Windows loader would
+  size_t layout_size;
+  uint8_t* layout = image_layout(&image, image_base, patch_size, &layout_size);
+  uint32_t timestamp = read32(target, coff_header + 4);
+  image_close(&image);
+
+  // Keep an unpatched copy to check plans against
+  uint8_t* planned = malloc(layout_size);
+  assert(planned != NULL);
+  memcpy(planned, layout, layout_size);
+
+  // The child inherits the layout at the same address and stops itself
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    raise(SIGSTOP);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, WUNTRACED);
+  assert(WIFSTOPPED(status));
+
+  // Patch the child
+  LinuxProcess process;
+  bool opened = linux_process_open(&process, pid, (uintptr_t)layout, image_base, layout_size);
+  assert(opened);
+  process.backend.addresses = addresses;
+  Batch batch;
+  batch_init(&batch, &process.backend);
+  Cave cave;
+  cave_init(&cave, memory_offset, patch_size);
+  patch(&batch.backend, &cave, &schedule, NULL);
+  cave_free(&cave);
+  batch_flush(&batch);
+
+  // Patch our own copy for reference
+  Memory memory;
+  memory_init(&memory, layout, image_base, layout_size);
+  memory.backend.addresses = addresses;
+  cave_init(&cave, memory_offset, patch_size);
+  patch(&memory.backend, &cave, &schedule, NULL);
+  cave_free(&cave);
+
+  // Build a plan like --plan, then apply it to the unpatched copy
+  Memory planned_memory;
+  memory_init(&planned_memory, planned, image_base, layout_size);
+  planned_memory.backend.addresses = addresses;
+  batch_init(&batch, &planned_memory.backend);
+  cave_init(&cave, memory_offset, patch_size);
+  patch(&batch.backend, &cave, &schedule, NULL);
+  cave_free(&cave);
+  schedule_free(&schedule);
+  size_t plan_size;
+  uint8_t* plan = plan_build(&batch, timestamp, memory_offset, patch_size, &plan_size);
+  bool plan_matches = (plan_check(plan, plan_size, timestamp) != NULL);
+  if (plan_matches) {
+    plan_apply(&planned_memory.backend, plan);
+    plan_matches = !memcmp(planned, layout, layout_size);
+  }
+  printf("Plan %s the reference\n", plan_matches ? "matches" : "does not match");
+  free(plan);
+  free(planned);
+
+  // Compare the results
+  uint8_t* remote = malloc(layout_size);
+  readx(&process.backend, image_base, remote, layout_size);
+  bool matches = !memcmp(remote, layout, layout_size);
+  printf("Stand-in process %s the reference\n", matches ? "matches" : "does not match");
+  free(remote);
+
+  linux_process_close(&process);
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  free(layout);
+
+  return (matches && plan_matches) ? 0 : 1;
+}
 
-  write8(target, 0x45B765 + 0, 0xE8);
-  write32(target, 0x45B765 + 1, memory_offset_upgrade_code - (0x45B765 + 5));
-  write8(target, 0x45B765 + 5, 0x90);
-  write8(target, 0x45B765 + 6, 0x90);
+#endif
 
-  return memory_offset;
+#ifndef LOADER
+
+#if USE_SIMD
+
+// Adds up the 16 bit words of all whole 16 byte blocks. Words are widened to
+// 32 bit lanes, which are emptied into 64 bit lanes well before they could
+// overflow.
+__attribute__((target("sse2")))
+static uint64_t pe_checksum_sse2(const uint8_t* data, size_t size, size_t* position) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i total = zero;
+  while(size - *position >= 16) {
+    size_t blocks = (size - *position) / 16;
+    if (blocks > 0x4000) {
+      blocks = 0x4000;
+    }
+    __m128i lanes = zero;
+    for(size_t i = 0; i < blocks; i++) {
+      __m128i v = _mm_loadu_si128((const __m128i*)&data[*position]);
+      lanes = _mm_add_epi32(lanes, _mm_unpacklo_epi16(v, zero));
+      lanes = _mm_add_epi32(lanes, _mm_unpackhi_epi16(v, zero));
+      *position += 16;
+    }
+    total = _mm_add_epi64(total, _mm_unpacklo_epi32(lanes, zero));
+    total = _mm_add_epi64(total, _mm_unpackhi_epi32(lanes, zero));
+  }
+  uint64_t halves[2];
+  _mm_storeu_si128((__m128i*)halves, total);
+  return halves[0] + halves[1];
 }
 
-static uint32_t patch_network_collisions(Target target, uint32_t memory_offset) {
-  // Disable collision between network players
+#endif
 
-#if USE_PATCHED_GUID
-  modify_network_guid(target, "Collisions", 0);
+// The PE checksum adds up the file as 16 bit words with end-around carry,
+// then adds the file size. The CheckSum field itself counts as zero.
+static uint32_t pe_checksum(const uint8_t* data, size_t size, size_t checksum_offset) {
+  assert(((checksum_offset % 2) == 0) && (checksum_offset + 4 <= size));
+  uint64_t sum = 0;
+  size_t position = 0;
+
+#if USE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    sum = pe_checksum_sse2(data, size, &position);
+  }
 #endif
 
-  // Inject the code
+  for(; position + 1 < size; position += 2) {
+    sum += data[position] | (data[position + 1] << 8);
+  }
+  if (position < size) {
+    sum += data[position];
+  }
 
-  uint32_t memory_offset_collision_code = memory_offset;
+  // Take the CheckSum field out again
+  uint32_t field;
+  memcpy(&field, &data[checksum_offset], 4);
+  sum -= (field & 0xFFFF) + (field >> 16);
 
-  memory_offset = push_edx(target, memory_offset);
+  while((sum >> 16) != 0) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return (uint32_t)sum + (uint32_t)size;
+}
 
-  // -> mov     edx, _dword_4D5E00_is_multiplayer
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x15); memory_offset += 1;
-  write32(target, memory_offset, 0x4D5E00); memory_offset += 4;
+// Patched files get a valid checksum, like a linker would write it
+static void image_update_checksum(Image* image) {
+  Target target = &image->backend;
+  uint32_t checksum = find_coff_header(target, image->image_base) + 20 + 64;
+  write32(target, checksum, pe_checksum(image->data, image->size, checksum - image->image_base));
+  return;
+}
 
-  memory_offset = test_edx_edx(target, memory_offset);
-  memory_offset = pop_edx(target, memory_offset);
+// A part of the file which --verify compares on its own
+typedef struct {
+  char name[9];
+  const uint8_t* expected;
+  const uint8_t* actual;
+  size_t size;
+  bool matches;
+} VerifyRange;
+
+// Like fnv1a, but takes 8 bytes per step, which is much quicker for whole
+// sections
+static uint64_t fnv1a_words(const uint8_t* data, size_t size, uint64_t hash) {
+  size_t i = 0;
+  for(; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, &data[i], 8);
+    hash = (hash ^ word) * 0x100000001B3ULL;
+    hash ^= hash >> 32;
+  }
+  return fnv1a(&data[i], size - i, hash);
+}
 
-  // -> jz _sub_47B0C0
-  write8(target, memory_offset, 0x0F); memory_offset += 1;
-  write8(target, memory_offset, 0x84); memory_offset += 1;
-  write32(target, memory_offset, 0x47B0C0 - (memory_offset + 4)); memory_offset += 4;
+static void verify_range(void* context, unsigned int index) {
+  VerifyRange* range = &((VerifyRange*)context)[index];
+  uint64_t expected_hash = fnv1a_words(range->expected, range->size, FNV_OFFSET);
+  uint64_t actual_hash = fnv1a_words(range->actual, range->size, FNV_OFFSET);
+  range->matches = (expected_hash == actual_hash);
+  return;
+}
 
-  memory_offset = retn(target, memory_offset);
+// Compares the headers and every section of a file to the expected image.
+// The parts are hashed at the same time, so the mismatching ones can be named.
+static bool verify_image(Image* expected, const char* path) {
+  size_t size;
+  uint8_t* actual = load_file(path, &size);
+  if (actual == NULL) {
+    fprintf(stderr, "Unable to open '%s'\n", path);
+    return false;
+  }
 
+  Target target = &expected->backend;
+  uint32_t image_base = expected->image_base;
+  uint32_t coff_header = find_coff_header(target, image_base);
+  uint32_t optional_header = coff_header + 20;
+  uint32_t section_header = optional_header + read16(target, coff_header + 16);
+  uint16_t section_count = read16(target, coff_header + 2);
 
-  // Install it by patching call at 0x47B5AF
+  VerifyRange* ranges = malloc((1 + section_count) * sizeof(VerifyRange));
+  assert(ranges != NULL);
+  unsigned int count = 0;
+  uint32_t size_of_headers = read32(target, optional_header + 60);
+  for(unsigned int i = 0; i <= section_count; i++) {
+    VerifyRange* range = &ranges[count];
+    uint32_t offset = 0;
+    uint32_t range_size = size_of_headers;
+    strcpy(range->name, "headers");
+    if (i > 0) {
+      uint32_t header = section_header + (i - 1) * 40;
+      readx(target, header + 0, range->name, 8);
+      range->name[8] = '\0';
+      range_size = read32(target, header + 16);
+      offset = read32(target, header + 20);
+    }
+    if ((offset > expected->size) || (range_size > expected->size - offset)) {
+      continue;
+    }
+    range->expected = &expected->data[offset];
+    range->actual = &actual[offset];
+    range->size = range_size;
+    range->matches = false;
+    if ((offset <= size) && (range_size <= size - offset)) {
+      count++;
+    }
+  }
+  parallel_for(count, verify_range, ranges);
 
-  write32(target, 0x47B5AF + 1, memory_offset_collision_code - (0x47B5AF + 5));
+  bool matches = (size == expected->size);
+  if (!matches) {
+    fprintf(stderr, "'%s' has %zu bytes, expected %zu\n", path, size, expected->size);
+  }
 
-  return memory_offset;
+  // Bytes which no patch wrote are taken from the file itself, so damage to
+  // those only shows in the checksum
+  uint32_t checksum = optional_header + 64 - image_base;
+  if (matches && (pe_checksum(actual, size, checksum) != read32(target, optional_header + 64))) {
+    fprintf(stderr, "'%s' has a wrong checksum\n", path);
+    matches = false;
+  }
+  for(unsigned int i = 0; i < count; i++) {
+    if (!ranges[i].matches) {
+      fprintf(stderr, "'%s' differs in %s\n", path, ranges[i].name);
+      matches = false;
+    }
+  }
+  free(ranges);
+  free(actual);
+  return matches;
 }
 
-static uint32_t patch_audio_stream_quality(Target target, uint32_t memory_offset, uint32_t samplerate, uint8_t bits_per_sample, bool stereo) {
-  // Patch audio streaming quality
+static bool image_finish(Image* image, const char* output_path, FILE* output_stream) {
+  bool saved = true;
+  if (output_stream != NULL) {
+    saved = image_write(image, output_stream);
+    fclose(output_stream);
+  } else if (output_path != NULL) {
+    saved = image_save(image, output_path);
+  }
+  image_close(image);
+  if (!saved) {
+    fprintf(stderr, "Unable to write '%s'\n", output_path);
+  }
+  return saved;
+}
 
-  // Calculate a fitting buffer-size
-  uint32_t buffer_size = 2 * samplerate * (bits_per_sample / 8) * (stereo ? 2 : 1);
+// Deltas in the BPS format, so patched files can be distributed without the
+// patcher and the textures
+
+#define BPS_MIN_RUN 4
+#define BPS_BUFFER_SIZE 0x10000
+
+typedef enum {
+  BPS_SOURCE_READ = 0,
+  BPS_TARGET_READ = 1,
+  BPS_SOURCE_COPY = 2,
+  BPS_TARGET_COPY = 3
+} BpsAction;
+
+// Table for the reflected polynomial 0xEDB88320. It's constant, so threads
+// can checksum at the same time.
+static uint32_t crc32(const void* data, size_t size, uint32_t crc) {
+  static const uint32_t table[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+    0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+    0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+    0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+    0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+    0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+    0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+    0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+    0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+    0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+    0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+    0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+    0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+    0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+    0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+    0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+    0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+    0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+    0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+    0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+    0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+  };
+  const uint8_t* bytes = data;
+  crc = ~crc;
+  for(size_t i = 0; i < size; i++) {
+    crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
 
-  // Patch audio stream source setting
-  write32(target, 0x423215, buffer_size);
-  write8(target, 0x42321A, bits_per_sample);
-  write32(target, 0x42321E, samplerate);
+static size_t bps_chunk(uint64_t length) {
+  return (length < BPS_BUFFER_SIZE) ? length : BPS_BUFFER_SIZE;
+}
 
-  // Patch audio stream buffer chunk size
-  write32(target, 0x423549, buffer_size / 2);
-  write32(target, 0x42354E, buffer_size / 2);
-  write32(target, 0x423555, buffer_size / 2);
+typedef struct {
+  FILE* f;
+  uint32_t crc;
+  size_t size;
+  bool failed;
+} BpsWriter;
+
+static void bps_write(BpsWriter* writer, const void* data, size_t size) {
+  writer->failed |= (fwrite(data, 1, size, writer->f) != size);
+  writer->crc = crc32(data, size, writer->crc);
+  writer->size += size;
+  return;
+}
 
-  return memory_offset;
+static void bps_write_number(BpsWriter* writer, uint64_t value) {
+  while(true) {
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    if (value == 0) {
+      byte |= 0x80;
+      bps_write(writer, &byte, 1);
+      break;
+    }
+    bps_write(writer, &byte, 1);
+    value--;
+  }
+  return;
 }
 
-static uint32_t patch_sprite_loader_to_load_tga(Target target, uint32_t memory_offset) {
-  // Replace the sprite loader with a version that checks for "data\\images\\sprite-%d.tga"
+static void bps_write_action(BpsWriter* writer, BpsAction action, size_t length) {
+  assert(length > 0);
+  bps_write_number(writer, ((uint64_t)(length - 1) << 2) | action);
+  return;
+}
 
-  // Write the path we want to use to the binary
-  const char* tga_path = "data\\sprites\\sprite-%d.tga";
+static void bps_write_literal(BpsWriter* writer, const Image* target, size_t begin, size_t end) {
+  if (end > begin) {
+    bps_write_action(writer, BPS_TARGET_READ, end - begin);
+    bps_write(writer, &target->data[begin], end - begin);
+  }
+  return;
+}
 
-  uint32_t memory_offset_tga_path = memory_offset;
-  writex(target, memory_offset, tga_path, strlen(tga_path) + 1);
-  memory_offset += strlen(tga_path) + 1;
+// Our patches only change bytes in place or append, so it's enough to look
+// for unchanged bytes at the same offset and for runs of a repeated byte
+static bool bps_diff(const Image* source, const Image* target, FILE* f) {
+  BpsWriter writer = { f, 0, 0, false };
+  bps_write(&writer, "BPS1", 4);
+  bps_write_number(&writer, source->size);
+  bps_write_number(&writer, target->size);
+  bps_write_number(&writer, 0);
+
+  size_t literal = 0;
+  size_t target_relative = 0;
+  size_t offset = 0;
+  while(offset < target->size) {
+
+    // Copy unchanged bytes from the source
+    size_t same = 0;
+    while((offset + same < target->size) && (offset + same < source->size) &&
+          (target->data[offset + same] == source->data[offset + same])) {
+      same++;
+    }
+    if (same >= BPS_MIN_RUN) {
+      bps_write_literal(&writer, target, literal, offset);
+      bps_write_action(&writer, BPS_SOURCE_READ, same);
+      offset += same;
+      literal = offset;
+      continue;
+    }
 
+    // Repeat the previous byte of the target
+    size_t repeat = 0;
+    while((offset > 0) && (offset + repeat < target->size) &&
+          (target->data[offset + repeat] == target->data[offset - 1])) {
+      repeat++;
+    }
+    if (repeat >= BPS_MIN_RUN) {
+      bps_write_literal(&writer, target, literal, offset);
+      bps_write_action(&writer, BPS_TARGET_COPY, repeat);
+      if (offset - 1 >= target_relative) {
+        bps_write_number(&writer, (uint64_t)(offset - 1 - target_relative) << 1);
+      } else {
+        bps_write_number(&writer, ((uint64_t)(target_relative - (offset - 1)) << 1) | 1);
+      }
+      offset += repeat;
+      target_relative = offset - 1;
+      literal = offset;
+      continue;
+    }
 
+    offset++;
+  }
+  bps_write_literal(&writer, target, literal, offset);
+
+  uint32_t footer[2] = { crc32(source->data, source->size, 0), crc32(target->data, target->size, 0) };
+  bps_write(&writer, footer, sizeof(footer));
+  uint32_t patch_crc = writer.crc;
+  bps_write(&writer, &patch_crc, sizeof(patch_crc));
+  printf("Delta has %zu bytes\n", writer.size);
+  return !writer.failed;
+}
 
-  // FIXME: load_success: Yay! Shift down size, to compensate for higher resolution
-  uint32_t memory_offset_load_success = memory_offset;
-  #if 1
+// Applies a delta in one pass over the delta and the source. Only copies from
+// elsewhere in the source or from far back in the target need to seek
+typedef struct {
+  FILE* patch;
+  uint32_t patch_crc;
+  FILE* source;
+  uint64_t source_offset;
+  uint64_t source_relative;
+  uint32_t source_crc;
+  FILE* target;
+  uint64_t target_offset;
+  uint64_t target_relative;
+  uint32_t target_crc;
+  bool failed;
+  uint8_t buffer[BPS_BUFFER_SIZE];
+
+  // Most recent bytes of the target, indexed by their offset
+  uint8_t window[BPS_BUFFER_SIZE];
+} BpsApplier;
+
+static void bps_read(BpsApplier* applier, void* data, size_t size) {
+  if (fread(data, 1, size, applier->patch) != size) {
+    memset(data, 0x00, size);
+    applier->failed = true;
+  }
+  applier->patch_crc = crc32(data, size, applier->patch_crc);
+  return;
+}
 
-  // Shift the width and height of the sprite to the right
-  #if 1
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write8(target, memory_offset, 0); memory_offset += 1;
-  write8(target, memory_offset, 1); memory_offset += 1;
-
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x68); memory_offset += 1;
-  write8(target, memory_offset, 14); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-  #endif
+static uint64_t bps_read_number(BpsApplier* applier) {
+  uint64_t value = 0;
+  uint64_t shift = 1;
+  for(unsigned int i = 0; i < 10; i++) {
+    uint8_t byte;
+    bps_read(applier, &byte, 1);
+    value += (byte & 0x7F) * shift;
+    if (byte & 0x80) {
+      return value;
+    }
+    shift <<= 7;
+    value += shift;
+  }
+  applier->failed = true;
+  return 0;
+}
 
-  // Get address of page and repeat steps
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x50); memory_offset += 1;
-  write8(target, memory_offset, 16); memory_offset += 1;
+static int64_t bps_read_relative(BpsApplier* applier) {
+  uint64_t value = bps_read_number(applier);
+  int64_t relative = value >> 1;
+  return (value & 1) ? -relative : relative;
+}
 
-  #if 1
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x6A); memory_offset += 1;
-  write8(target, memory_offset, 0); memory_offset += 1;
-  write8(target, memory_offset, 1); memory_offset += 1;
-
-  write8(target, memory_offset, 0x66); memory_offset += 1;
-  write8(target, memory_offset, 0xC1); memory_offset += 1;
-  write8(target, memory_offset, 0x6A); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-  write8(target, memory_offset, 2); memory_offset += 1;
-  #endif
+static void bps_output(BpsApplier* applier, const uint8_t* data, size_t size) {
+  applier->failed |= (fwrite(data, 1, size, applier->target) != size);
+  applier->target_crc = crc32(data, size, applier->target_crc);
+  for(size_t i = 0; i < size; i++) {
+    applier->window[(applier->target_offset + i) % BPS_BUFFER_SIZE] = data[i];
+  }
+  applier->target_offset += size;
+  return;
+}
 
-  // Get address of texture and repeat steps
+// Reads the source sequentially up to offset, so it's checksummed in one pass
+static void bps_source_read(BpsApplier* applier, uint64_t offset, uint8_t* data) {
+  while(!applier->failed && (applier->source_offset < offset)) {
+    size_t size = bps_chunk(offset - applier->source_offset);
+    uint8_t* out = (data != NULL) ? data : applier->buffer;
+    if (fread(out, 1, size, applier->source) != size) {
+      fprintf(stderr, "Source is shorter than expected\n");
+      applier->failed = true;
+      break;
+    }
+    applier->source_crc = crc32(out, size, applier->source_crc);
+    applier->source_offset += size;
+    if (data != NULL) {
+      bps_output(applier, data, size);
+    }
+  }
+  return;
+}
 
-  //0:  8b 50 10                mov    edx,DWORD PTR [eax+0x10]
-  //3:  66 c1 6a 02 02          shr    WORD PTR [edx+0x2],0x2
-  #endif
+static void bps_copy_source(BpsApplier* applier, size_t length) {
+  applier->source_relative += bps_read_relative(applier);
+  if (fseek(applier->source, (long)applier->source_relative, SEEK_SET) != 0) {
+    fprintf(stderr, "Delta needs a seekable source\n");
+    applier->failed = true;
+    return;
+  }
+  while(!applier->failed && (length > 0)) {
+    size_t size = bps_chunk(length);
+    applier->failed |= (fread(applier->buffer, 1, size, applier->source) != size);
+    bps_output(applier, applier->buffer, size);
+    applier->source_relative += size;
+    length -= size;
+  }
+  applier->failed |= (fseek(applier->source, (long)applier->source_offset, SEEK_SET) != 0);
+  return;
+}
 
-  // finish: Clear stack and return
-  uint32_t memory_offset_finish = memory_offset;
-  memory_offset = add_esp(target, memory_offset, 0x4 + 0x400);
-  memory_offset = retn(target, memory_offset);
+static void bps_copy_target(BpsApplier* applier, size_t length) {
+  applier->target_relative += bps_read_relative(applier);
+  while(!applier->failed && (length > 0)) {
+    if (applier->target_relative >= applier->target_offset) {
+      applier->failed = true;
+      break;
+    }
 
-  // Start of actual code
-  uint32_t memory_offset_tga_loader_code = memory_offset;
+    // Copies may overlap their output, so never copy past the current end
+    uint64_t distance = applier->target_offset - applier->target_relative;
+    size_t size = bps_chunk((length < distance) ? length : distance);
+    if (distance <= BPS_BUFFER_SIZE) {
+      for(size_t i = 0; i < size; i++) {
+        applier->buffer[i] = applier->window[(applier->target_relative + i) % BPS_BUFFER_SIZE];
+      }
+    } else {
+      applier->failed |= (fseek(applier->target, (long)applier->target_relative, SEEK_SET) != 0);
+      applier->failed |= (fread(applier->buffer, 1, size, applier->target) != size);
+      applier->failed |= (fseek(applier->target, 0, SEEK_END) != 0);
+    }
+    bps_output(applier, applier->buffer, size);
+    applier->target_relative += size;
+    length -= size;
+  }
+  return;
+}
 
-  // Read the sprite_index from stack
-  //  -> mov     eax, [esp+4]
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x44); memory_offset += 1;
-  write8(target, memory_offset, 0x24); memory_offset += 1;
-  write8(target, memory_offset, 0x04); memory_offset += 1;
+static bool bps_apply(FILE* patch, FILE* source, FILE* target) {
+  BpsApplier* applier = malloc(sizeof(BpsApplier));
+  assert(applier != NULL);
+  memset(applier, 0x00, offsetof(BpsApplier, buffer));
+  applier->patch = patch;
+  applier->source = source;
+  applier->target = target;
+
+  char magic[4];
+  bps_read(applier, magic, sizeof(magic));
+  if (memcmp(magic, "BPS1", 4)) {
+    fprintf(stderr, "Not a BPS delta\n");
+    free(applier);
+    return false;
+  }
+  uint64_t source_size = bps_read_number(applier);
+  uint64_t target_size = bps_read_number(applier);
+  uint64_t metadata_size = bps_read_number(applier);
+  while(!applier->failed && (metadata_size > 0)) {
+    size_t size = bps_chunk(metadata_size);
+    bps_read(applier, applier->buffer, size);
+    metadata_size -= size;
+  }
 
-  // Make room for sprintf buffer and keep the pointer in edx
-  //  -> add     esp, -400h
-  memory_offset = add_esp(target, memory_offset, -0x400);
-  //  -> mov     edx, esp
-  write8(target, memory_offset, 0x89); memory_offset += 1;
-  write8(target, memory_offset, 0xE2); memory_offset += 1;
+  while(!applier->failed && (applier->target_offset < target_size)) {
+    uint64_t action = bps_read_number(applier);
+    uint64_t length = (action >> 2) + 1;
+    if (length > target_size - applier->target_offset) {
+      applier->failed = true;
+      break;
+    }
+    switch(action & 3) {
+    case BPS_SOURCE_READ:
+      if (applier->target_offset < applier->source_offset) {
+        applier->failed = true;
+        break;
+      }
+      bps_source_read(applier, applier->target_offset, NULL);
+      bps_source_read(applier, applier->target_offset + length, applier->buffer);
+      break;
+    case BPS_TARGET_READ:
+      while(!applier->failed && (length > 0)) {
+        size_t size = bps_chunk(length);
+        bps_read(applier, applier->buffer, size);
+        bps_output(applier, applier->buffer, size);
+        length -= size;
+      }
+      break;
+    case BPS_SOURCE_COPY:
+      bps_copy_source(applier, length);
+      break;
+    case BPS_TARGET_COPY:
+      bps_copy_target(applier, length);
+      break;
+    }
+  }
 
-  // Generate the path, keep sprite_index on stack as we'll keep using it
-  memory_offset = push_eax(target, memory_offset); // (sprite_index)
-  memory_offset = push_u32(target, memory_offset, memory_offset_tga_path); // (fmt)
-  memory_offset = push_edx(target, memory_offset); // (buffer)
-  memory_offset = call(target, memory_offset, 0x49EB80); // sprintf
-  memory_offset = pop_edx(target, memory_offset); // (buffer)
-  memory_offset = add_esp(target, memory_offset, 0x4);
+  // Checksum the rest of the source, which must end where the delta says
+  bps_source_read(applier, source_size, NULL);
+  if (!applier->failed && (fgetc(source) != EOF)) {
+    fprintf(stderr, "Source is longer than expected\n");
+    applier->failed = true;
+  }
 
-  // Attempt to load the TGA, then remove path from stack
-  memory_offset = push_edx(target, memory_offset); // (buffer)
-  memory_offset = call(target, memory_offset, 0x4114D0); // load_sprite_from_tga_and_add_loaded_sprite
-  memory_offset = add_esp(target, memory_offset, 0x4);
+  uint32_t footer[2];
+  bps_read(applier, footer, sizeof(footer));
+  uint32_t patch_crc = applier->patch_crc;
+  uint32_t expected_patch_crc;
+  bps_read(applier, &expected_patch_crc, sizeof(expected_patch_crc));
+
+  bool applied = false;
+  if (applier->failed) {
+    fprintf(stderr, "Delta doesn't fit the source or is damaged\n");
+  } else if (expected_patch_crc != patch_crc) {
+    fprintf(stderr, "Delta is damaged (CRC 0x%08X, expected 0x%08X)\n", patch_crc, expected_patch_crc);
+  } else if (footer[0] != applier->source_crc) {
+    fprintf(stderr, "Delta is for a different file (CRC 0x%08X, expected 0x%08X)\n", applier->source_crc, footer[0]);
+  } else if (footer[1] != applier->target_crc) {
+    fprintf(stderr, "Result is corrupt (CRC 0x%08X, expected 0x%08X)\n", applier->target_crc, footer[1]);
+  } else {
+    printf("Applied delta (CRC 0x%08X)\n", applier->target_crc);
+    applied = true;
+  }
+  free(applier);
+  return applied;
+}
 
-  // Check if the load failed
-  memory_offset = test_eax_eax(target, memory_offset);
-  //  -> jnz load_success
-  memory_offset = jnz(target, memory_offset, memory_offset_load_success);
+static FILE* open_input(const char* path) {
+  if (!strcmp(path, "-")) {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    return stdin;
+  }
+  return fopen(path, "rb");
+}
 
-  // Load failed, so load the original sprite (sprite-index still on stack)
-  memory_offset = call(target, memory_offset, 0x446CA0); // load_sprite_internal
+// Writes a delta which turns source into target
+static int delta_export(const char* source_path, const char* target_path, const char* output_path) {
+  Image source;
+  Image target;
+  if (!image_load(&source, source_path)) {
+    fprintf(stderr, "Unable to open '%s'\n", source_path);
+    return 1;
+  }
+  if (!image_load(&target, target_path)) {
+    fprintf(stderr, "Unable to open '%s'\n", target_path);
+    image_close(&source);
+    return 1;
+  }
 
-  //  -> jmp finish
-  memory_offset = jmp(target, memory_offset, memory_offset_finish);
+  bool written;
+  if (!strcmp(output_path, "-")) {
+    FILE* f = claim_stdout();
+    assert(f != NULL);
+    written = bps_diff(&source, &target, f);
+    written &= (fclose(f) == 0);
+  } else {
+    char temporary_path[4096 + 32];
+    FILE* f = temporary_open(temporary_path, output_path, "wb");
+    written = (f != NULL) && temporary_commit(f, temporary_path, output_path, bps_diff(&source, &target, f));
+  }
+  image_close(&source);
+  image_close(&target);
+  if (!written) {
+    fprintf(stderr, "Unable to write '%s'\n", output_path);
+    return 1;
+  }
+  return 0;
+}
 
+// Applies a delta, the output is only replaced if all checksums match
+static int delta_apply(const char* patch_path, const char* source_path, const char* output_path) {
+  FILE* patch = open_input(patch_path);
+  if (patch == NULL) {
+    fprintf(stderr, "Unable to open '%s'\n", patch_path);
+    return 1;
+  }
+  FILE* source = open_input(source_path);
+  if (source == NULL) {
+    fprintf(stderr, "Unable to open '%s'\n", source_path);
+    fclose(patch);
+    return 1;
+  }
 
-  // Install it by jumping from 0x446FB0 (and we'll return directly)
-  jmp(target, 0x446FB0, memory_offset_tga_loader_code);
+  bool applied;
+  if (!strcmp(output_path, "-")) {
+    FILE* f = claim_stdout();
+    assert(f != NULL);
+    applied = bps_apply(patch, source, f);
+    applied &= (fclose(f) == 0);
+  } else {
+    char temporary_path[4096 + 32];
+    FILE* f = temporary_open(temporary_path, output_path, "w+b");
+    applied = (f != NULL) && temporary_commit(f, temporary_path, output_path, bps_apply(patch, source, f));
+  }
+  if (patch != stdin) {
+    fclose(patch);
+  }
+  if (source != stdin) {
+    fclose(source);
+  }
+  return applied ? 0 : 1;
+}
+
+// Writes the plan which the DLL applies instead of patching at startup. The
+// patch is placed right after the image, where the DLL allocates it
+static int plan_export(const char* path, const char* output_path) {
+  Image image;
+  if (!image_load(&image, path)) {
+    fprintf(stderr, "Unable to open '%s'\n", path);
+    return 1;
+  }
+  if (!image_parse(&image)) {
+    fprintf(stderr, "'%s' is not a valid executable\n", path);
+    image_close(&image);
+    return 1;
+  }
+  Target target = &image.backend;
 
-  return memory_offset;
+  uint32_t image_base = image.image_base;
+  uint32_t coff_header = find_coff_header(target, image_base);
+  uint32_t optional_header = coff_header + 20;
+  uint32_t timestamp = read32(target, coff_header + 4);
+  uint32_t size_of_image = read32(target, optional_header + 56);
+  uint32_t memory_offset = image_base + ((size_of_image + 0xFFF) & ~0xFFF);
+
+  uint32_t addresses[ADDRESS_COUNT];
+  addresses_init(target, image_base, addresses);
+  Schedule schedule;
+  uint32_t patch_size;
+  if (!measure_patch(target, memory_offset, NULL, &schedule, &patch_size)) {
+    schedule_free(&schedule);
+    image_close(&image);
+    return 1;
+  }
+
+  size_t layout_size;
+  uint8_t* layout = image_layout(&image, image_base, patch_size, &layout_size);
+  image_close(&image);
+  Memory memory;
+  memory_init(&memory, layout, image_base, layout_size);
+  memory.backend.addresses = addresses;
+  Batch batch;
+  batch_init(&batch, &memory.backend);
+  Cave cave;
+  cave_init(&cave, memory_offset, patch_size);
+  patch(&batch.backend, &cave, &schedule, NULL);
+  cave_free(&cave);
+  schedule_free(&schedule);
+  size_t plan_size;
+  uint8_t* plan = plan_build(&batch, timestamp, memory_offset, patch_size, &plan_size);
+  free(layout);
+
+  char temporary_path[4096 + 32];
+  FILE* f = temporary_open(temporary_path, output_path, "wb");
+  bool written = (f != NULL) && temporary_commit(f, temporary_path, output_path, fwrite(plan, 1, plan_size, f) == plan_size);
+  free(plan);
+  if (!written) {
+    fprintf(stderr, "Unable to write '%s'\n", output_path);
+    return 1;
+  }
+  printf("Plan has %zu bytes\n", plan_size);
+  return 0;
 }
 
-static uint32_t patch_trigger_display(Target target, uint32_t memory_offset) {
-  // Display triggers
+// Puts back the replaced game bytes in reverse order and drops the section
+static bool unpatch(Image* image, uint32_t image_base, uint32_t coff_header) {
+  Target target = &image->backend;
+  uint32_t optional_header = coff_header + 20;
+  uint32_t size_of_optional_header = read16(target, coff_header + 16);
+  uint16_t section_count = read16(target, coff_header + 2);
+  uint32_t hack_section_header = optional_header + size_of_optional_header + (section_count - 1) * 40;
+  if ((section_count == 0) ||
+      (read32(target, hack_section_header + 0) != *(uint32_t*)"hack") ||
+      (read32(target, hack_section_header + 4) != 0x00000000)) {
+    fprintf(stderr, "This file has not been patched.\n");
+    return false;
+  }
 
-  const char* trigger_string = "Trigger %d activated";
-  float trigger_string_display_duration = 3.0f;
+  Manifest manifest;
+  uint32_t section = image_base + read32(target, hack_section_header + 12);
+  if (!manifest_load(target, section, read32(target, hack_section_header + 8), &manifest)) {
+    fprintf(stderr, "This file has been patched by an older version, which can't be undone.\n");
+    return false;
+  }
 
-  uint32_t memory_offset_trigger_string = memory_offset;
-  writex(target, memory_offset, trigger_string, strlen(trigger_string));
-  memory_offset += strlen(trigger_string) + 1;
+  size_t restored = 0;
+  for(unsigned int i = manifest.record_count; i > 0; i--) {
+    const JournalRecord* record = &manifest.records[i - 1];
+    writex(target, record->address, record->data, record->size);
+    restored += record->size;
+  }
 
-  uint32_t memory_offset_trigger_code = memory_offset;
+  const OriginalHeaders* original = &manifest.original;
+  writex(target, hack_section_header, original->section_header, sizeof(original->section_header));
+  write16(target, coff_header + 2, original->section_count);
+  write32(target, optional_header + 4, original->size_of_code);
+  write32(target, optional_header + 8, original->size_of_initialized_data);
+  write32(target, optional_header + 56, original->size_of_image);
+  write32(target, optional_header + 64, original->checksum);
+  image_resize(image, original->file_size);
+  if (!image_parse(image)) {
+    fprintf(stderr, "The restored headers are invalid.\n");
+    manifest_free(&manifest);
+    return false;
+  }
+  printf("Restored %zu bytes in %u places and removed the patch section\n", restored, manifest.record_count);
 
-  // Read the trigger from stack
-  //  -> mov     eax, [esp+4]
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x44); memory_offset += 1;
-  write8(target, memory_offset, 0x24); memory_offset += 1;
-  write8(target, memory_offset, 0x04); memory_offset += 1;
+  manifest_free(&manifest);
+  return true;
+}
 
-  // Get pointer to section 8
-  //0:  8b 40 4c                mov    eax,DWORD PTR [eax+0x4c]
-  write8(target, memory_offset, 0x8B); memory_offset += 1;
-  write8(target, memory_offset, 0x40); memory_offset += 1;
-  write8(target, memory_offset, 0x4C); memory_offset += 1;
+#endif
 
-  // Read the section8.trigger_action field
-  //3:  0f b7 40 24             movzx  eax,WORD PTR [eax+0x24] 
-  write8(target, memory_offset, 0x0F); memory_offset += 1;
-  write8(target, memory_offset, 0xB7); memory_offset += 1;
-  write8(target, memory_offset, 0x40); memory_offset += 1;
-  write8(target, memory_offset, 0x24); memory_offset += 1;
+#ifndef LOADER
 
-  // Make room for sprintf buffer and keep the pointer in edx
-  //  -> add     esp, -400h
-  memory_offset = add_esp(target, memory_offset, -0x400);
-  //  -> mov     edx, esp
-  write8(target, memory_offset, 0x89); memory_offset += 1;
-  write8(target, memory_offset, 0xE2); memory_offset += 1;
+#if USE_RESULT_CACHE
 
-  // Generate the string we'll display
-  memory_offset = push_eax(target, memory_offset); // (trigger index)
-  memory_offset = push_u32(target, memory_offset, memory_offset_trigger_string); // (fmt)
-  memory_offset = push_edx(target, memory_offset); // (buffer)
-  memory_offset = call(target, memory_offset, 0x49EB80); // sprintf
-  memory_offset = pop_edx(target, memory_offset); // (buffer)
-  memory_offset = add_esp(target, memory_offset, 0x8);
+// Patched files are stored next to the converted textures, named after a hash
+// of the input file, the patcher, its settings and the textures.
+// Bump the version whenever the meaning of the key changes.
+#define RESULT_CACHE_PATH "textures/cache"
+#define RESULT_CACHE_VERSION 1
 
-  // Display a message
-  memory_offset = push_u32(target, memory_offset, *(uint32_t*)&trigger_string_display_duration);
-  memory_offset = push_edx(target, memory_offset); // (buffer)
-  memory_offset = call(target, memory_offset, 0x44FCE0);
-  memory_offset = add_esp(target, memory_offset, 0x8);
+// Each result is a whole executable, so only the most recently used ones
+// are kept
+#define RESULT_CACHE_MAX_ENTRIES 8
 
-  // Pop the string buffer off of the stack
-  memory_offset = add_esp(target, memory_offset, 0x400);
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifndef _WIN32
+#include <dirent.h>
+#include <utime.h>
+#endif
 
-  // Jump to the real function to run the trigger
-  memory_offset = jmp(target, memory_offset, 0x47CE60);
+// Path of the running patcher, so results of other builds aren't reused
+static const char* patcher_path = NULL;
 
-  // Install it by replacing the call destination (we'll jump to the real one)
-  call(target, 0x476E80, memory_offset_trigger_code);
+static void result_cache_path(char* path, uint64_t key) {
+  sprintf(path, RESULT_CACHE_PATH "/%016llX.exe", (unsigned long long)key);
+  return;
+}
 
-  return memory_offset;
+static bool hash_file(const char* path, uint64_t* hash) {
+  size_t size;
+  uint8_t* data = load_file(path, &size);
+  if (data == NULL) {
+    return false;
+  }
+  *hash = fnv1a(&size, sizeof(size), *hash);
+  *hash = fnv1a(data, size, *hash);
+  free(data);
+  return true;
 }
 
-static void patch(Target target, uint32_t memory_offset) {
-#if 0
-  // This is a debug feature to dump the original font textures
+// Returns false if some input can't be read, the result isn't cached then
+static bool result_cache_key(Target target, const Image* image, uint64_t* key) {
+  uint32_t version = RESULT_CACHE_VERSION;
+  uint64_t hash = fnv1a(&version, sizeof(version), FNV_OFFSET);
 
-  dumpTextureTable(target, 0x4BF91C, 3, 0, 64, 128, "font0");
-  dumpTextureTable(target, 0x4BF7E4, 3, 0, 64, 128, "font1");
-  dumpTextureTable(target, 0x4BF84C, 3, 0, 64, 128, "font2");
-  dumpTextureTable(target, 0x4BF8B4, 3, 0, 64, 128, "font3");
-  dumpTextureTable(target, 0x4BF984, 3, 0, 64, 128, "font4");
+#ifdef _WIN32
+  char path[4096];
+  if ((GetModuleFileNameA(NULL, path, sizeof(path)) == 0) || !hash_file(path, &hash)) {
+    return false;
+  }
+#elif defined(__linux__)
+  if (!hash_file("/proc/self/exe", &hash)) {
+    return false;
+  }
+#else
+  if ((patcher_path == NULL) || !hash_file(patcher_path, &hash)) {
+    return false;
+  }
 #endif
 
-
-// Start the actual patching
+  hash = fnv1a(&settings, sizeof(settings), hash);
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    hash = fnv1a(patches[i].name, strlen(patches[i].name) + 1, hash);
+  }
+  hash = fnv1a(&image->size, sizeof(image->size), hash);
+  hash = fnv1a(image->data, image->size, hash);
 
 #if USE_PATCHED_FONTS
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF91C, 0x42D745, 0x42D753, 512, 1024, "font0");
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF7E4, 0x42D786, 0x42D794, 512, 1024, "font1");
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF84C, 0x42D7C7, 0x42D7D5, 512, 1024, "font2");
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF8B4, 0x42D808, 0x42D816, 512, 1024, "font3");
-  memory_offset = patchTextureTable(target, memory_offset, 0x4BF984, 0x42D849, 0x42D857, 512, 1024, "font4");
+  for(unsigned int i = 0; i < FONT_COUNT; i++) {
+    uint32_t table = target->addresses[fonts[i].table];
+    uint32_t count = (table != 0) ? read32(target, table) : 0;
+    for(unsigned int j = 0; j < count; j++) {
+      char texture_path[4096];
+      sprintf(texture_path, TEXTURE_PATH_FORMAT, fonts[i].name, j);
+      hash = fnv1a(texture_path, strlen(texture_path) + 1, hash);
+      if (!hash_file(texture_path, &hash)) {
+        return false;
+      }
+    }
+  }
 #endif
 
-#if USE_R100
-	uint8_t upgrade_levels[7]  = {    3,    5,    5,    5,    5,    5,    5 };
-#else
-	uint8_t upgrade_levels[7]  = {    5,    5,    5,    5,    5,    5,    5 };
+  *key = hash;
+  return true;
+}
+
+// Copies a file, sharing its blocks if the file system supports it
+static bool copy_file(FILE* source, FILE* f) {
+#ifdef FICLONE
+  if ((fflush(f) == 0) && (ioctl(fileno(f), FICLONE, fileno(source)) == 0)) {
+    return true;
+  }
 #endif
-	uint8_t upgrade_healths[7] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-	memory_offset = patch_network_upgrades(target, memory_offset, upgrade_levels, upgrade_healths);
+  uint8_t buffer[0x10000];
+  size_t size;
+  while((size = fread(buffer, 1, sizeof(buffer), source)) > 0) {
+    if (fwrite(buffer, 1, size, f) != size) {
+      return false;
+    }
+  }
+  return !ferror(source);
+}
 
-#if 1
-  memory_offset = patch_network_collisions(target, memory_offset);
+// Writes the cached result instead of patching, the image is closed then
+// Returns -1 without a cached result, otherwise the image is closed and the
+// exit code for writing the result is returned
+static int result_cache_fetch(uint64_t key, Image* image, const char* input_path, const char* output_path, FILE* output_stream) {
+  char path[4096];
+  result_cache_path(path, key);
+  FILE* source = fopen(path, "rb");
+  if (source == NULL) {
+    return -1;
+  }
+  image_close(image);
+
+  bool written;
+  const char* destination = (output_path != NULL) ? output_path : input_path;
+  if (output_stream != NULL) {
+    written = copy_file(source, output_stream);
+    written &= (fclose(output_stream) == 0);
+  } else {
+    char temporary_path[4096 + 32];
+    FILE* f = temporary_open(temporary_path, destination, "wb");
+    written = (f != NULL) && temporary_commit(f, temporary_path, destination, copy_file(source, f));
+  }
+  fclose(source);
+  if (!written) {
+    fprintf(stderr, "Unable to write '%s'\n", destination);
+  }
+
+  // Mark the result as used, so it is kept over older ones
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file != INVALID_HANDLE_VALUE) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(file, NULL, NULL, &now);
+    CloseHandle(file);
+  }
+#else
+  utime(path, NULL);
 #endif
+  return written ? 0 : 1;
+}
 
-#if 0
-  uint32_t samplerate = 22050 * 2;
-  uint8_t bits_per_sample = 16;
-  bool stereo = true;
+typedef struct {
+  char name[32];
+  uint64_t time;
+} ResultCacheEntry;
+
+static int result_cache_entry_compare(const void* a, const void* b) {
+  const ResultCacheEntry* entry_a = a;
+  const ResultCacheEntry* entry_b = b;
+  if (entry_a->time != entry_b->time) {
+    return (entry_a->time > entry_b->time) ? -1 : 1;
+  }
+  return strcmp(entry_a->name, entry_b->name);
+}
 
-  memory_offset = patch_audio_stream_quality(target, memory_offset, samplerate, bits_per_sample, stereo);
+// Adds an entry unless it isn't a result, which are named like "%016llX.exe"
+static void result_cache_entry_add(ResultCacheEntry** entries, unsigned int* count, const char* name, uint64_t time) {
+  size_t length = strlen(name);
+  if ((length != 16 + 4) || strcmp(&name[16], ".exe") || (strspn(name, "0123456789ABCDEF") != 16)) {
+    return;
+  }
+  *entries = realloc(*entries, (*count + 1) * sizeof(ResultCacheEntry));
+  assert(*entries != NULL);
+  strcpy((*entries)[*count].name, name);
+  (*entries)[*count].time = time;
+  (*count)++;
+  return;
+}
+
+// Removes all but the RESULT_CACHE_MAX_ENTRIES most recently used results
+static void result_cache_prune(void) {
+  ResultCacheEntry* entries = NULL;
+  unsigned int count = 0;
+#ifdef _WIN32
+  WIN32_FIND_DATAA data;
+  HANDLE find = FindFirstFileA(RESULT_CACHE_PATH "/*.exe", &data);
+  if (find == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  do {
+    uint64_t time = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    result_cache_entry_add(&entries, &count, data.cFileName, time);
+  } while(FindNextFileA(find, &data));
+  FindClose(find);
+#else
+  DIR* directory = opendir(RESULT_CACHE_PATH);
+  if (directory == NULL) {
+    return;
+  }
+  struct dirent* entry;
+  while((entry = readdir(directory)) != NULL) {
+    char path[4096];
+    struct stat st;
+    snprintf(path, sizeof(path), RESULT_CACHE_PATH "/%s", entry->d_name);
+    if (stat(path, &st) == 0) {
+      result_cache_entry_add(&entries, &count, entry->d_name, st.st_mtime);
+    }
+  }
+  closedir(directory);
 #endif
 
-#if 0
-  memory_offset = patch_sprite_loader_to_load_tga(target, memory_offset);
+  if (count > RESULT_CACHE_MAX_ENTRIES) {
+    qsort(entries, count, sizeof(ResultCacheEntry), result_cache_entry_compare);
+    for(unsigned int i = RESULT_CACHE_MAX_ENTRIES; i < count; i++) {
+      char path[4096];
+      snprintf(path, sizeof(path), RESULT_CACHE_PATH "/%s", entries[i].name);
+      remove(path);
+    }
+  }
+  free(entries);
+  return;
+}
+
+static void result_cache_store(uint64_t key, const Image* image) {
+  char path[4096];
+  result_cache_path(path, key);
+  cache_write(RESULT_CACHE_PATH, path, NULL, 0, image->data, image->size);
+  result_cache_prune();
+  return;
+}
+
 #endif
 
-#if USE_TRIGGER_DISPLAY
-  memory_offset = patch_trigger_display(target, memory_offset);
 #endif
 
-  // Dump out the network GUID
+#ifndef LOADER
 
-  printf("Network GUID is: ");
-  for(int i = 0; i < 16; i++) {
-    printf("%02X", read8(target, 0x4AF9B0 + i));
-  }
-  printf("\n"); 
-}
+// What patch_game does with the executable
+typedef enum {
+  PATCH_APPLY,
+  PATCH_UNDO,
+  PATCH_VERIFY
+} PatchMode;
 
-// Allocate more space, say... 4MB?
-// (we use the .rsrc section, which is last in memory)
-uint32_t patch_size = 4 * 1024 * 1024;
+#endif
 
-#ifndef DLL
+// Patches one executable, or the game which the loader starts
+#ifdef LOADER
+static int patch_game(void) {
+#else
+static int patch_game(const char* input_path, const char* output_path, PatchMode mode, Trace* trace) {
+#endif
 
-int main(int argc, char* argv[]) {
+#ifdef LOADER
+  Trace* trace = NULL;
+  Process process;
+  memset(&process.backend, 0x00, sizeof(process.backend));
+  process.backend.writex = process_writex;
+  process.backend.readx = process_readx;
+  Target target = &process.backend;
+#else
+  Image image;
+  Target target = &image.backend;
+#endif
 
-  Target target;
+#ifdef LOADER
 
   //FIXME: Retrieve this somehow
   uint32_t image_base = 0x400000;
 
-#ifdef LOADER
+  // Errors name the file, like they do for the patcher
+  const char* input_path = "swep1rcr.exe";
 
   STARTUPINFO startup_info;
   memset(&startup_info, 0x00, sizeof(startup_info));
   char cmd_line[0x8000];
   strcpy(cmd_line, GetCommandLine());
-  BOOL status = CreateProcess("swep1rcr.exe", cmd_line, NULL, NULL, FALSE, CREATE_SUSPENDED, NULL, NULL, &startup_info, &target.process_information);
+  BOOL status = CreateProcess(input_path, cmd_line, NULL, NULL, FALSE, CREATE_SUSPENDED, NULL, NULL, &startup_info, &process.process_information);
 
   printf("Status: %d\n", status);
 
@@ -847,137 +6012,649 @@ int main(int argc, char* argv[]) {
 
 #else
 
-  target.f = fopen(argv[1], "rb+");
-  assert(target.f != NULL);
+  // With an output, the input is only read and the patched image is written
+  // in one go at the end
+  FILE* output_stream = NULL;
+  if ((output_path != NULL) && !strcmp(output_path, "-")) {
+    output_stream = claim_stdout();
+    assert(output_stream != NULL);
+  }
+
+  bool opened = ((output_path != NULL) || (mode == PATCH_VERIFY)) ? image_load(&image, input_path) : image_open(&image, input_path);
+  if (!opened) {
+    fprintf(stderr, "Unable to open '%s'\n", input_path);
+    return 1;
+  }
 
 #endif
 
-  //FIXME: Locate this properly
-  uint32_t coff_header = image_base + 212;
+#ifndef LOADER
+  if (!image_parse(&image)) {
+    fprintf(stderr, "'%s' is not a valid executable\n", input_path);
+    image_close(&image);
+    return 1;
+  }
+  uint32_t image_base = image.image_base;
+#endif
 
-  // Read timestamp of binary to see which base version this is
-  uint32_t timestamp = read32(target, coff_header + 4);
+  uint32_t coff_header = find_coff_header(target, image_base);
 
-  //FIXME: Now set the correct pointers for this binary
-  switch(timestamp) {
-  case 0x3C60692C:
-    break;
-  default:
-    printf("Unsupported version of the game, timestamp 0x%08X\n", timestamp);
-    return 1;
+#ifndef LOADER
+  if (mode == PATCH_UNDO) {
+    bool undone = unpatch(&image, image_base, coff_header);
+    bool saved = image_finish(&image, output_path, output_stream);
+    return (undone && saved) ? 0 : 1;
   }
+#endif
 
   uint32_t optional_header = coff_header + 20;
   assert(image_base == read32(target, optional_header + 28));
 
-#ifdef LOADER
+  // Select a unused memory region (after SizeOfImage) and align it
+  uint32_t memory_offset = read32(target, optional_header + 56);
+  memory_offset = (memory_offset + 0xFFF) & ~0xFFF;
 
-  uint32_t memory_offset = (uintptr_t)VirtualAllocEx(target.process_information.hProcess, NULL, patch_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-  printf("Allocated memory at 0x%08X\n", memory_offset);
+  // Patches see the original game, even if it has been patched before
+  Target patch_target = target;
+  Manifest* previous = NULL;
 
-#else
+#ifndef LOADER
 
   // Search for existing section
   uint32_t size_of_optional_header = read16(target, coff_header + 16);
   uint32_t section_header = optional_header + size_of_optional_header;
   uint16_t section_count = read16(target, coff_header + 2);
-#if 1
+  uint32_t hack_section_header = 0;
   for(int i = 0; i < section_count; i++) {
     uint32_t old_section_header = section_header + i * 40;
     uint32_t n1 = read32(target, old_section_header + 0);
     uint32_t n2 = read32(target, old_section_header + 4);
     if ((n1 == *(uint32_t*)"hack") && (n2 == 0x00000000)) {
-      fprintf(stderr, "This file had already been patched!\n"
-                      "This tool is unable to upgrade an existing patch.\n"
-                      "Please find an unmodified file.\n"
-                      "Aborting.\n");
-
-      //FIXME: Undo patches, and allow to continue
+      hack_section_header = old_section_header;
+    }
+  }
 
+  // Update an existing patch in place
+  Manifest manifest;
+  Original original;
+  if (hack_section_header != 0) {
+    memory_offset = read32(target, hack_section_header + 12);
+    if (!manifest_load(target, image_base + memory_offset, read32(target, hack_section_header + 8), &manifest)) {
+      fprintf(stderr, "'%s' had already been patched by an older version!\n"
+                      "This tool is unable to upgrade that patch.\n"
+                      "Please find an unmodified file.\n"
+                      "Aborting.\n", input_path);
+      image_close(&image);
       return 1;
     }
+    previous = &manifest;
+    original_init(&original, target, previous);
+    patch_target = &original.backend;
+    printf("Updating existing patch\n");
+  }
+
+  // Verifying compares the file to what the patch would write into it
+  if ((mode == PATCH_VERIFY) && (previous == NULL)) {
+    fprintf(stderr, "'%s' has not been patched\n", input_path);
+    image_close(&image);
+    return 1;
   }
+
 #endif
 
-  // Get rough offset where we'll place our stuff
-  fseek(target.f, 0, SEEK_END);
-  uint32_t file_offset = ftell(target.f);
+  // Find the addresses in the original game, which selects the patches for
+  // this version of it
+  uint32_t addresses[ADDRESS_COUNT];
+  addresses_init(patch_target, image_base, addresses);
+  target->addresses = addresses;
+  if (!patches_available(addresses)) {
+    fprintf(stderr, "'%s' is an unsupported version of the game, timestamp 0x%08X\n", input_path, read32(target, coff_header + 4));
+#ifdef LOADER
+    TerminateProcess(process.process_information.hProcess, 1);
+#else
+    if (previous != NULL) {
+      manifest_free(previous);
+    }
+    image_close(&image);
+#endif
+    return 1;
+  }
 
-  // Align offset to safe bound
-  fseek(target.f, file_offset, SEEK_SET);
-  file_offset = (file_offset + 0xFFF) & ~0xFFF;
+#if !defined(LOADER) && USE_RESULT_CACHE
+  // An identical earlier run gives the same bytes, so reuse them. A trace
+  // needs the patches to run, but the result is still stored.
+  uint64_t result_key;
+  bool cacheable = (mode != PATCH_VERIFY) && result_cache_key(target, &image, &result_key);
+  int cached = (cacheable && (trace == NULL)) ? result_cache_fetch(result_key, &image, input_path, output_path, output_stream) : -1;
+  if (cached >= 0) {
+    printf("Used the cached result %016llX\n", (unsigned long long)result_key);
+    if (previous != NULL) {
+      manifest_free(previous);
+    }
+    return cached;
+  }
+#endif
 
-  // Append section data
-  while(ftell(target.f) < (file_offset + patch_size)) {
-    uint8_t dummy = 0x00;
-    fwrite(&dummy, 1, 1, target.f);
+  // Find out how much space we need
+  Schedule schedule;
+  uint32_t patch_size;
+  if (!measure_patch(patch_target, image_base + memory_offset, previous, &schedule, &patch_size)) {
+    fprintf(stderr, "Unable to patch '%s'\n", input_path);
+#ifdef LOADER
+    TerminateProcess(process.process_information.hProcess, 1);
+#else
+    if (previous != NULL) {
+      manifest_free(previous);
+    }
+    image_close(&image);
+#endif
+    schedule_free(&schedule);
+    return 1;
+  }
+  printf("Patch requires 0x%X bytes\n", patch_size);
+
+#ifndef LOADER
+  // Patches which the file has already are written again, to compare them
+  unsigned int outdated = 0;
+  if (mode == PATCH_VERIFY) {
+    for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+      PatchRecord* record = &schedule.records[i];
+      if (record->apply && record->available) {
+        fprintf(stderr, "'%s' has an outdated '%s' patch\n", input_path, patches[i].name);
+        outdated++;
+      }
+      record->apply = true;
+    }
   }
+#endif
 
-  // Select a unused memory region (after SizeOfImage) and align it
-  uint32_t memory_offset = read32(target, optional_header + 56);
-  memory_offset = (memory_offset + 0xFFF) & ~0xFFF;
+#ifdef LOADER
 
-  // Create data for new section
-  uint32_t characteristics = 0;
-  characteristics |= 0x20; // Code
-  characteristics |= 0x40; // Initialized Data
-  characteristics |= 0x20000000; // Executable
-  characteristics |= 0x40000000; // Readable
-  characteristics |= 0x80000000; // Writeable
+  memory_offset = (uintptr_t)VirtualAllocEx(process.process_information.hProcess, NULL, patch_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+  printf("Allocated memory at 0x%08X\n", memory_offset);
 
-  // Append a new section
-  uint32_t size_of_headers = read32(target, optional_header + 60);
-  uint32_t new_section_header = section_header + section_count * 40;
-  assert((new_section_header + 40) <= (image_base + size_of_headers));
-  write32(target, new_section_header + 0, *(uint32_t*)"hack");
-  write32(target, new_section_header + 4, 0x00000000);
-  write32(target, new_section_header + 8, patch_size);
-  write32(target, new_section_header + 12, memory_offset);
-  write32(target, new_section_header + 16, patch_size);
-  write32(target, new_section_header + 20, file_offset);
-  write32(target, new_section_header + 24, 0x00000000);
-  write32(target, new_section_header + 28, 0x00000000);
-  write32(target, new_section_header + 32, 0x00000000);
-  write32(target, new_section_header + 36, characteristics);
+#else
 
-  // Increment number of sections
-  patch16_add(target, coff_header + 2, 1);
+  if (previous != NULL) {
+
+    // Grow the section if the patch doesn't fit anymore
+    uint32_t section_size = read32(target, hack_section_header + 8);
+    if (patch_size > section_size) {
+      uint32_t file_offset = read32(target, hack_section_header + 20);
+      if (file_offset + section_size != image.size) {
+        fprintf(stderr, "The patch section of '%s' is not at the end of the file, so it can't grow.\n"
+                        "Aborting.\n", input_path);
+        schedule_free(&schedule);
+        manifest_free(previous);
+        image_close(&image);
+        return 1;
+      }
+      image_resize(&image, file_offset + patch_size);
+      write32(target, hack_section_header + 8, patch_size);
+      write32(target, hack_section_header + 16, patch_size);
+      write32(target, optional_header + 56, memory_offset + patch_size);
+      patch32_add(target, optional_header + 4, patch_size - section_size);
+      patch32_add(target, optional_header + 8, patch_size - section_size);
+    } else {
+      patch_size = section_size;
+    }
 
-  // size of image
-  write32(target, optional_header + 56, memory_offset + patch_size);
+    // Undo the patches which will be replaced
+    manifest_restore(target, previous, &schedule);
+    manifest_set_original(&schedule, &previous->original);
 
-  // size of code
-  patch32_add(target, optional_header + 4, patch_size);
+  } else {
 
-  // size of intialized data
-  patch32_add(target, optional_header + 8, patch_size);
+    // Remember everything we change here, so it can be undone
+    uint32_t new_section_header = section_header + section_count * 40;
+    OriginalHeaders original;
+    original.file_size = image.size;
+    original.size_of_image = read32(target, optional_header + 56);
+    original.size_of_code = read32(target, optional_header + 4);
+    original.size_of_initialized_data = read32(target, optional_header + 8);
+    original.section_count = section_count;
+    readx(target, new_section_header, original.section_header, sizeof(original.section_header));
+    original.checksum = read32(target, optional_header + 64);
+    manifest_set_original(&schedule, &original);
+
+    // Get rough offset where we'll place our stuff
+    uint32_t file_offset = image.size;
+
+    // Align offset to safe bound
+    file_offset = (file_offset + 0xFFF) & ~0xFFF;
+
+    // Append section data by growing the file and the mapping in one step
+    image_resize(&image, file_offset + patch_size);
+
+    // Create data for new section
+    uint32_t characteristics = 0;
+    characteristics |= 0x20; // Code
+    characteristics |= 0x40; // Initialized Data
+    characteristics |= 0x20000000; // Executable
+    characteristics |= 0x40000000; // Readable
+    characteristics |= 0x80000000; // Writeable
+
+    // Append a new section
+    uint32_t size_of_headers = read32(target, optional_header + 60);
+    assert((new_section_header + 40) <= (image_base + size_of_headers));
+    write32(target, new_section_header + 0, *(uint32_t*)"hack");
+    write32(target, new_section_header + 4, 0x00000000);
+    write32(target, new_section_header + 8, patch_size);
+    write32(target, new_section_header + 12, memory_offset);
+    write32(target, new_section_header + 16, patch_size);
+    write32(target, new_section_header + 20, file_offset);
+    write32(target, new_section_header + 24, 0x00000000);
+    write32(target, new_section_header + 28, 0x00000000);
+    write32(target, new_section_header + 32, 0x00000000);
+    write32(target, new_section_header + 36, characteristics);
+
+    // Increment number of sections
+    patch16_add(target, coff_header + 2, 1);
+
+    // size of image
+    write32(target, optional_header + 56, memory_offset + patch_size);
+
+    // size of code
+    patch32_add(target, optional_header + 4, patch_size);
+
+    // size of intialized data
+    patch32_add(target, optional_header + 8, patch_size);
 
+  }
 
+  // Pick up the new or grown section
+  if (!image_parse(&image)) {
+    fprintf(stderr, "The patched headers of '%s' are invalid, aborting.\n", input_path);
+    schedule_free(&schedule);
+    if (previous != NULL) {
+      manifest_free(previous);
+    }
+    image_close(&image);
+    return 1;
+  }
 
   // Add image base
   memory_offset += image_base;
 
 #endif
 
-  patch(target, memory_offset);
+#ifdef LOADER
+  // Collect all writes, so we can submit them with few calls
+  Batch batch;
+  batch_init(&batch, target);
+  target = &batch.backend;
+  patch_target = target;
+#endif
+
+  Cave cave;
+  cave_init(&cave, memory_offset, patch_size);
+  patch(patch_target, &cave, &schedule, trace);
+  cave_free(&cave);
+  schedule_free(&schedule);
+  if (previous != NULL) {
+    manifest_free(previous);
+  }
+  print_network_guid(target);
 
 #ifdef LOADER
 
+  batch_flush(&batch);
+
   printf("Running the game\n");
   fflush(stdout);
-  ResumeThread(target.process_information.hThread);
+  ResumeThread(process.process_information.hThread);
 
 #else
 
-  fclose(target.f);
+  image_update_checksum(&image);
+
+  if (mode == PATCH_VERIFY) {
+    bool matches = verify_image(&image, input_path);
+    image_close(&image);
+    if (matches && (outdated == 0)) {
+      printf("'%s' is intact\n", input_path);
+      return 0;
+    }
+    return 1;
+  }
+
+#if USE_RESULT_CACHE
+  if (cacheable) {
+    result_cache_store(result_key, &image);
+  }
+#endif
+
+  if (!image_finish(&image, output_path, output_stream)) {
+    return 1;
+  }
 
 #endif
 
   return 0;
 }
 
+#ifndef LOADER
+
+// Patches many executables in place at once. Files are patched alone until
+// the textures have been converted, so that only happens once.
+#include <ctype.h>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+typedef struct {
+  char path[4096];
+  int status;
+  double seconds;
+} PatchJob;
+
+typedef struct {
+  PatchJob* jobs;
+  unsigned int count;
+  PatchMode mode;
+} PatchJobs;
+
+static void patch_jobs_add(PatchJobs* jobs, const char* path) {
+
+  // The same file must not be patched twice at once
+  for(unsigned int i = 0; i < jobs->count; i++) {
+    if (!strcmp(jobs->jobs[i].path, path)) {
+      return;
+    }
+  }
+
+  jobs->jobs = realloc(jobs->jobs, (jobs->count + 1) * sizeof(PatchJob));
+  PatchJob* job = &jobs->jobs[jobs->count++];
+  snprintf(job->path, sizeof(job->path), "%s", path);
+  job->status = 1;
+  job->seconds = 0.0;
+  return;
+}
+
+static bool is_directory(const char* path) {
+#ifdef _WIN32
+  DWORD attributes = GetFileAttributesA(path);
+  return (attributes != INVALID_FILE_ATTRIBUTES) && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+  struct stat st;
+  return (stat(path, &st) == 0) && S_ISDIR(st.st_mode);
+#endif
+}
+
+// Adds the game in a directory, and in each directory inside it
+static void patch_jobs_add_directory(PatchJobs* jobs, const char* path) {
+  char exe_path[4096 + 32];
+  snprintf(exe_path, sizeof(exe_path), "%s/swep1rcr.exe", path);
+  FILE* f = fopen(exe_path, "rb");
+  if (f != NULL) {
+    fclose(f);
+    patch_jobs_add(jobs, exe_path);
+  }
+
+  unsigned int first = jobs->count;
+#ifdef _WIN32
+  char pattern[4096 + 32];
+  snprintf(pattern, sizeof(pattern), "%s/*", path);
+  WIN32_FIND_DATAA entry;
+  HANDLE find = FindFirstFileA(pattern, &entry);
+  if (find != INVALID_HANDLE_VALUE) {
+    do {
+      const char* name = entry.cFileName;
+#else
+  DIR* directory = opendir(path);
+  if (directory != NULL) {
+    struct dirent* entry;
+    while((entry = readdir(directory)) != NULL) {
+      const char* name = entry->d_name;
+#endif
+      if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        continue;
+      }
+      snprintf(exe_path, sizeof(exe_path), "%s/%s/swep1rcr.exe", path, name);
+      f = fopen(exe_path, "rb");
+      if (f != NULL) {
+        fclose(f);
+        patch_jobs_add(jobs, exe_path);
+      }
+#ifdef _WIN32
+    } while(FindNextFileA(find, &entry));
+    FindClose(find);
+  }
+#else
+    }
+    closedir(directory);
+  }
+#endif
+
+  // Directory order is arbitrary, so sort for a stable summary
+  for(unsigned int i = first + 1; i < jobs->count; i++) {
+    for(unsigned int j = i; (j > first) && (strcmp(jobs->jobs[j - 1].path, jobs->jobs[j].path) > 0); j--) {
+      PatchJob swap = jobs->jobs[j - 1];
+      jobs->jobs[j - 1] = jobs->jobs[j];
+      jobs->jobs[j] = swap;
+    }
+  }
+  return;
+}
+
+// Arguments are directories, executables or lists with one path per line
+static void patch_jobs_collect(PatchJobs* jobs, const char* path, bool allow_list) {
+  size_t length = strlen(path);
+  bool is_exe = (length >= 4) && (path[length - 4] == '.') &&
+                (tolower(path[length - 3]) == 'e') &&
+                (tolower(path[length - 2]) == 'x') &&
+                (tolower(path[length - 1]) == 'e');
+  if (is_directory(path)) {
+    patch_jobs_add_directory(jobs, path);
+  } else if (is_exe) {
+    patch_jobs_add(jobs, path);
+  } else if (allow_list) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+      fprintf(stderr, "Unable to open '%s'\n", path);
+      return;
+    }
+    char line[4096];
+    while(fgets(line, sizeof(line), f) != NULL) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] != '\0') {
+        patch_jobs_collect(jobs, line, false);
+      }
+    }
+    fclose(f);
+  } else {
+    patch_jobs_add(jobs, path);
+  }
+  return;
+}
+
+static void run_patch_job(void* context, unsigned int index) {
+  PatchJob* job = &((PatchJobs*)context)->jobs[index];
+  double start = seconds_now();
+  job->status = patch_game(job->path, NULL, ((PatchJobs*)context)->mode, NULL);
+  job->seconds = seconds_now() - start;
+  return;
+}
+
+static int patch_many(int argc, char* argv[], PatchMode mode) {
+  PatchJobs jobs = { NULL, 0, mode };
+  for(int i = 0; i < argc; i++) {
+    patch_jobs_collect(&jobs, argv[i], true);
+  }
+  if (jobs.count == 0) {
+    fprintf(stderr, "No executables found\n");
+    return 1;
+  }
+  printf("%s %u files\n", (mode == PATCH_VERIFY) ? "Verifying" : "Patching", jobs.count);
+
+  // The log of each file would be interleaved, so only errors are shown.
+  // patch_game reports every failure on stderr and names the file in it.
+  fflush(stdout);
+#ifdef _WIN32
+  int saved_stdout = _dup(_fileno(stdout));
+  int null_fd = _open("NUL", _O_WRONLY);
+  _dup2(null_fd, _fileno(stdout));
+  _close(null_fd);
+#else
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+#endif
+
+  // The first file runs alone, so its textures are converted on all CPUs.
+  // The others mostly find them converted already.
+  double start = seconds_now();
+  run_patch_job(&jobs, 0);
+  PatchJobs rest = { &jobs.jobs[1], jobs.count - 1, mode };
+  parallel_for(rest.count, run_patch_job, &rest);
+  double seconds = seconds_now() - start;
+
+  fflush(stdout);
+#ifdef _WIN32
+  _dup2(saved_stdout, _fileno(stdout));
+  _close(saved_stdout);
+#else
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+#endif
+
+  unsigned int patched = 0;
+  for(unsigned int i = 0; i < jobs.count; i++) {
+    const PatchJob* job = &jobs.jobs[i];
+    printf("%-6s %7.3fs  %s\n", (job->status == 0) ? "ok" : "failed", job->seconds, job->path);
+    patched += (job->status == 0);
+  }
+  printf("%s %u of %u files in %.3fs\n", (mode == PATCH_VERIFY) ? "Verified" : "Patched", patched, jobs.count, seconds);
+  free(jobs.jobs);
+  return (patched == jobs.count) ? 0 : 1;
+}
+
+#endif
+
+int main(int argc, char* argv[]) {
+
+#if !defined(LOADER) && defined(__linux__)
+  if ((argc == 3) && !strcmp(argv[1], "--stand-in")) {
+    return stand_in(argv[2]);
+  }
+#endif
+
+#ifndef LOADER
+#if USE_RESULT_CACHE
+  patcher_path = argv[0];
+#endif
+  if ((argc == 5) && !strcmp(argv[1], "--diff")) {
+    return delta_export(argv[2], argv[3], argv[4]);
+  }
+  if ((argc == 5) && !strcmp(argv[1], "--apply")) {
+    return delta_apply(argv[2], argv[3], argv[4]);
+  }
+  if ((argc == 4) && !strcmp(argv[1], "--plan")) {
+    return plan_export(argv[2], argv[3]);
+  }
+  if ((argc >= 3) && !strcmp(argv[1], "--batch")) {
+    return patch_many(argc - 2, &argv[2], PATCH_APPLY);
+  }
+  if ((argc >= 3) && !strcmp(argv[1], "--verify")) {
+    return patch_many(argc - 2, &argv[2], PATCH_VERIFY);
+  }
+#endif
+
+#ifdef LOADER
+  return patch_game();
+#else
+  const char* program = argv[0];
+  bool undo = (argc >= 2) && !strcmp(argv[1], "--unpatch");
+  if (undo) {
+    argc--;
+    argv++;
+  }
+
+  // The trace is printed, or written as JSON if there is a path
+  bool tracing = !undo && (argc >= 2) && !strncmp(argv[1], "--trace", 7) && ((argv[1][7] == '\0') || (argv[1][7] == '='));
+  const char* trace_path = NULL;
+  if (tracing) {
+    trace_path = (argv[1][7] == '=') ? &argv[1][8] : NULL;
+    argc--;
+    argv++;
+  }
+  if ((argc != 2) && (argc != 3)) {
+    fprintf(stderr, "Usage: %s [--unpatch | --trace[=<trace.json>]] <swep1rcr.exe> [<output.exe>]\n"
+                    "Without an output, the input is patched in place.\n"
+                    "Use \"-\" to read from stdin or write to stdout.\n"
+                    "--unpatch restores the file as it was before patching.\n"
+                    "--trace shows time, accesses and cave use of each patch.\n"
+                    "       %s --diff <original.exe> <patched.exe> <delta.bps>\n"
+                    "       %s --apply <delta.bps> <original.exe> <output.exe>\n"
+                    "--diff writes a BPS delta, which --apply turns into the patched file again.\n"
+                    "       %s --plan <swep1rcr.exe> <swe1r.plan>\n"
+                    "--plan precomputes the patch for the dinput.dll loader.\n"
+                    "       %s --batch <directory | swep1rcr.exe | list.txt>...\n"
+                    "--batch patches many files in place at once.\n"
+                    "       %s --verify <directory | swep1rcr.exe | list.txt>...\n"
+                    "--verify checks that patched files are intact and up to date.\n", program, program, program, program, program, program);
+    return 1;
+  }
+  if (!tracing) {
+    return patch_game(argv[1], (argc == 3) ? argv[2] : NULL, undo ? PATCH_UNDO : PATCH_APPLY, NULL);
+  }
+
+  Trace trace;
+  memset(&trace, 0x00, sizeof(trace));
+  int status = patch_game(argv[1], (argc == 3) ? argv[2] : NULL, PATCH_APPLY, &trace);
+  if (trace_path == NULL) {
+    trace_print(&trace);
+  } else {
+    FILE* f = fopen(trace_path, "wb");
+    bool written = (f != NULL) && trace_write_json(&trace, f);
+    if ((f == NULL) || (fclose(f) != 0) || !written) {
+      fprintf(stderr, "Unable to write trace to '%s'\n", trace_path);
+      status = 1;
+    }
+  }
+  trace_free(&trace);
+  return status;
+#endif
+}
+
 #else
 
+// Applies a plan from --plan if there is one for this executable
+static bool plan_run(Target target, const char* path, uint32_t timestamp) {
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  DWORD size = GetFileSize(file, NULL);
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  const uint8_t* plan = (mapping != NULL) ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+
+  bool applied = false;
+  const PlanHeader* header = (plan != NULL) ? plan_check(plan, size, timestamp) : NULL;
+  if (header != NULL) {
+
+    // The patch only works at the address it was made for
+    void* cave_address = (void*)(uintptr_t)header->cave_address;
+    void* cave = VirtualAlloc(cave_address, header->cave_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+    if (cave == cave_address) {
+      plan_apply(target, plan);
+      applied = true;
+    } else if (cave != NULL) {
+      VirtualFree(cave, 0, MEM_RELEASE);
+    }
+  }
+
+  if (plan != NULL) {
+    UnmapViewOfFile(plan);
+  }
+  if (mapping != NULL) {
+    CloseHandle(mapping);
+  }
+  CloseHandle(file);
+  return applied;
+}
+
 BOOL WINAPI DllMain(
   HINSTANCE hinstDLL,
   DWORD fdwReason,
@@ -991,10 +6668,38 @@ HRESULT WINAPI DirectInputCreateA(uint32_t a, uint32_t b, uint32_t c, uint32_t d
   static HRESULT(WINAPI *o_DirectInputCreateA)(uint32_t, uint32_t, uint32_t, uint32_t) = NULL;
   if (o_DirectInputCreateA == NULL) {
 
-    Target target;
-    uint32_t memory_offset = (uintptr_t)VirtualAlloc(NULL, patch_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-   
-    patch(target, memory_offset);
+    static Backend memory = { .writex = memory_writex, .readx = memory_readx };
+    Target target = &memory;
+
+    uint32_t image_base = (uintptr_t)GetModuleHandle(NULL);
+    uint32_t coff_header = find_coff_header(target, image_base);
+    uint32_t timestamp = read32(target, coff_header + 4);
+
+    // Use the prepared patch if there is one, it's much quicker
+    if (!plan_run(target, "swe1r.plan", timestamp)) {
+
+      // Measure the patch as if it was placed after the image
+      static uint32_t addresses[ADDRESS_COUNT];
+      addresses_init(target, image_base, addresses);
+      uint32_t size_of_image = read32(target, coff_header + 20 + 56);
+      Schedule schedule;
+      uint32_t patch_size;
+      if (measure_patch(target, image_base + ((size_of_image + 0xFFF) & ~0xFFF), NULL, &schedule, &patch_size)) {
+
+        uint32_t memory_offset = (uintptr_t)VirtualAlloc(NULL, patch_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+
+        // Collect all writes, so we can submit them with few calls
+        Batch batch;
+        batch_init(&batch, target);
+
+        Cave cave;
+        cave_init(&cave, memory_offset, patch_size);
+        patch(&batch.backend, &cave, &schedule, NULL);
+        cave_free(&cave);
+        batch_flush(&batch);
+      }
+      schedule_free(&schedule);
+    }
 
     HMODULE dll = LoadLibrary("c:/windows/system32/dinput.dll");
     o_DirectInputCreateA = (void*)GetProcAddress(dll, "DirectInputCreateA");
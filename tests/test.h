@@ -0,0 +1,32 @@
+/*
+
+  Star Wars Episode 1: Racer - Patcher tests
+
+  Each test includes the patcher, so it can check its static functions
+  directly.
+
+*/
+
+#define main patcher_main
+#include "../main.c"
+#undef main
+
+static unsigned int test_failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      test_failures++; \
+    } \
+  } while(0)
+
+// Returns the exit code for the test
+static int test_result(const char* name) {
+  if (test_failures > 0) {
+    fprintf(stderr, "%s: %u checks failed\n", name, test_failures);
+    return 1;
+  }
+  printf("%s: all checks passed\n", name);
+  return 0;
+}
@@ -0,0 +1,137 @@
+// Checks that every address is found by its signature in one scan, in a
+// small game where all sites are somewhere else than in the known build
+
+#include "test.h"
+
+#define IMAGE_BASE 0x400000
+#define PE_HEADER 0x40
+#define COFF_HEADER (PE_HEADER + 4)
+#define OPTIONAL_HEADER (COFF_HEADER + 20)
+#define SECTION_HEADER (OPTIONAL_HEADER + 0xE0)
+#define TEXT 0x1000
+#define DATA 0x8000
+#define IMAGE_SIZE 0xC000
+
+static void put32(uint8_t* data, uint32_t value) {
+  memcpy(data, &value, 4);
+  return;
+}
+
+// Sections are at the same offset in the file and in memory, so the image
+// can be read like the loaded game
+static uint8_t* build_image(void) {
+  uint8_t* data = calloc(1, IMAGE_SIZE);
+  memcpy(data, "MZ", 2);
+  put32(&data[0x3C], PE_HEADER);
+  memcpy(&data[PE_HEADER], "PE\0\0", 4);
+  data[COFF_HEADER + 2] = 2;
+  data[COFF_HEADER + 16] = 0xE0;
+  put32(&data[OPTIONAL_HEADER + 28], IMAGE_BASE);
+  put32(&data[OPTIONAL_HEADER + 56], IMAGE_SIZE);
+
+  const uint32_t sections[2][3] = {
+    { TEXT, DATA - TEXT, 0x60000020 },
+    { DATA, IMAGE_SIZE - DATA, 0xC0000040 }
+  };
+  for(unsigned int i = 0; i < 2; i++) {
+    uint8_t* header = &data[SECTION_HEADER + i * 40];
+    memcpy(header, i ? ".data" : ".text", 5);
+    put32(&header[8], sections[i][1]);
+    put32(&header[12], sections[i][0]);
+    put32(&header[16], sections[i][1]);
+    put32(&header[20], sections[i][0]);
+    put32(&header[36], sections[i][2]);
+  }
+  memset(&data[TEXT], 0xCC, DATA - TEXT);
+  return data;
+}
+
+// Writes every signature match_count times, with all wildcards 0, and fills
+// in the operands which the addresses are taken from
+static void plant(Target target, uint32_t* expected) {
+  uint32_t sites[ADDRESS_COUNT][8];
+  uint32_t next = IMAGE_BASE + TEXT + 0x123;
+  for(unsigned int i = 0; i < ADDRESS_COUNT; i++) {
+    if (address_info[i].signature == NULL) {
+      continue;
+    }
+    unsigned int j;
+    for(j = 0; (address_info[j].signature == NULL) || strcmp(address_info[j].signature, address_info[i].signature); j++) {
+    }
+    if (j == i) {
+      Signature signature;
+      signature_compile(&signature, address_info[i].signature);
+      assert(address_info[i].match_count <= 8);
+      for(unsigned int k = 0; k < address_info[i].match_count; k++) {
+        sites[i][k] = next;
+        writex(target, next, signature.bytes, signature.size);
+        next += 0x80 + k * 3;
+      }
+    } else {
+      memcpy(sites[i], sites[j], sizeof(sites[i]));
+    }
+
+    uint32_t at = sites[i][address_info[i].match] + address_info[i].offset;
+    switch(address_info[i].resolve) {
+    case RESOLVE_MATCH:
+      expected[i] = at;
+      break;
+    case RESOLVE_POINTER:
+      expected[i] = IMAGE_BASE + DATA + i * 0x10;
+      write32(target, at, expected[i]);
+      break;
+    case RESOLVE_CALL:
+      expected[i] = IMAGE_BASE + TEXT + 0x6000 + i * 0x10;
+      write32(target, at + 1, expected[i] - (at + 5));
+      break;
+    }
+  }
+  return;
+}
+
+static bool check_addresses(const uint32_t* addresses, const uint32_t* expected) {
+  bool matches = true;
+  for(unsigned int i = 1; i < ADDRESS_COUNT; i++) {
+    if (addresses[i] != expected[i]) {
+      fprintf(stderr, "%s: 0x%08X, expected 0x%08X\n", address_info[i].name, addresses[i], expected[i]);
+      matches = false;
+    }
+  }
+  return matches;
+}
+
+static void test_resolve(void) {
+  uint8_t* data = build_image();
+  Memory memory;
+  memory_init(&memory, data, IMAGE_BASE, IMAGE_SIZE);
+  Target target = &memory.backend;
+  uint32_t expected[ADDRESS_COUNT] = { 0 };
+  plant(target, expected);
+
+  uint32_t addresses[ADDRESS_COUNT] = { 0 };
+  addresses_scan(target, IMAGE_BASE, find_coff_header(target, IMAGE_BASE), addresses);
+  CHECK(check_addresses(addresses, expected));
+
+  // None of them is where the known build has it
+  for(unsigned int i = 1; i < ADDRESS_COUNT; i++) {
+    CHECK(addresses[i] != address_info[i].known);
+  }
+
+  // A second collision check makes it ambiguous, so both addresses are lost
+  Signature signature;
+  signature_compile(&signature, address_info[ADDRESS_COLLISION_CALL].signature);
+  writex(target, IMAGE_BASE + TEXT + 0x5800, signature.bytes, signature.size);
+  expected[ADDRESS_COLLISION_CALL] = 0;
+  expected[ADDRESS_COLLISION_FUNCTION] = 0;
+  memset(addresses, 0x00, sizeof(addresses));
+  addresses_scan(target, IMAGE_BASE, find_coff_header(target, IMAGE_BASE), addresses);
+  CHECK(check_addresses(addresses, expected));
+
+  free(data);
+  return;
+}
+
+int main(void) {
+  test_resolve();
+  return test_result("addresses");
+}
@@ -0,0 +1,120 @@
+// Checks the assembler: branch encoding and short to long relaxation
+
+#include "test.h"
+
+#define ASM_BASE 0x1000
+
+// Assembles into a buffer at ASM_BASE and compares the result
+static void check_code(Assembler* a, const uint8_t* expected, size_t size) {
+  uint8_t code[512];
+  memset(code, 0xCC, sizeof(code));
+  Memory memory;
+  memory_init(&memory, code, ASM_BASE, sizeof(code));
+  uint32_t end = asm_commit(a, &memory.backend);
+  CHECK(end == ASM_BASE + size);
+  CHECK(!memcmp(code, expected, size));
+  asm_free(a);
+  return;
+}
+
+static void test_short_branches(void) {
+  Assembler a;
+  asm_init(&a, ASM_BASE);
+  int top = asm_here(&a);
+  int end = asm_label(&a);
+  asm_jmp_label(&a, end);
+  asm_jcc_label(&a, CC_Z, end);
+  asm_push(&a, REG_EAX);
+  asm_jcc_label(&a, CC_NZ, top);
+  asm_bind(&a, end);
+  asm_retn(&a);
+  static const uint8_t expected[] = {
+    0xEB, 0x05,       // jmp end
+    0x74, 0x03,       // jz end
+    0x50,             // push eax
+    0x75, 0xF9,       // jnz top
+    0xC3              // end: retn
+  };
+  check_code(&a, expected, sizeof(expected));
+  return;
+}
+
+static void test_absolute_branches(void) {
+  Assembler a;
+  asm_init(&a, ASM_BASE);
+  asm_jmp(&a, ASM_BASE + 0x10);
+  asm_call(&a, 0x2000);
+  asm_jcc(&a, CC_NZ, 0x400000);
+  static const uint8_t expected[] = {
+    0xEB, 0x0E,                         // jmp 0x1010
+    0xE8, 0xF9, 0x0F, 0x00, 0x00,       // call 0x2000
+    0x0F, 0x85, 0xF3, 0xEF, 0x3F, 0x00  // jnz 0x400000
+  };
+  check_code(&a, expected, sizeof(expected));
+  return;
+}
+
+// Promoting one branch moves the target of another out of reach, so that
+// one has to be promoted as well
+static void test_relaxation(void) {
+  Assembler a;
+  asm_init(&a, ASM_BASE);
+  int end = asm_label(&a);
+  int far = asm_label(&a);
+  asm_jcc_label(&a, CC_Z, end);
+  asm_jmp_label(&a, far);
+  uint8_t nops[200];
+  memset(nops, 0x90, sizeof(nops));
+  asm_bytes(&a, nops, 124);
+  asm_bind(&a, end);
+  asm_bytes(&a, nops, 200);
+  asm_bind(&a, far);
+  asm_retn(&a);
+
+  uint8_t expected[6 + 5 + 124 + 200 + 1];
+  static const uint8_t branches[] = {
+    0x0F, 0x84, 0x81, 0x00, 0x00, 0x00, // jz end (+129)
+    0xE9, 0x44, 0x01, 0x00, 0x00        // jmp far (+324)
+  };
+  memcpy(expected, branches, sizeof(branches));
+  memset(&expected[sizeof(branches)], 0x90, 124 + 200);
+  expected[sizeof(expected) - 1] = 0xC3;
+  check_code(&a, expected, sizeof(expected));
+  return;
+}
+
+// A short branch reaches exactly 127 bytes forward
+static void test_short_limit(void) {
+  uint8_t nops[128];
+  memset(nops, 0x90, sizeof(nops));
+  for(unsigned int distance = 127; distance <= 128; distance++) {
+    Assembler a;
+    asm_init(&a, ASM_BASE);
+    int end = asm_label(&a);
+    asm_jmp_label(&a, end);
+    asm_bytes(&a, nops, distance);
+    asm_bind(&a, end);
+
+    uint8_t code[512];
+    Memory memory;
+    memory_init(&memory, code, ASM_BASE, sizeof(code));
+    uint32_t size = asm_commit(&a, &memory.backend) - ASM_BASE;
+    asm_free(&a);
+    if (distance == 127) {
+      CHECK((size == 2 + 127) && (code[0] == 0xEB) && (code[1] == 0x7F));
+    } else {
+      uint32_t displacement;
+      memcpy(&displacement, &code[1], 4);
+      CHECK((size == 5 + 128) && (code[0] == 0xE9) && (displacement == 128));
+    }
+  }
+  return;
+}
+
+int main(void) {
+  test_short_branches();
+  test_absolute_branches();
+  test_relaxation();
+  test_short_limit();
+  return test_result("asm");
+}
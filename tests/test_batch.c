@@ -0,0 +1,93 @@
+// Checks that the batch backend merges writes into runs, with the original
+// bytes between them, and counts writes and runs
+
+#include "test.h"
+
+#define BATCH_BASE 0x10000
+
+// Remembers the runs which reach the parent
+typedef struct {
+  Memory memory;
+  unsigned int run_count;
+  WriteRun runs[16];
+} RunLog;
+
+static void run_log_writexv(Target target, const WriteRun* runs, size_t count) {
+  RunLog* log = (RunLog*)target;
+  for(size_t i = 0; i < count; i++) {
+    if (log->run_count < 16) {
+      log->runs[log->run_count] = runs[i];
+      log->runs[log->run_count].data = NULL;
+    }
+    log->run_count++;
+    writex(target, runs[i].offset, runs[i].data, runs[i].size);
+  }
+  return;
+}
+
+static void run_log_init(RunLog* log, uint8_t* data, size_t size) {
+  memset(log, 0x00, sizeof(RunLog));
+  memory_init(&log->memory, data, BATCH_BASE, size);
+  log->memory.backend.writexv = run_log_writexv;
+  return;
+}
+
+static void test_coalesce(void) {
+  static uint8_t data[0x4000];
+  static uint8_t expected[0x4000];
+  for(unsigned int i = 0; i < sizeof(data); i++) {
+    data[i] = i * 13;
+  }
+  memcpy(expected, data, sizeof(data));
+  RunLog log;
+  run_log_init(&log, data, sizeof(data));
+
+  Batch batch;
+  batch_init(&batch, &log.memory.backend);
+  Target target = &batch.backend;
+
+  // Adjacent, overlapping and with a gap, all in one page
+  write32(target, BATCH_BASE + 0x100, 0x11111111);
+  write32(target, BATCH_BASE + 0x104, 0x22222222);
+  write16(target, BATCH_BASE + 0x106, 0x3333);
+  write8(target, BATCH_BASE + 0x10A, 0x44);
+  uint32_t values[] = { 0x11111111, 0x33332222 };
+  memcpy(&expected[0x100], values, sizeof(values));
+  expected[0x10A] = 0x44;
+
+  // After an untouched page, across a page boundary, then the next page
+  uint8_t block[0x20];
+  memset(block, 0x55, sizeof(block));
+  writex(target, BATCH_BASE + 0x2FF0, block, sizeof(block));
+  write8(target, BATCH_BASE + 0x3800, 0x66);
+  memset(&expected[0x2FF0], 0x55, sizeof(block));
+  expected[0x3800] = 0x66;
+
+  // Pending writes are visible, the parent is untouched
+  CHECK(read16(target, BATCH_BASE + 0x106) == 0x3333);
+  CHECK(read8(target, BATCH_BASE + 0x10B) == data[0x10B]);
+  CHECK(data[0x100] == 0x00);
+
+  CHECK(batch.write_count == 6);
+  CHECK(batch.write_bytes == 4 + 4 + 2 + 1 + 0x20 + 1);
+  batch_flush(&batch);
+  CHECK(!memcmp(data, expected, sizeof(data)));
+
+  // One run for the first page, one for the two pages after the gap
+  CHECK(batch.issued_count == 2);
+  CHECK(batch.issued_bytes == (0x10B - 0x100) + (0x3801 - 0x2FF0));
+  CHECK(log.run_count == 2);
+  CHECK((log.runs[0].offset == BATCH_BASE + 0x100) && (log.runs[0].size == 0x0B));
+  CHECK((log.runs[1].offset == BATCH_BASE + 0x2FF0) && (log.runs[1].size == 0x811));
+
+  // Nothing is left to flush
+  batch_flush(&batch);
+  CHECK(log.run_count == 2);
+  CHECK(batch.issued_count == 2);
+  return;
+}
+
+int main(void) {
+  test_coalesce();
+  return test_result("batch");
+}
@@ -0,0 +1,176 @@
+// Checks BPS deltas: our own deltas must restore the target, and copies
+// which our deltas don't use must work like other tools write them
+
+#include "test.h"
+
+static uint8_t* random_bytes(size_t size, uint32_t seed) {
+  uint8_t* data = malloc(size);
+  for(size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = seed >> 24;
+  }
+  return data;
+}
+
+static FILE* file_with(const uint8_t* data, size_t size) {
+  FILE* f = tmpfile();
+  assert(f != NULL);
+  fwrite(data, 1, size, f);
+  rewind(f);
+  return f;
+}
+
+// Applies patch to source, returns true if the result is expected
+static bool apply_matches(FILE* patch, const uint8_t* source, size_t source_size, const uint8_t* expected, size_t expected_size) {
+  rewind(patch);
+  FILE* s = file_with(source, source_size);
+  FILE* t = tmpfile();
+  bool applied = bps_apply(patch, s, t);
+  bool matches = false;
+  if (applied) {
+    uint8_t* result = malloc(expected_size + 1);
+    rewind(t);
+    size_t size = fread(result, 1, expected_size + 1, t);
+    matches = (size == expected_size) && !memcmp(result, expected, expected_size);
+    free(result);
+  }
+  fclose(s);
+  fclose(t);
+  return matches;
+}
+
+static void test_round_trip(void) {
+  const size_t source_size = 0x30000;
+  const size_t target_size = 0x50000;
+  uint8_t* source_data = random_bytes(source_size, 1);
+  uint8_t* target_data = random_bytes(target_size, 2);
+
+  // Patched in place, a run of one byte, and a different tail
+  memcpy(target_data, source_data, source_size);
+  memset(&target_data[0x1000], 0x90, 0x20);
+  target_data[0x2000] ^= 0xFF;
+  memset(&target_data[0x8000], 0xCC, 0x18000);
+
+  Image source;
+  Image target;
+  memset(&source, 0x00, sizeof(source));
+  memset(&target, 0x00, sizeof(target));
+  source.data = source_data;
+  source.size = source_size;
+  target.data = target_data;
+  target.size = target_size;
+
+  FILE* patch = tmpfile();
+  CHECK(bps_diff(&source, &target, patch));
+  CHECK(apply_matches(patch, source_data, source_size, target_data, target_size));
+
+  // Nothing changed
+  FILE* same = tmpfile();
+  CHECK(bps_diff(&source, &source, same));
+  CHECK(apply_matches(same, source_data, source_size, source_data, source_size));
+  fclose(same);
+
+  // A different source, or one with extra bytes
+  uint8_t* other = random_bytes(source_size + 1, 3);
+  CHECK(!apply_matches(patch, other, source_size, target_data, target_size));
+  memcpy(other, source_data, source_size);
+  CHECK(!apply_matches(patch, other, source_size + 1, target_data, target_size));
+  CHECK(!apply_matches(patch, source_data, source_size - 1, target_data, target_size));
+  free(other);
+
+  // A damaged delta
+  fseek(patch, 0, SEEK_END);
+  long patch_size = ftell(patch);
+  uint8_t* data = malloc(patch_size);
+  rewind(patch);
+  CHECK(fread(data, 1, patch_size, patch) == (size_t)patch_size);
+  for(long offset = 4; offset < patch_size; offset += patch_size / 7) {
+    data[offset] ^= 0x01;
+    FILE* damaged = file_with(data, patch_size);
+    CHECK(!apply_matches(damaged, source_data, source_size, target_data, target_size));
+    fclose(damaged);
+    data[offset] ^= 0x01;
+  }
+  FILE* cut = file_with(data, patch_size - 1);
+  CHECK(!apply_matches(cut, source_data, source_size, target_data, target_size));
+  fclose(cut);
+  free(data);
+
+  fclose(patch);
+  free(source_data);
+  free(target_data);
+  return;
+}
+
+// Copies from anywhere in the source, and from the target both within the
+// window and further back than it
+static void test_copies(void) {
+  const size_t source_size = 0x100;
+  uint8_t* source_data = random_bytes(source_size, 4);
+  const size_t literal_size = BPS_BUFFER_SIZE + 0x100;
+  uint8_t* literal = random_bytes(literal_size, 5);
+
+  size_t target_size = 0x40 + 0x20 + literal_size + 0x80 + 0x30;
+  uint8_t* target_data = malloc(target_size);
+  size_t offset = 0;
+  memcpy(&target_data[offset], &source_data[0xC0], 0x40);
+  offset += 0x40;
+  memcpy(&target_data[offset], &source_data[0x10], 0x20);
+  offset += 0x20;
+  memcpy(&target_data[offset], literal, literal_size);
+  offset += literal_size;
+  memcpy(&target_data[offset], &target_data[0x10], 0x80);
+  offset += 0x80;
+  for(size_t i = 0; i < 0x30; i++) {
+    target_data[offset + i] = target_data[offset - 2 + (i % 2)];
+  }
+
+  FILE* patch = tmpfile();
+  BpsWriter writer = { patch, 0, 0, false };
+  bps_write(&writer, "BPS1", 4);
+  bps_write_number(&writer, source_size);
+  bps_write_number(&writer, target_size);
+  bps_write_number(&writer, 3);
+  bps_write(&writer, "abc", 3);
+
+  // Source copies are relative to the end of the previous one
+  bps_write_action(&writer, BPS_SOURCE_COPY, 0x40);
+  bps_write_number(&writer, 0xC0 << 1);
+  bps_write_action(&writer, BPS_SOURCE_COPY, 0x20);
+  bps_write_number(&writer, ((0x100 - 0x10) << 1) | 1);
+  bps_write_action(&writer, BPS_TARGET_READ, literal_size);
+  bps_write(&writer, literal, literal_size);
+
+  // Further back than the window, then overlapping its own output
+  bps_write_action(&writer, BPS_TARGET_COPY, 0x80);
+  bps_write_number(&writer, 0x10 << 1);
+  bps_write_action(&writer, BPS_TARGET_COPY, 0x30);
+  bps_write_number(&writer, (uint64_t)(offset - 2 - (0x10 + 0x80)) << 1);
+
+  uint32_t footer[2] = { crc32(source_data, source_size, 0), crc32(target_data, target_size, 0) };
+  bps_write(&writer, footer, sizeof(footer));
+  uint32_t patch_crc = writer.crc;
+  bps_write(&writer, &patch_crc, sizeof(patch_crc));
+  CHECK(!writer.failed);
+  CHECK(apply_matches(patch, source_data, source_size, target_data, target_size));
+
+  fclose(patch);
+  free(target_data);
+  free(literal);
+  free(source_data);
+  return;
+}
+
+// The check value of the CRC-32 catalogue, also split in two
+static void test_crc(void) {
+  CHECK(crc32("123456789", 9, 0) == 0xCBF43926);
+  CHECK(crc32("6789", 4, crc32("12345", 5, 0)) == 0xCBF43926);
+  return;
+}
+
+int main(void) {
+  test_crc();
+  test_round_trip();
+  test_copies();
+  return test_result("bps");
+}
@@ -0,0 +1,69 @@
+// Checks the PE checksum against a plain word by word version, for sizes
+// which end inside and outside of whole SIMD blocks
+
+#include "test.h"
+
+// Folds the carry after every word, like CheckSumMappedFile
+static uint32_t reference_checksum(const uint8_t* data, size_t size, size_t checksum_offset) {
+  uint32_t sum = 0;
+  for(size_t i = 0; i < size; i += 2) {
+    uint32_t word = data[i];
+    if (i + 1 < size) {
+      word |= data[i + 1] << 8;
+    }
+    if ((i >= checksum_offset) && (i < checksum_offset + 4)) {
+      word = 0;
+    }
+    sum += word;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return sum + (uint32_t)size;
+}
+
+static void test_vectors(void) {
+
+  // 1 + 2 words, the CheckSum field is ignored, plus the size
+  uint8_t small[8] = { 0x01, 0x00, 0x02, 0x00, 0xAA, 0xBB, 0xCC, 0xDD };
+  CHECK(pe_checksum(small, sizeof(small), 4) == 3 + 8);
+
+  // 0xFFFF + 0x0001 carries around
+  uint8_t carry[9] = { 0xFF, 0xFF, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02 };
+  CHECK(pe_checksum(carry, sizeof(carry), 4) == 0x0001 + 0x0002 + 9);
+  return;
+}
+
+static void test_sizes(void) {
+  const size_t sizes[] = { 4, 5, 15, 16, 17, 31, 33, 4096, 4097, 0x40000 - 2, 0x40000 + 2, 0x40000 * 2 + 13 };
+  const size_t max_size = 0x40000 * 2 + 13;
+  uint8_t* data = malloc(max_size);
+
+  // Random bytes, then all bits set which stresses the carries most
+  uint32_t state = 0x12345678;
+  for(size_t i = 0; i < max_size; i++) {
+    state = state * 1103515245 + 12345;
+    data[i] = state >> 24;
+  }
+  for(unsigned int pass = 0; pass < 2; pass++) {
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      size_t size = sizes[i];
+      size_t offsets[3] = { 0, ((size - 4) / 2) & ~1, (size - 4) & ~1 };
+      for(unsigned int j = 0; j < 3; j++) {
+        uint32_t expected = reference_checksum(data, size, offsets[j]);
+        uint32_t checksum = pe_checksum(data, size, offsets[j]);
+        if (checksum != expected) {
+          fprintf(stderr, "Size %zu, CheckSum at %zu: 0x%08X, expected 0x%08X\n", size, offsets[j], checksum, expected);
+        }
+        CHECK(checksum == expected);
+      }
+    }
+    memset(data, 0xFF, max_size);
+  }
+  free(data);
+  return;
+}
+
+int main(void) {
+  test_vectors();
+  test_sizes();
+  return test_result("checksum");
+}
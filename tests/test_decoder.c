@@ -0,0 +1,111 @@
+// Checks the instruction length decoder against lengths from a reference
+// disassembler
+
+#include "test.h"
+
+typedef struct {
+  const char* bytes;
+  unsigned int length;
+  unsigned int displacement_size;
+  unsigned int immediate_size;
+  bool is_relative;
+} DecoderVector;
+
+static const DecoderVector vectors[] = {
+  { "90", 1, 0, 0, false },                            // nop
+  { "55", 1, 0, 0, false },                            // push ebp
+  { "8B EC", 2, 0, 0, false },                         // mov ebp, esp
+  { "83 EC 10", 3, 0, 1, false },                      // sub esp, 0x10
+  { "81 EC 00 01 00 00", 6, 0, 4, false },             // sub esp, 0x100
+  { "8B 44 24 08", 4, 1, 0, false },                   // mov eax, [esp + 8]
+  { "8B 84 24 00 01 00 00", 7, 4, 0, false },          // mov eax, [esp + 0x100]
+  { "8B 04 85 00 10 40 00", 7, 4, 0, false },          // mov eax, [eax * 4 + 0x401000]
+  { "8B 45 FC", 3, 1, 0, false },                      // mov eax, [ebp - 4]
+  { "8D 4C 24 04", 4, 1, 0, false },                   // lea ecx, [esp + 4]
+  { "A1 2C 69 60 3C", 5, 4, 0, false },                // mov eax, [0x3C60692C]
+  { "66 A1 00 00 40 00", 6, 4, 0, false },             // mov ax, [0x400000]
+  { "64 A1 00 00 00 00", 6, 4, 0, false },             // mov eax, fs:[0]
+  { "C7 05 00 10 40 00 01 00 00 00", 10, 4, 4, false }, // mov dword [0x401000], 1
+  { "66 C7 05 00 10 40 00 01 00", 9, 4, 2, false },    // mov word [0x401000], 1
+  { "E8 00 00 00 00", 5, 0, 4, true },                 // call rel32
+  { "EB FE", 2, 0, 1, true },                          // jmp rel8
+  { "74 05", 2, 0, 1, true },                          // jz rel8
+  { "0F 84 00 01 00 00", 6, 0, 4, true },              // jz rel32
+  { "F6 05 00 10 40 00 01", 7, 4, 1, false },          // test byte [0x401000], 1
+  { "F7 D8", 2, 0, 0, false },                         // neg eax
+  { "F7 C0 01 00 00 00", 6, 0, 4, false },             // test eax, 1
+  { "C2 08 00", 3, 0, 2, false },                      // ret 8
+  { "C8 10 00 00", 4, 0, 3, false },                   // enter 0x10, 0
+  { "0F B6 45 08", 4, 1, 0, false },                   // movzx eax, byte [ebp + 8]
+  { "0F AF C1", 3, 0, 0, false },                      // imul eax, ecx
+  { "0F BA E0 03", 4, 0, 1, false },                   // bt eax, 3
+  { "6B C0 0C", 3, 0, 1, false },                      // imul eax, eax, 12
+  { "69 C0 00 01 00 00", 6, 0, 4, false },             // imul eax, eax, 0x100
+  { "D9 45 08", 3, 1, 0, false },                      // fld dword [ebp + 8]
+  { "DD 05 00 10 40 00", 6, 4, 0, false },             // fld qword [0x401000]
+  { "F3 A5", 2, 0, 0, false },                         // rep movsd
+  { "66 0F 3A 0F C1 08", 6, 0, 1, false },             // palignr xmm0, xmm1, 8
+  { "0F 38 00 C1", 4, 0, 0, false },                   // pshufb mm0, mm1
+  { "9A 00 00 00 00 08 00", 7, 0, 6, false },          // call far 0x8:0
+  { "FF 15 00 10 40 00", 6, 4, 0, false },             // call [0x401000]
+  { "67 8B 46 02", 4, 1, 0, false },                   // mov eax, [bp + 2]
+  { "67 8B 06 00 10", 5, 2, 0, false },                // mov eax, [0x1000]
+};
+
+static size_t parse_hex(const char* text, uint8_t* bytes) {
+  size_t size = 0;
+  unsigned int value;
+  int consumed;
+  while(sscanf(text, " %2X%n", &value, &consumed) == 1) {
+    bytes[size++] = value;
+    text += consumed;
+  }
+  return size;
+}
+
+static void test_lengths(void) {
+  for(unsigned int i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    const DecoderVector* vector = &vectors[i];
+    uint8_t code[16];
+    size_t size = parse_hex(vector->bytes, code);
+    CHECK(size == vector->length);
+
+    X86Instruction instruction;
+    bool decoded = x86_decode(code, size, &instruction);
+    if (!decoded) {
+      fprintf(stderr, "Unable to decode %s\n", vector->bytes);
+    }
+    CHECK(decoded);
+    CHECK(instruction.length == vector->length);
+    CHECK(instruction.displacement_size == vector->displacement_size);
+    CHECK(instruction.immediate_size == vector->immediate_size);
+    CHECK(instruction.is_relative == vector->is_relative);
+    CHECK(instruction.immediate_offset + instruction.immediate_size == instruction.length);
+
+    // Cut off instructions must not be decoded
+    CHECK(!x86_decode(code, size - 1, &instruction));
+  }
+  return;
+}
+
+// Decoding a sequence must find each instruction boundary
+static void test_sequence(void) {
+  uint8_t code[64];
+  size_t size = parse_hex("55 8B EC 83 EC 10 A1 2C 69 60 3C 0F 84 00 01 00 00 C3", code);
+  static const unsigned int boundaries[] = { 0, 1, 3, 6, 11, 17 };
+  size_t offset = 0;
+  for(unsigned int i = 0; i < sizeof(boundaries) / sizeof(boundaries[0]); i++) {
+    CHECK(offset == boundaries[i]);
+    X86Instruction instruction;
+    CHECK(x86_decode(&code[offset], size - offset, &instruction));
+    offset += instruction.length;
+  }
+  CHECK(offset == size);
+  return;
+}
+
+int main(void) {
+  test_lengths();
+  test_sequence();
+  return test_result("decoder");
+}
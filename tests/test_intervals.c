@@ -0,0 +1,169 @@
+// Checks the interval sets and how the schedule uses them to order patches
+// and to find patches which write the same bytes
+
+#include "test.h"
+
+// Compares a set with pairs of begin and end
+static bool check_set(const IntervalSet* set, const uint32_t* expected, size_t count) {
+  if (set->count != count) {
+    return false;
+  }
+  for(size_t i = 0; i < count; i++) {
+    if ((set->intervals[i].begin != expected[i * 2 + 0]) ||
+        (set->intervals[i].end != expected[i * 2 + 1])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_add(void) {
+  IntervalSet set = { NULL, 0, 0 };
+
+  // Out of order, stays sorted
+  interval_set_add(&set, 30, 40);
+  interval_set_add(&set, 10, 20);
+  interval_set_add(&set, 50, 60);
+  const uint32_t sorted[] = { 10, 20, 30, 40, 50, 60 };
+  CHECK(check_set(&set, sorted, 3));
+
+  // Touching ranges are merged
+  interval_set_add(&set, 20, 25);
+  const uint32_t touching[] = { 10, 25, 30, 40, 50, 60 };
+  CHECK(check_set(&set, touching, 3));
+
+  // A range which spans several others replaces them
+  interval_set_add(&set, 24, 55);
+  const uint32_t spanning[] = { 10, 60 };
+  CHECK(check_set(&set, spanning, 1));
+
+  // Contained ranges change nothing
+  interval_set_add(&set, 12, 14);
+  CHECK(check_set(&set, spanning, 1));
+  interval_set_free(&set);
+
+  // Growing past the initial capacity
+  for(uint32_t i = 0; i < 100; i++) {
+    interval_set_add(&set, 1000 - i * 10, 1000 - i * 10 + 5);
+  }
+  CHECK(set.count == 100);
+  bool ordered = true;
+  for(size_t i = 1; i < set.count; i++) {
+    ordered &= (set.intervals[i - 1].end < set.intervals[i].begin);
+  }
+  CHECK(ordered);
+  interval_set_free(&set);
+  CHECK((set.intervals == NULL) && (set.count == 0));
+  return;
+}
+
+static void test_intersect(void) {
+  IntervalSet a = { NULL, 0, 0 };
+  IntervalSet b = { NULL, 0, 0 };
+  IntervalSet out = { NULL, 0, 0 };
+  interval_set_add(&a, 0, 10);
+  interval_set_add(&a, 20, 30);
+  interval_set_add(&a, 40, 50);
+  interval_set_add(&b, 5, 25);
+  interval_set_add(&b, 30, 40);
+  interval_set_add(&b, 45, 100);
+
+  interval_set_intersect(&a, &b, &out);
+  const uint32_t expected[] = { 5, 10, 20, 25, 45, 50 };
+  CHECK(check_set(&out, expected, 3));
+  interval_set_free(&out);
+
+  // Ranges which only touch don't overlap
+  interval_set_intersect(&b, &a, &out);
+  CHECK(check_set(&out, expected, 3));
+  interval_set_free(&out);
+
+  IntervalSet empty = { NULL, 0, 0 };
+  interval_set_intersect(&a, &empty, &out);
+  CHECK(out.count == 0);
+  interval_set_free(&a);
+  interval_set_free(&b);
+  return;
+}
+
+static void test_recorder(void) {
+  uint8_t data[0x100] = { 0 };
+  Memory memory;
+  memory_init(&memory, data, 0x1000, sizeof(data));
+
+  IntervalSet reads = { NULL, 0, 0 };
+  IntervalSet writes = { NULL, 0, 0 };
+  Recorder recorder;
+  recorder_init(&recorder, &memory.backend, &reads, &writes);
+  Target target = &recorder.backend;
+
+  uint32_t value = 0x12345678;
+  write32(target, 0x1010, value);
+  write32(target, 0x1014, value);
+  CHECK(read32(target, 0x1080) == 0);
+  writex(target, 0x10F0, NULL, 0);
+
+  const uint32_t expected_writes[] = { 0x1010, 0x1018 };
+  const uint32_t expected_reads[] = { 0x1080, 0x1084 };
+  CHECK(check_set(&writes, expected_writes, 1));
+  CHECK(check_set(&reads, expected_reads, 1));
+  CHECK(!memcmp(&data[0x10], &value, 4));
+
+  // The hash depends on what was written
+  uint64_t hash = recorder.hash;
+  recorder_init(&recorder, &memory.backend, &reads, &writes);
+  write32(target, 0x1010, value + 1);
+  write32(target, 0x1014, value);
+  writex(target, 0x10F0, NULL, 0);
+  CHECK(recorder.hash != hash);
+
+  interval_set_free(&reads);
+  interval_set_free(&writes);
+  return;
+}
+
+static void test_schedule(void) {
+  if (PATCH_COUNT < 3) {
+    return;
+  }
+
+  Schedule* schedule = calloc(1, sizeof(Schedule));
+
+  // Independent patches share the first round
+  interval_set_add(&schedule->records[0].writes, 0x100, 0x110);
+  interval_set_add(&schedule->records[1].writes, 0x200, 0x210);
+  interval_set_add(&schedule->records[2].reads, 0x300, 0x310);
+  CHECK(schedule_build(schedule));
+  CHECK(schedule->round_count == 1);
+
+  // Reading what an earlier patch writes needs a later round
+  interval_set_add(&schedule->records[2].reads, 0x104, 0x108);
+  CHECK(schedule_build(schedule));
+  CHECK(schedule->records[2].round == 1);
+  CHECK(schedule->round_count == 2);
+
+  // So does writing what an earlier patch reads
+  interval_set_free(&schedule->records[2].reads);
+  interval_set_add(&schedule->records[1].reads, 0x400, 0x404);
+  interval_set_add(&schedule->records[2].writes, 0x402, 0x403);
+  CHECK(schedule_build(schedule));
+  CHECK(schedule->records[2].round == 1);
+
+  // Writing the same bytes is a conflict, but touching ranges aren't
+  interval_set_add(&schedule->records[1].writes, 0x110, 0x120);
+  CHECK(schedule_build(schedule));
+  interval_set_add(&schedule->records[1].writes, 0x10F, 0x110);
+  CHECK(!schedule_build(schedule));
+
+  schedule_free(schedule);
+  free(schedule);
+  return;
+}
+
+int main(void) {
+  test_add();
+  test_intersect();
+  test_recorder();
+  test_schedule();
+  return test_result("intervals");
+}
@@ -0,0 +1,65 @@
+// Checks that the SIMD versions of the 4 bpp packer give the same bytes as
+// the scalar one, including the tails which don't fill a whole vector
+
+#include "test.h"
+
+#define PACK_GUARD 0xA5
+
+// Packs with one implementation and checks that nothing past size is written
+static void pack_with(void (*pack)(uint8_t* out, const uint8_t* in, size_t size), uint8_t* out, const uint8_t* in, size_t size) {
+  memset(out, PACK_GUARD, size + 16);
+  pack(out, in, size);
+  bool intact = true;
+  for(size_t i = size; i < size + 16; i++) {
+    intact &= (out[i] == PACK_GUARD);
+  }
+  CHECK(intact);
+  return;
+}
+
+static void test_same_output(void) {
+  const size_t sizes[] = { 0, 1, 7, 15, 16, 17, 31, 32, 33, 47, 63, 64, 65, 255, 257, 1021 };
+  const size_t max_size = 1021;
+  uint8_t* in = malloc(max_size * 4);
+  uint8_t* expected = malloc(max_size + 16);
+  uint8_t* out = malloc(max_size + 16);
+
+  uint32_t state = 0x2468ACE0;
+  for(size_t i = 0; i < max_size * 4; i++) {
+    state = state * 1103515245 + 12345;
+    in[i] = state >> 24;
+  }
+
+  // One pixel by hand: gray 0xAB and 0x12 keep their top nibbles
+  uint8_t pixels[4] = { 0xAB, 0xFF, 0x12, 0x00 };
+  pack_4bpp_scalar(out, pixels, 1);
+  CHECK(out[0] == 0xA1);
+
+  for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t size = sizes[i];
+    pack_with(pack_4bpp_scalar, expected, in, size);
+    pack_with(pack_4bpp, out, in, size);
+    CHECK(!memcmp(out, expected, size));
+#if USE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+      pack_with(pack_4bpp_sse2, out, in, size);
+      CHECK(!memcmp(out, expected, size));
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      pack_with(pack_4bpp_avx2, out, in, size);
+      CHECK(!memcmp(out, expected, size));
+    }
+#endif
+  }
+
+  free(out);
+  free(expected);
+  free(in);
+  return;
+}
+
+int main(void) {
+  test_same_output();
+  return test_result("pack");
+}
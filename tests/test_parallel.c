@@ -0,0 +1,69 @@
+// Checks that parallel_for visits every index once, and that nested loops
+// stay on the thread which runs the outer index
+
+#include "test.h"
+
+#define OUTER_COUNT 16
+#define INNER_COUNT 64
+
+typedef struct {
+  atomic_uint visits[OUTER_COUNT * INNER_COUNT];
+#ifdef _WIN32
+  DWORD threads[OUTER_COUNT * INNER_COUNT];
+#else
+  pthread_t threads[OUTER_COUNT * INNER_COUNT];
+#endif
+  atomic_uint foreign;
+} Visits;
+
+typedef struct {
+  Visits* visits;
+  unsigned int outer;
+} Inner;
+
+#ifdef _WIN32
+#define current_thread() GetCurrentThreadId()
+#define same_thread(a, b) ((a) == (b))
+#else
+#define current_thread() pthread_self()
+#define same_thread(a, b) pthread_equal(a, b)
+#endif
+
+static void visit_inner(void* context, unsigned int index) {
+  Inner* inner = context;
+  unsigned int i = inner->outer * INNER_COUNT + index;
+  atomic_fetch_add(&inner->visits->visits[i], 1);
+  if (!same_thread(inner->visits->threads[inner->outer * INNER_COUNT], current_thread())) {
+    atomic_fetch_add(&inner->visits->foreign, 1);
+  }
+  return;
+}
+
+static void visit_outer(void* context, unsigned int index) {
+  Visits* visits = context;
+  visits->threads[index * INNER_COUNT] = current_thread();
+  Inner inner = { visits, index };
+  parallel_for(INNER_COUNT, visit_inner, &inner);
+  return;
+}
+
+static void test_nested(void) {
+  Visits* visits = calloc(1, sizeof(Visits));
+  parallel_for(OUTER_COUNT, visit_outer, visits);
+  bool once = true;
+  for(unsigned int i = 0; i < OUTER_COUNT * INNER_COUNT; i++) {
+    once &= (atomic_load(&visits->visits[i]) == 1);
+  }
+  CHECK(once);
+  CHECK(atomic_load(&visits->foreign) == 0);
+
+  // Outside of a loop, all threads are used again
+  CHECK(!parallel_nested);
+  free(visits);
+  return;
+}
+
+int main(void) {
+  test_nested();
+  return test_result("parallel");
+}
@@ -0,0 +1,209 @@
+// Checks the PNG decoder with zlib streams which use stored, fixed and
+// dynamic Huffman blocks, all row filters, and rows longer than the
+// Adler-32 NMAX
+
+#include "test.h"
+
+// Generated by zlib from rows using filter y % 5, with pixel values from
+// test_pixel
+static const uint8_t stored_8x5_ga[] = {
+  0x78, 0x01, 0x01, 0x55, 0x00, 0xAA, 0xFF, 0x00, 0x00, 0x40, 0x00, 0x40,
+  0x00, 0x40, 0x00, 0x40, 0x11, 0x51, 0x11, 0x51, 0x11, 0x51, 0x11, 0x51,
+  0x01, 0x05, 0x45, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x11, 0x11, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x05, 0x05, 0x05, 0x05, 0x05, 0x05,
+  0x05, 0x05, 0x05, 0x05, 0x05, 0x05, 0x05, 0x05, 0x05, 0x05, 0x03, 0x0A,
+  0x2A, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x0B, 0x0B, 0x03, 0x03, 0x03,
+  0x03, 0x03, 0x03, 0x04, 0x05, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x05, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF5, 0x50, 0x03, 0xD1,
+};
+
+static const uint8_t fixed_16x8_ga[] = {
+  0x78, 0xDA, 0x63, 0x60, 0x70, 0x80, 0x40, 0xC1, 0x40, 0x08, 0x54, 0x4A,
+  0x82, 0x40, 0xE3, 0x62, 0x08, 0x64, 0x64, 0x75, 0x65, 0x00, 0x03, 0x41,
+  0x41, 0xEC, 0x34, 0x13, 0x2B, 0x01, 0xC0, 0xCC, 0xA5, 0xC5, 0x0C, 0x06,
+  0xDC, 0xDC, 0xD8, 0x69, 0x16, 0x56, 0x56, 0x88, 0x51, 0xB8, 0x68, 0x06,
+  0xC9, 0x48, 0x08, 0xD4, 0xCA, 0x82, 0x40, 0xEB, 0x6A, 0x08, 0xF4, 0xE9,
+  0x81, 0x40, 0x46, 0xB9, 0x38, 0x0A, 0x1D, 0x09, 0x00, 0xE8, 0x79, 0x15,
+  0x46,
+};
+
+static const uint8_t dynamic_16x8_ga[] = {
+  0x78, 0x01, 0x85, 0xC1, 0x21, 0x16, 0xC3, 0x20, 0x14, 0x04, 0xC0, 0x4D,
+  0xE8, 0x37, 0x45, 0xAD, 0xC4, 0x54, 0x20, 0xB1, 0x91, 0x18, 0x4C, 0x1D,
+  0x06, 0x19, 0x53, 0x81, 0xC4, 0x22, 0xB9, 0x02, 0x87, 0xEE, 0x7B, 0xDB,
+  0x03, 0x74, 0x06, 0x28, 0x28, 0x28, 0x28, 0x6C, 0x6C, 0x6C, 0x6C, 0xB1,
+  0xC7, 0x1E, 0x7B, 0xEC, 0xD7, 0xBC, 0xE6, 0x35, 0xAF, 0x79, 0xD8, 0x1B,
+  0x42, 0x42, 0x48, 0x08, 0x09, 0x39, 0xED, 0x0F, 0xF7, 0x4C, 0x4E, 0xBC,
+  0x77, 0xE2, 0xBD, 0x13, 0xEF, 0x9D, 0x3C, 0xCC, 0x20, 0x66, 0x10, 0x33,
+  0x88, 0x19, 0x7E, 0xC2, 0x1D, 0xEE, 0x70, 0x87, 0x3B, 0x8D, 0x34, 0xD2,
+  0x48, 0x23, 0xAF, 0xBC, 0xF2, 0xCA, 0xAB, 0xEE, 0xBA, 0xEB, 0xAE, 0xFB,
+  0x78, 0x7D, 0x20, 0x24, 0x84, 0x84, 0x90, 0x90, 0xD3, 0xFE, 0xF8, 0x02,
+  0xE8, 0x79, 0x15, 0x46,
+};
+
+static const uint8_t fixed_24x16_rgb[] = {
+  0x78, 0xDA, 0x63, 0x60, 0x70, 0x68, 0x80, 0x23, 0xC1, 0xC0, 0x89, 0x70,
+  0xA4, 0x94, 0xB4, 0x08, 0x8E, 0x8C, 0x8B, 0x37, 0xC3, 0x91, 0x4B, 0xCB,
+  0x11, 0x38, 0x0A, 0x9D, 0x7A, 0x15, 0x8E, 0x18, 0x59, 0x5D, 0x5B, 0x19,
+  0x60, 0x40, 0x50, 0x50, 0x90, 0x6C, 0x36, 0x13, 0x2B, 0x95, 0x00, 0x33,
+  0x97, 0x96, 0x17, 0x33, 0x0C, 0x70, 0x73, 0x73, 0x93, 0xCD, 0x66, 0x01,
+  0x1A, 0x06, 0x77, 0x1E, 0x25, 0x6C, 0x06, 0xC9, 0xC8, 0x99, 0x70, 0xA4,
+  0x95, 0xB5, 0x0A, 0x8E, 0xAC, 0xAB, 0x77, 0xC3, 0x91, 0x4F, 0xCF, 0x19,
+  0x38, 0x8A, 0x9D, 0x7B, 0x17, 0x8E, 0xF2, 0xD6, 0xBD, 0x83, 0x23, 0x46,
+  0xB9, 0xB8, 0x79, 0x83, 0x2C, 0xB0, 0xC5, 0xCD, 0xC3, 0x07, 0x59, 0x60,
+  0x1B, 0x15, 0x6D, 0x82, 0x23, 0xE7, 0xE6, 0xC3, 0x70, 0x14, 0x32, 0xE5,
+  0x0A, 0x1C, 0xA5, 0x2E, 0x7D, 0x0A, 0x47, 0x65, 0xDB, 0xBE, 0xC1, 0x51,
+  0xFB, 0x71, 0x76, 0x38, 0x62, 0x34, 0x2F, 0xDF, 0x3E, 0xC8, 0x02, 0x5B,
+  0xD9, 0x39, 0x99, 0xC4, 0x00, 0xEE, 0xA6, 0x71, 0x60, 0x7B, 0x77, 0x9F,
+  0x86, 0xA3, 0x98, 0x39, 0x77, 0xE0, 0x28, 0x77, 0xED, 0x5B, 0x38, 0xAA,
+  0xDB, 0xF7, 0x0F, 0x8E, 0xFA, 0xCF, 0xF3, 0xC3, 0xD1, 0x82, 0x07, 0x0A,
+  0x70, 0x04, 0x00, 0x22, 0x9F, 0xA7, 0xF1,
+};
+
+static uint8_t test_pixel(unsigned int x, unsigned int y, unsigned int channel) {
+  return ((x >> 2) * 17 + y * 5 + channel * 64) & 0xFF;
+}
+
+static void put_be32(uint8_t* data, uint32_t value) {
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+  return;
+}
+
+static size_t png_chunk(uint8_t* out, const char* type, const uint8_t* data, size_t size) {
+  put_be32(&out[0], size);
+  memcpy(&out[4], type, 4);
+  if (size > 0) {
+    memcpy(&out[8], data, size);
+  }
+  put_be32(&out[8 + size], crc32(&out[4], 4 + size, 0));
+  return 12 + size;
+}
+
+// Wraps a zlib stream in a PNG, split across two IDAT chunks
+static uint8_t* png_wrap(unsigned int width, unsigned int height, unsigned int channels, const uint8_t* stream, size_t stream_size, size_t* size) {
+  static const uint8_t colors[5] = { 0, 0, 4, 2, 6 };
+  uint8_t* png = malloc(8 + 3 * 12 + 13 + stream_size + 12);
+  memcpy(png, "\x89PNG\r\n\x1A\n", 8);
+  size_t offset = 8;
+  uint8_t header[13] = { 0 };
+  put_be32(&header[0], width);
+  put_be32(&header[4], height);
+  header[8] = 8;
+  header[9] = colors[channels];
+  offset += png_chunk(&png[offset], "IHDR", header, sizeof(header));
+  offset += png_chunk(&png[offset], "IDAT", stream, stream_size / 2);
+  offset += png_chunk(&png[offset], "IDAT", &stream[stream_size / 2], stream_size - stream_size / 2);
+  offset += png_chunk(&png[offset], "IEND", NULL, 0);
+  *size = offset;
+  return png;
+}
+
+typedef struct {
+  unsigned int width;
+  unsigned int rows;
+  unsigned int mismatches;
+  uint8_t value; // Compared instead of test_pixel if not 0
+} PngCheck;
+
+static void check_row(void* context, unsigned int y, const uint8_t* pixels, unsigned int channels) {
+  PngCheck* check = context;
+  check->mismatches += (y != check->rows);
+  for(unsigned int x = 0; x < check->width; x++) {
+    for(unsigned int c = 0; c < channels; c++) {
+      uint8_t expected = (check->value != 0) ? check->value : test_pixel(x, y, c);
+      check->mismatches += (pixels[x * channels + c] != expected);
+    }
+  }
+  check->rows++;
+  return;
+}
+
+static bool decode(const uint8_t* stream, size_t stream_size, unsigned int width, unsigned int height, unsigned int channels, unsigned int expected_width, unsigned int expected_height) {
+  size_t size;
+  uint8_t* png = png_wrap(width, height, channels, stream, stream_size, &size);
+  PngCheck check = { width, 0, 0, 0 };
+  bool decoded = png_decode(png, size, expected_width, expected_height, check_row, &check);
+  free(png);
+  return decoded && (check.rows == height) && (check.mismatches == 0);
+}
+
+static void test_blocks(void) {
+  CHECK(decode(stored_8x5_ga, sizeof(stored_8x5_ga), 8, 5, 2, 8, 5));
+  CHECK(decode(fixed_16x8_ga, sizeof(fixed_16x8_ga), 16, 8, 2, 16, 8));
+  CHECK(decode(dynamic_16x8_ga, sizeof(dynamic_16x8_ga), 16, 8, 2, 16, 8));
+  CHECK(decode(fixed_24x16_rgb, sizeof(fixed_24x16_rgb), 24, 16, 3, 24, 16));
+  return;
+}
+
+static void test_damage(void) {
+  uint8_t stream[sizeof(dynamic_16x8_ga)];
+
+  // Wrong size
+  CHECK(!decode(fixed_16x8_ga, sizeof(fixed_16x8_ga), 16, 8, 2, 16, 16));
+
+  // Wrong Adler-32
+  memcpy(stream, dynamic_16x8_ga, sizeof(stream));
+  stream[sizeof(stream) - 1] ^= 0x01;
+  CHECK(!decode(stream, sizeof(stream), 16, 8, 2, 16, 8));
+
+  // Cut off
+  CHECK(!decode(dynamic_16x8_ga, sizeof(dynamic_16x8_ga) - 8, 16, 8, 2, 16, 8));
+
+  // NLEN which isn't the complement of LEN
+  memcpy(stream, stored_8x5_ga, sizeof(stored_8x5_ga));
+  stream[5] ^= 0x01;
+  CHECK(!decode(stream, sizeof(stored_8x5_ga), 8, 5, 2, 8, 5));
+  return;
+}
+
+// Rows of 0xFF longer than 5552 bytes overflow unreduced Adler-32 sums
+static void test_wide_rows(void) {
+  const unsigned int width = 6000;
+  const unsigned int height = 2;
+  size_t row_size = 1 + width * 4;
+  size_t raw_size = row_size * height;
+  uint8_t* raw = malloc(raw_size);
+  memset(raw, 0xFF, raw_size);
+  for(unsigned int y = 0; y < height; y++) {
+    raw[y * row_size] = 0;
+  }
+
+  // A zlib stream of a single stored block
+  uint32_t a = 1;
+  uint32_t b = 0;
+  for(size_t i = 0; i < raw_size; i++) {
+    a = (a + raw[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  size_t stream_size = 2 + 5 + raw_size + 4;
+  uint8_t* stream = malloc(stream_size);
+  stream[0] = 0x78;
+  stream[1] = 0x01;
+  stream[2] = 0x01;
+  stream[3] = raw_size & 0xFF;
+  stream[4] = raw_size >> 8;
+  stream[5] = ~stream[3];
+  stream[6] = ~stream[4];
+  memcpy(&stream[7], raw, raw_size);
+  put_be32(&stream[7 + raw_size], (b << 16) | a);
+
+  size_t size;
+  uint8_t* png = png_wrap(width, height, 4, stream, stream_size, &size);
+  PngCheck check = { width, 0, 0, 0xFF };
+  CHECK(png_decode(png, size, width, height, check_row, &check));
+  CHECK((check.rows == height) && (check.mismatches == 0));
+  free(png);
+  free(stream);
+  free(raw);
+  return;
+}
+
+int main(void) {
+  test_blocks();
+  test_damage();
+  test_wide_rows();
+  return test_result("png");
+}
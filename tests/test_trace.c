@@ -0,0 +1,29 @@
+// Checks that --trace writes valid JSON for any span name
+
+#include "test.h"
+
+static void test_json_names(void) {
+  TraceSpan spans[2];
+  memset(spans, 0x00, sizeof(spans));
+  snprintf(spans[0].name, sizeof(spans[0].name), "a \"b\" c\\d");
+  snprintf(spans[1].name, sizeof(spans[1].name), "tab\there");
+  spans[1].depth = 1;
+  Trace trace = { spans, 2 };
+
+  FILE* f = tmpfile();
+  CHECK(trace_write_json(&trace, f));
+  char json[1024];
+  rewind(f);
+  size_t size = fread(json, 1, sizeof(json) - 1, f);
+  json[size] = '\0';
+  fclose(f);
+
+  CHECK(strstr(json, "\"name\": \"a \\\"b\\\" c\\\\d\", \"depth\": 0") != NULL);
+  CHECK(strstr(json, "\"name\": \"tab\\u0009here\", \"depth\": 1") != NULL);
+  return;
+}
+
+int main(void) {
+  test_json_names();
+  return test_result("trace");
+}
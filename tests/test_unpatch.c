@@ -0,0 +1,242 @@
+// Checks that undoing a patch gives back the original file byte for byte.
+// The patch is laid out like patch_game does it, with a journal from
+// manifest_build, on a small executable with one code section.
+
+#include "test.h"
+
+#define IMAGE_BASE 0x400000
+#define PE_HEADER 0x40
+#define COFF_HEADER (PE_HEADER + 4)
+#define OPTIONAL_HEADER (COFF_HEADER + 20)
+#define SECTION_HEADER (OPTIONAL_HEADER + 0xE0)
+#define FILE_SIZE 0x400
+
+static void put16(uint8_t* data, uint16_t value) {
+  memcpy(data, &value, 2);
+  return;
+}
+
+static void put32(uint8_t* data, uint32_t value) {
+  memcpy(data, &value, 4);
+  return;
+}
+
+// Same as image_load, but from memory
+static void image_from(Image* image, const uint8_t* data, size_t size) {
+  memset(image, 0x00, sizeof(Image));
+  image->backend.writex = image_writex;
+  image->backend.readx = image_readx;
+  image->backend.concurrent = true;
+  image->buffered = true;
+  image->data = malloc(size);
+  memcpy(image->data, data, size);
+  image->size = size;
+  return;
+}
+
+static uint8_t* build_original(void) {
+  uint8_t* data = calloc(1, FILE_SIZE);
+  memcpy(data, "MZ", 2);
+  put32(&data[0x3C], PE_HEADER);
+  memcpy(&data[PE_HEADER], "PE\0\0", 4);
+  put16(&data[COFF_HEADER + 0], 0x14C);
+  put16(&data[COFF_HEADER + 2], 1);
+  put32(&data[COFF_HEADER + 4], 0x12345678);
+  put16(&data[COFF_HEADER + 16], 0xE0);
+  put16(&data[OPTIONAL_HEADER + 0], 0x10B);
+  put32(&data[OPTIONAL_HEADER + 4], 0x200);
+  put32(&data[OPTIONAL_HEADER + 8], 0x100);
+  put32(&data[OPTIONAL_HEADER + 28], IMAGE_BASE);
+  put32(&data[OPTIONAL_HEADER + 56], 0x2000);
+  put32(&data[OPTIONAL_HEADER + 60], 0x200);
+  put32(&data[OPTIONAL_HEADER + 64], 0xCAFE);
+
+  memcpy(&data[SECTION_HEADER + 0], ".text", 5);
+  put32(&data[SECTION_HEADER + 8], 0x200);
+  put32(&data[SECTION_HEADER + 12], 0x1000);
+  put32(&data[SECTION_HEADER + 16], 0x200);
+  put32(&data[SECTION_HEADER + 20], 0x200);
+  put32(&data[SECTION_HEADER + 36], 0x60000020);
+  for(unsigned int i = 0; i < 0x200; i++) {
+    data[0x200 + i] = i * 7;
+  }
+  return data;
+}
+
+// Patches the game bytes in writes[] and appends a section with the journal,
+// like patch_game and patch do
+static void apply_fake_patch(Image* image, const uint32_t (*writes)[2], unsigned int write_count) {
+  Target target = &image->backend;
+  uint32_t memory_offset = 0x2000;
+  uint32_t file_offset = 0x1000;
+  uint32_t patch_size = 0x1000;
+
+  Schedule* schedule = calloc(1, sizeof(Schedule));
+  for(unsigned int i = 0; i < write_count; i++) {
+    interval_set_add(&schedule->records[i % PATCH_COUNT].writes, writes[i][0], writes[i][1]);
+  }
+  manifest_build(schedule, target, IMAGE_BASE + memory_offset);
+
+  uint32_t new_section_header = IMAGE_BASE + SECTION_HEADER + 40;
+  OriginalHeaders original;
+  original.file_size = image->size;
+  original.size_of_image = read32(target, IMAGE_BASE + OPTIONAL_HEADER + 56);
+  original.size_of_code = read32(target, IMAGE_BASE + OPTIONAL_HEADER + 4);
+  original.size_of_initialized_data = read32(target, IMAGE_BASE + OPTIONAL_HEADER + 8);
+  original.section_count = 1;
+  readx(target, new_section_header, original.section_header, sizeof(original.section_header));
+  original.checksum = read32(target, IMAGE_BASE + OPTIONAL_HEADER + 64);
+  manifest_set_original(schedule, &original);
+
+  image_resize(image, file_offset + patch_size);
+  write32(target, new_section_header + 0, *(uint32_t*)"hack");
+  write32(target, new_section_header + 4, 0x00000000);
+  write32(target, new_section_header + 8, patch_size);
+  write32(target, new_section_header + 12, memory_offset);
+  write32(target, new_section_header + 16, patch_size);
+  write32(target, new_section_header + 20, file_offset);
+  write32(target, new_section_header + 36, 0xE0000060);
+  patch16_add(target, IMAGE_BASE + COFF_HEADER + 2, 1);
+  write32(target, IMAGE_BASE + OPTIONAL_HEADER + 56, memory_offset + patch_size);
+  patch32_add(target, IMAGE_BASE + OPTIONAL_HEADER + 4, patch_size);
+  patch32_add(target, IMAGE_BASE + OPTIONAL_HEADER + 8, patch_size);
+  CHECK(image_parse(image));
+
+  for(unsigned int i = 0; i < write_count; i++) {
+    uint32_t size = writes[i][1] - writes[i][0];
+    uint8_t code[size];
+    memset(code, 0x90, size);
+    writex(target, writes[i][0], code, size);
+  }
+
+  SectionHeader header;
+  memcpy(header.magic, MANIFEST_MAGIC, 8);
+  header.manifest_offset = sizeof(SectionHeader);
+  header.manifest_size = schedule->manifest_size;
+  writex(target, IMAGE_BASE + memory_offset, &header, sizeof(header));
+  writex(target, IMAGE_BASE + memory_offset + header.manifest_offset, schedule->manifest, schedule->manifest_size);
+  image_update_checksum(image);
+
+  schedule_free(schedule);
+  free(schedule);
+  return;
+}
+
+static void test_round_trip(void) {
+  uint8_t* original = build_original();
+  Image image;
+  image_from(&image, original, FILE_SIZE);
+  CHECK(image_parse(&image));
+
+  const uint32_t writes[][2] = {
+    { IMAGE_BASE + 0x1010, IMAGE_BASE + 0x1015 },
+    { IMAGE_BASE + 0x1100, IMAGE_BASE + 0x1101 },
+    { IMAGE_BASE + 0x11F0, IMAGE_BASE + 0x1200 },
+    { IMAGE_BASE + 0x1020, IMAGE_BASE + 0x1030 }
+  };
+  apply_fake_patch(&image, writes, sizeof(writes) / sizeof(writes[0]));
+  CHECK(image.size == 0x2000);
+  CHECK(image.data[0x210] == 0x90);
+  CHECK(read32(&image.backend, IMAGE_BASE + OPTIONAL_HEADER + 64) != 0xCAFE);
+
+  CHECK(unpatch(&image, IMAGE_BASE, IMAGE_BASE + COFF_HEADER));
+  CHECK(image.size == FILE_SIZE);
+  CHECK(!memcmp(image.data, original, FILE_SIZE));
+
+  // Twice doesn't work
+  CHECK(!unpatch(&image, IMAGE_BASE, IMAGE_BASE + COFF_HEADER));
+  CHECK(!memcmp(image.data, original, FILE_SIZE));
+  image_close(&image);
+  free(original);
+  return;
+}
+
+static void test_damaged(void) {
+  uint8_t* original = build_original();
+  Image image;
+  image_from(&image, original, FILE_SIZE);
+  CHECK(image_parse(&image));
+  const uint32_t writes[][2] = { { IMAGE_BASE + 0x1010, IMAGE_BASE + 0x1015 } };
+  apply_fake_patch(&image, writes, 1);
+
+  // A manifest which claims more than the section holds is refused
+  uint8_t* patched = malloc(image.size);
+  memcpy(patched, image.data, image.size);
+  write32(&image.backend, IMAGE_BASE + 0x2000 + offsetof(SectionHeader, manifest_size), 0x2000);
+  CHECK(!unpatch(&image, IMAGE_BASE, IMAGE_BASE + COFF_HEADER));
+  memcpy(image.data, patched, image.size);
+
+  // So is a journal which doesn't add up
+  uint32_t manifest = IMAGE_BASE + 0x2000 + sizeof(SectionHeader);
+  write32(&image.backend, manifest + offsetof(ManifestHeader, journal_size), 3);
+  CHECK(!unpatch(&image, IMAGE_BASE, IMAGE_BASE + COFF_HEADER));
+  memcpy(image.data, patched, image.size);
+
+  CHECK(unpatch(&image, IMAGE_BASE, IMAGE_BASE + COFF_HEADER));
+  CHECK(!memcmp(image.data, original, FILE_SIZE));
+  free(patched);
+  image_close(&image);
+  free(original);
+  return;
+}
+
+// Records which overlap give the same bytes when updating a patch, reading
+// the original game, and unpatching: those from before the first write
+static void test_overlap(void) {
+  uint8_t* original = build_original();
+  Image image;
+  image_from(&image, original, FILE_SIZE);
+  CHECK(image_parse(&image));
+  const uint32_t writes[][2] = {
+    { IMAGE_BASE + 0x1010, IMAGE_BASE + 0x1018 },
+    { IMAGE_BASE + 0x1100, IMAGE_BASE + 0x1108 }
+  };
+  apply_fake_patch(&image, writes, 2);
+
+  // Make the second record cover the first, holding what the first wrote
+  uint32_t manifest = IMAGE_BASE + 0x2000 + sizeof(SectionHeader);
+  uint32_t journal = manifest + sizeof(ManifestHeader) + PATCH_COUNT * sizeof(ManifestEntry);
+  uint32_t second = journal + read32(&image.backend, manifest + sizeof(ManifestHeader) + sizeof(ManifestEntry) + offsetof(ManifestEntry, journal_offset));
+  uint8_t written[8];
+  memset(written, 0x90, sizeof(written));
+  write32(&image.backend, second, IMAGE_BASE + 0x1010);
+  writex(&image.backend, second + 8, written, sizeof(written));
+  image_update_checksum(&image);
+
+  Manifest loaded;
+  CHECK(manifest_load(&image.backend, IMAGE_BASE + 0x2000, 0x1000, &loaded));
+  CHECK(loaded.record_count == 2);
+
+  Original game;
+  original_init(&game, &image.backend, &loaded);
+  uint8_t bytes[8];
+  readx(&game.backend, IMAGE_BASE + 0x1010, bytes, sizeof(bytes));
+  CHECK(!memcmp(bytes, &original[0x210], sizeof(bytes)));
+
+  // Every patch is written again, so everything is restored
+  uint8_t* copy = malloc(image.size);
+  memcpy(copy, image.data, image.size);
+  Schedule* schedule = calloc(1, sizeof(Schedule));
+  for(unsigned int i = 0; i < PATCH_COUNT; i++) {
+    schedule->records[i].apply = true;
+  }
+  manifest_restore(&image.backend, &loaded, schedule);
+  CHECK(!memcmp(&image.data[0x210], &original[0x210], 8));
+  free(schedule);
+  manifest_free(&loaded);
+
+  memcpy(image.data, copy, image.size);
+  free(copy);
+  CHECK(unpatch(&image, IMAGE_BASE, IMAGE_BASE + COFF_HEADER));
+  CHECK(!memcmp(&image.data[0x210], &original[0x210], 8));
+  image_close(&image);
+  free(original);
+  return;
+}
+
+int main(void) {
+  test_round_trip();
+  test_damaged();
+  test_overlap();
+  return test_result("unpatch");
+}